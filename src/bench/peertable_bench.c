@@ -0,0 +1,288 @@
+// Compares the peer lookups and snapshot diffs on wg_peer lists with the
+// keymap index and peertable that replaced them, on synthetic devices.
+//
+// usage: peertable_bench [peers...] (default: 1000 10000 100000)
+//
+// The list diff is quadratic, so it only walks the new list for a sample of
+// the old peers and is scaled up to the whole device.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wireguard.h"
+
+#include "keymap.h"
+#include "mem.h"
+#include "net.h"
+#include "peertable.h"
+#include "wgutil.h"
+
+#define NQUERIES 1024
+#define DIFF_SAMPLE 1000 // old peers the list diff is run for
+#define CHANGED_PERCENT 1
+#define MIN_DURATION 200000000 // ns, an operation is repeated at least this long
+
+typedef struct {
+    size_t npeers;
+    wg_device *old_device;
+    wg_device *new_device; // the same peers, some with a changed endpoint
+    wg_key *queries;       // keys of random peers
+    keymap_t index;
+    peertable_t old_table;
+    peertable_t new_table;
+    size_t sink; // keeps the results alive
+} bench_ctx;
+
+// returns the number of operations done, a fraction of one if only sampled
+typedef double (*bench_fn)(bench_ctx *ctx);
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+// splitmix64, so every run uses the same devices
+static uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+
+    return z ^ (z >> 31);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void random_endpoint(wg_endpoint *endpoint) {
+    const uint64_t value = rng_next();
+
+    memset(endpoint, 0, sizeof(*endpoint));
+
+    endpoint->addr4.sin_family = AF_INET;
+    endpoint->addr4.sin_addr.s_addr = (uint32_t)value;
+    endpoint->addr4.sin_port = (uint16_t)(value >> 32);
+}
+
+static void add_peer(wg_device *device, const wg_key key, const wg_endpoint *endpoint) {
+    wg_peer *peer = mem_zalloc(sizeof(wg_peer));
+
+    peer->flags = WGPEER_HAS_PUBLIC_KEY;
+    memcpy(peer->public_key, key, sizeof(wg_key));
+    peer->endpoint = *endpoint;
+
+    if (device->last_peer)
+        device->last_peer->next_peer = peer;
+    else
+        device->first_peer = peer;
+
+    device->last_peer = peer;
+}
+
+static void bench_init(bench_ctx *ctx, size_t npeers) {
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->npeers = npeers;
+    ctx->old_device = mem_zalloc(sizeof(wg_device));
+    ctx->new_device = mem_zalloc(sizeof(wg_device));
+
+    wg_key *keys = mem_alloc(npeers * sizeof(wg_key));
+
+    for (size_t i = 0; i < npeers; i++) {
+        for (size_t j = 0; j < sizeof(wg_key); j += sizeof(uint64_t)) {
+            const uint64_t value = rng_next();
+
+            memcpy(keys[i] + j, &value, sizeof(value));
+        }
+
+        wg_endpoint endpoint;
+
+        random_endpoint(&endpoint);
+        add_peer(ctx->old_device, keys[i], &endpoint);
+
+        if (rng_next() % 100 < CHANGED_PERCENT)
+            random_endpoint(&endpoint);
+
+        add_peer(ctx->new_device, keys[i], &endpoint);
+    }
+
+    ctx->queries = mem_alloc(NQUERIES * sizeof(wg_key));
+
+    for (size_t i = 0; i < NQUERIES; i++)
+        memcpy(ctx->queries[i], keys[rng_next() % npeers], sizeof(wg_key));
+
+    free(keys);
+
+    keymap_init(&ctx->index);
+    peertable_init(&ctx->old_table);
+    peertable_init(&ctx->new_table);
+}
+
+static void bench_free(bench_ctx *ctx) {
+    wg_free_device(ctx->old_device);
+    wg_free_device(ctx->new_device);
+    free(ctx->queries);
+    keymap_free(&ctx->index);
+    peertable_free(&ctx->old_table);
+    peertable_free(&ctx->new_table);
+}
+
+static void build_table(peertable_t *table, const wg_device *device) {
+    wg_peer *peer;
+
+    table->size = 0;
+
+    wg_for_each_peer(device, peer) {
+        peertable_append(table, peer->public_key, &peer->endpoint);
+    }
+
+    peertable_sort(table);
+}
+
+// what handle_endpoint_info_request() did before the index
+static double lookup_list(bench_ctx *ctx) {
+    for (size_t i = 0; i < NQUERIES; i++) {
+        wg_peer *peer;
+
+        wg_for_each_peer(ctx->old_device, peer) {
+            if (wgutil_key_matches(peer->public_key, ctx->queries[i]))
+                ctx->sink++;
+        }
+    }
+
+    return NQUERIES;
+}
+
+static double build_index(bench_ctx *ctx) {
+    wg_peer *peer;
+
+    keymap_clear(&ctx->index);
+
+    wg_for_each_peer(ctx->old_device, peer) {
+        keymap_put(&ctx->index, peer->public_key, peer);
+    }
+
+    return 1;
+}
+
+static double lookup_index(bench_ctx *ctx) {
+    for (size_t i = 0; i < NQUERIES; i++)
+        ctx->sink += keymap_get(&ctx->index, ctx->queries[i]) != NULL;
+
+    return NQUERIES;
+}
+
+static double build_tables(bench_ctx *ctx) {
+    build_table(&ctx->old_table, ctx->old_device);
+    build_table(&ctx->new_table, ctx->new_device);
+
+    return 1;
+}
+
+static double lookup_table(bench_ctx *ctx) {
+    for (size_t i = 0; i < NQUERIES; i++)
+        ctx->sink += peertable_find(&ctx->old_table, ctx->queries[i]) != PEERTABLE_NONE;
+
+    return NQUERIES;
+}
+
+// what check_endpoint_details() did before the linear diff
+static double diff_list(bench_ctx *ctx) {
+    wg_peer *p1, *p2;
+    size_t sampled = 0;
+
+    for (p1 = ctx->old_device->first_peer; p1 && sampled < DIFF_SAMPLE; p1 = p1->next_peer, sampled++) {
+        wg_for_each_peer(ctx->new_device, p2) {
+            if (!wgutil_key_matches(p1->public_key, p2->public_key))
+                continue;
+
+            if (net_addr_and_port_matches(&p1->endpoint.addr4, &p2->endpoint.addr4))
+                continue;
+
+            ctx->sink++;
+        }
+    }
+
+    return (double)sampled / ctx->npeers;
+}
+
+static void count_change(size_t old_index, size_t new_index, void *data) {
+    bench_ctx *ctx = data;
+
+    (void)old_index;
+    (void)new_index;
+
+    ctx->sink++;
+}
+
+static double diff_table(bench_ctx *ctx) {
+    peertable_compare(&ctx->old_table, &ctx->new_table, count_change, ctx);
+
+    return 1;
+}
+
+static void run(bench_ctx *ctx, size_t npeers, const char *name, bench_fn fn) {
+    const uint64_t start = now_ns();
+    uint64_t elapsed;
+    double ops = 0;
+
+    do {
+        ops += fn(ctx);
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_DURATION);
+
+    printf("%-8zu %-14s %16.1f\n", npeers, name, (double)elapsed / ops);
+    fflush(stdout);
+}
+
+static void bench(size_t npeers) {
+    bench_ctx ctx;
+
+    bench_init(&ctx, npeers);
+
+    run(&ctx, npeers, "lookup list", lookup_list);
+    run(&ctx, npeers, "build index", build_index);
+    run(&ctx, npeers, "lookup index", lookup_index);
+    run(&ctx, npeers, "build tables", build_tables);
+    run(&ctx, npeers, "lookup table", lookup_table);
+    run(&ctx, npeers, "diff list", diff_list);
+    run(&ctx, npeers, "diff table", diff_table);
+
+    // a lookup that never matched would be suspicious
+    if (!ctx.sink)
+        fprintf(stderr, "no peer was found.\n");
+
+    bench_free(&ctx);
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t default_sizes[] = {1000, 10000, 100000};
+
+    printf("%-8s %-14s %16s\n", "peers", "operation", "ns/op");
+
+    if (argc < 2) {
+        for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]); i++)
+            bench(default_sizes[i]);
+
+        return EXIT_SUCCESS;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        char *end;
+        const unsigned long npeers = strtoul(argv[i], &end, 10);
+
+        if (*end || !npeers) {
+            fprintf(stderr, "invalid peer count: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        bench(npeers);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -9,6 +9,7 @@
 #include "log.h"
 #include "mem.h"
 #include "net.h"
+#include "batch.h"
 
 #define DEFAULT_BIND_PORT 59912
 
@@ -23,9 +24,10 @@ const char *Usage =
     "  -w, --public-key <key>                public key of WireGuard device\n"
     "  -P, --peer       <peer,endpoint>      peer's default endpoint\n"
     "  -b, --bind-port  <port>               forwarding bind port\n"
-    "  -f, --forward    <port,peer,endpoint> forward peer's traffic\n";
+    "  -f, --forward    <port,peer,endpoint> forward peer's traffic\n"
+    "  -c, --coalesce   <ms>                 endpoint update coalescing window\n";
 
-const char *c_short_opts = "hvi:P:w:b:f:p:";
+const char *c_short_opts = "hvi:P:w:b:f:p:c:";
 
 const struct option c_long_options[] = {
     {"help", no_argument, NULL, 'h'},
@@ -36,6 +38,7 @@ const struct option c_long_options[] = {
     {"bind-port", required_argument, NULL, 'b'},
     {"forward", required_argument, NULL, 'f'},
     {"port", required_argument, NULL, 'p'},
+    {"coalesce", required_argument, NULL, 'c'},
     {}
 };
 
@@ -52,7 +55,8 @@ args_t args_get_defaults() {
         .public_key = NULL,
         .bind_port = DEFAULT_BIND_PORT,
         .fwds = NULL,
-        .nfwds = 0
+        .nfwds = 0,
+        .coalesce = BATCH_DEFAULT_WINDOW
     };
 
     return args;
@@ -170,6 +174,9 @@ int args_parse(int argc, char *argv[], args_t *args) {
             case 'p':
                 args->port = atoi(optarg);
                 break;
+            case 'c':
+                args->coalesce = atoi(optarg);
+                break;
         }
     }
 
@@ -22,6 +22,7 @@ typedef struct {
     int bind_port;
     args_fwd_t *fwds;
     int nfwds;
+    int coalesce;
 } args_t;
 
 args_t args_get_defaults();
@@ -0,0 +1,64 @@
+#include "batch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+// the index stores entry positions offset by one, as keymap values can't be NULL
+static wg_peer_endpoint *find_entry(batch_t *batch, const wg_key public_key) {
+    const uintptr_t pos = (uintptr_t)keymap_get(&batch->index, public_key);
+
+    return pos ? &batch->entries[pos - 1] : NULL;
+}
+
+void batch_init(batch_t *batch) {
+    batch->entries = NULL;
+    batch->nentries = 0;
+    batch->cap = 0;
+
+    keymap_init(&batch->index);
+}
+
+void batch_add(batch_t *batch, const wg_key public_key, const wg_endpoint *endpoint) {
+    wg_peer_endpoint *entry = find_entry(batch, public_key);
+
+    if (entry) {
+        entry->endpoint = *endpoint;
+        return;
+    }
+
+    if (batch->nentries == batch->cap) {
+        batch->cap = batch->cap ? batch->cap * 2 : 64;
+        batch->entries = mem_realloc(batch->entries, batch->cap * sizeof(wg_peer_endpoint));
+    }
+
+    entry = &batch->entries[batch->nentries++];
+
+    memcpy(entry->public_key, public_key, sizeof(wg_key));
+    entry->endpoint = *endpoint;
+
+    keymap_put(&batch->index, public_key, (void *)(uintptr_t)batch->nentries);
+}
+
+const wg_endpoint *batch_find(batch_t *batch, const wg_key public_key) {
+    const wg_peer_endpoint *entry = find_entry(batch, public_key);
+
+    return entry ? &entry->endpoint : NULL;
+}
+
+void batch_clear(batch_t *batch) {
+    batch->nentries = 0;
+
+    keymap_clear(&batch->index);
+}
+
+void batch_free(batch_t *batch) {
+    free(batch->entries);
+    keymap_free(&batch->index);
+
+    batch->entries = NULL;
+    batch->nentries = 0;
+    batch->cap = 0;
+}
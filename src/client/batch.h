@@ -0,0 +1,30 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wireguard.h"
+
+#include "keymap.h"
+
+#define BATCH_DEFAULT_WINDOW 10 // ms
+
+// Endpoint updates waiting to be applied to the kernel. Only the latest
+// endpoint of each peer is kept; the caller applies them all once the window
+// since the first one passed.
+
+typedef struct {
+    wg_peer_endpoint *entries;
+    size_t nentries;
+    size_t cap;
+    keymap_t index;
+} batch_t;
+
+void batch_init(batch_t *batch);
+void batch_add(batch_t *batch, const wg_key public_key, const wg_endpoint *endpoint);
+const wg_endpoint *batch_find(batch_t *batch, const wg_key public_key);
+void batch_clear(batch_t *batch);
+void batch_free(batch_t *batch);
+
+#endif
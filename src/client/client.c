@@ -6,6 +6,7 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
@@ -17,6 +18,7 @@
 #include "net.h"
 #include "packets.h"
 #include "socket.h"
+#include "wirebuf.h"
 
 client_t *client_new() {
     return mem_zalloc(sizeof(client_t));
@@ -32,15 +34,12 @@ int client_init(client_t *client) {
     return 0;
 }
 
-void client_setup_poll(client_t *client, struct pollfd *fd) {
-    fd->fd = client->fd;
-    fd->events = POLLIN | POLLOUT;
-    fd->revents = 0;
-}
-
 int client_connect(client_t *client, const char *host, unsigned short port) {
     client->connect_failed = false;
     client->last_conn = time(NULL);
+    client->max_frame_size = 0;
+
+    socket_buffer_reset(&client->rx);
 
     struct sockaddr_in addr;
 
@@ -65,59 +64,101 @@ int client_connect(client_t *client, const char *host, unsigned short port) {
     return 0;
 }
 
+static void client_lost(client_t *client) {
+    LOG(ERROR, "lost connection to server.");
+    client->connect_failed = true;
+    client->connected = false;
+}
+
+// Queues the packet behind whatever the socket didn't take yet and sends as
+// much as it takes now. A frame is never cut short, the rest of it goes out
+// once the socket is writable again, see client_flush().
 int client_send_packet(client_t *client, packet_t *packet) {
     if (!client)
         return -1;
 
-    const int ret = socket_send_packet(client->fd, packet);
+    wirebuf_t *buf = wirebuf_from_packet(packet);
 
-    if (ret == SOCK_DISCONNECTED) {
-        LOG(ERROR, "lost connection to server.");
-        client->connect_failed = true;
-        client->connected = false;
-    }
+    socket_queue_push(&client->tx, buf);
+    wirebuf_unref(buf);
 
-    return ret;
+    return client_flush(client);
 }
 
-int client_read_packet(client_t *client, packet_t **packet) {
-    if (!client || !packet)
+int client_flush(client_t *client) {
+    if (!client)
         return -1;
 
-    const int ret = socket_read_packet(client->fd, &client->packet);
+    const int ret = socket_queue_flush(client->fd, &client->tx);
 
-    if (ret != SOCK_OK) {
-        if (ret == SOCK_DISCONNECTED) {
-            LOG(ERROR, "lost connection to server.");
-            client->connect_failed = true;
-            client->connected = false;
-        }
+    if (ret == SOCK_DISCONNECTED || ret == SOCK_ERROR) {
+        client_lost(client);
+        return -1;
+    }
 
+    // the server doesn't read anymore, or far too slowly
+    if (client->tx.size > CLIENT_MAX_QUEUE) {
+        LOG(ERROR, "more than %d bytes queued for the server.", CLIENT_MAX_QUEUE);
+        client_lost(client);
         return -1;
     }
 
-    *packet = &client->packet;
+    return 0;
+}
+
+// Whether data is queued, the socket has to be watched for EPOLLOUT then.
+bool client_pending(const client_t *client) {
+    return client->tx.count != 0;
+}
+
+int client_receive(client_t *client) {
+    if (!client)
+        return -1;
+
+    const int ret = socket_fill(client->fd, &client->rx);
+
+    if (ret == SOCK_DISCONNECTED || ret == SOCK_ERROR) {
+        client_lost(client);
+        return -1;
+    }
 
     return 0;
 }
 
-int client_check_poll(client_t *client, struct pollfd *fd) {
-    if (fd->revents & POLLHUP || fd->revents & POLLERR) {
+int client_read_packet(client_t *client, packet_t **packet) {
+    if (!client || !packet)
+        return -1;
+
+    const int ret = socket_next_packet(&client->rx, packet);
+
+    if (ret == SOCK_ERROR) {
+        // the stream can't be resynchronised after a malformed frame
+        LOG(ERROR, "malformed packet from server, reconnecting.");
+        client->connect_failed = true;
+        client->connected = false;
+    }
+
+    return ret == SOCK_OK ? 0 : -1;
+}
+
+// Handles the events epoll reported for the socket, watched for EPOLLOUT too
+// while connecting and while data is queued.
+int client_check_events(client_t *client, uint32_t events) {
+    if (events & (EPOLLHUP | EPOLLERR)) {
         client->connect_failed = true;
         client->connected = false;
 
         return CLIENT_ERROR;
     }
 
-    if (!client->connected && fd->revents & POLLOUT) {
-        fd->events &= ~POLLOUT;
-        fd->revents &= ~POLLOUT;
-
+    if (!client->connected && events & EPOLLOUT) {
         int err;
         socklen_t err_size = sizeof(err);
 
         if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &err_size) == -1) {
             LOG(ERROR, "getsockopt() failed: %s", strerror(errno));
+            client->connect_failed = true;
+
             return CLIENT_ERROR;
         }
 
@@ -125,7 +166,7 @@ int client_check_poll(client_t *client, struct pollfd *fd) {
             if (err == EINPROGRESS)
                 return CLIENT_OK;
 
-            LOG(ERROR, "connect() failed: %s", strerror(errno));
+            LOG(ERROR, "connect() failed: %s", strerror(err));
 
             client->connect_failed = true;
 
@@ -139,10 +180,11 @@ int client_check_poll(client_t *client, struct pollfd *fd) {
         return CLIENT_CONNECTED;
     }
 
-    if (fd->revents & POLLIN) {
-        fd->revents &= ~POLLIN;
+    if (client->connected && events & EPOLLOUT && client_flush(client) == -1)
+        return CLIENT_ERROR;
+
+    if (events & EPOLLIN)
         return CLIENT_RECEIVED_PACKET;
-    }
 
     return CLIENT_OK;
 }
@@ -150,6 +192,9 @@ int client_check_poll(client_t *client, struct pollfd *fd) {
 void client_close(client_t *client) {
     close(client->fd);
 
+    // the frames queued were meant for this connection
+    socket_queue_free(&client->tx);
+
     client->connected = false;
     client->fd = -1;
 }
@@ -158,5 +203,7 @@ void client_free(client_t *client) {
     if (!client)
         return;
 
+    socket_buffer_free(&client->rx);
+    socket_queue_free(&client->tx);
     free(client);
 }
@@ -3,31 +3,37 @@
 
 #include <stdbool.h>
 #include <stddef.h>
-#include <poll.h>
 #include <time.h>
 
 #include "packets.h"
+#include "socket.h"
 
 #define CLIENT_OK 0
 #define CLIENT_ERROR -1
 #define CLIENT_CONNECTED 1
 #define CLIENT_RECEIVED_PACKET 2
 
+#define CLIENT_MAX_QUEUE (16 * 1024 * 1024) // bytes waiting for the socket before giving up
+
 typedef struct {
     int fd;
     time_t last_conn;
     bool connect_failed;
     bool connected;
-    packet_t packet;
+    uint32_t max_frame_size; // 0 until the server answered PACKET_TYPE_HELLO
+    socket_buffer rx;
+    socket_queue tx; // what the socket didn't take yet, flushed on EPOLLOUT
 } client_t;
 
 client_t *client_new();
 int client_init(client_t *client);
-void client_setup_poll(client_t *client, struct pollfd *fd);
 int client_connect(client_t *client, const char *host, unsigned short port);
 int client_send_packet(client_t *client, packet_t *packet);
+int client_flush(client_t *client);
+bool client_pending(const client_t *client);
+int client_receive(client_t *client);
 int client_read_packet(client_t *client, packet_t **packet);
-int client_check_poll(client_t *client, struct pollfd *fd);
+int client_check_events(client_t *client, uint32_t events);
 void client_close(client_t *client);
 void client_free(client_t *client);
 
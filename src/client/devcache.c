@@ -0,0 +1,165 @@
+#include "devcache.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "log.h"
+
+static void set_endpoint(peertable_t *peers, const wg_peer_endpoint *entry) {
+    const size_t i = peertable_find(peers, entry->public_key);
+
+    if (i != PEERTABLE_NONE)
+        peers->endpoints[i] = entry->endpoint;
+}
+
+static void swap_tables(devcache_t *cache) {
+    peertable_t peers = cache->peers;
+
+    cache->peers = cache->scratch;
+    cache->scratch = peers;
+
+    // the dump may have read these peers before they were set
+    for (size_t i = 0; i < cache->written.nentries; i++)
+        set_endpoint(&cache->peers, &cache->written.entries[i]);
+
+    batch_clear(&cache->written);
+
+    cache->refreshed = time(NULL);
+    cache->valid = !cache->stale;
+}
+
+static void start_refresh(devcache_t *cache) {
+    if (peertable_dump_start(&cache->scratch, cache->wg, cache->name, NULL) < 0) {
+        LOG(ERROR, "failed to get device %s: %s.", cache->name, strerror(errno));
+        return;
+    }
+
+    cache->refreshing = true;
+    cache->stale = false;
+
+    // a new dump sees everything set so far
+    batch_clear(&cache->written);
+}
+
+bool devcache_init(devcache_t *cache, const char *name) {
+    cache->valid = false;
+    cache->refreshing = false;
+    cache->stale = false;
+
+    strncpy(cache->name, name, sizeof(cache->name) - 1);
+    cache->name[sizeof(cache->name) - 1] = '\0';
+
+    peertable_init(&cache->peers);
+    peertable_init(&cache->scratch);
+    batch_init(&cache->written);
+
+    if (!(cache->wg = wg_ctx_new()))
+        return false;
+
+    wg_device device;
+
+    // nothing can be done without the peers, so wait for them this once
+    if (peertable_dump(&cache->scratch, cache->wg, cache->name, &device) < 0) {
+        LOG(ERROR, "failed to get device %s: %s.", cache->name, strerror(errno));
+        return false;
+    }
+
+    memcpy(cache->public_key, device.public_key, sizeof(wg_key));
+
+    swap_tables(cache);
+
+    return true;
+}
+
+const peertable_t *devcache_get(devcache_t *cache) {
+    if (!cache->refreshing && (!cache->valid || time(NULL) - cache->refreshed >= DEVCACHE_REFRESH_INTERVAL))
+        start_refresh(cache);
+
+    // keep serving the stale copy until the dump is done
+    return &cache->peers;
+}
+
+wg_endpoint *devcache_find_endpoint(devcache_t *cache, const wg_key key) {
+    const peertable_t *peers = devcache_get(cache);
+    const size_t i = peertable_find(peers, key);
+
+    return i != PEERTABLE_NONE ? &cache->peers.endpoints[i] : NULL;
+}
+
+// The fd to poll for reading while a dump is in progress, -1 otherwise.
+int devcache_fd(devcache_t *cache) {
+    if (!cache->refreshing)
+        return -1;
+
+    const int fd = wg_ctx_fd(cache->wg);
+
+    if (fd < 0) {
+        LOG(ERROR, "failed to get netlink socket: %s.", strerror(-fd));
+        return -1;
+    }
+
+    return fd;
+}
+
+// Changes whenever the fd devcache_fd() returned was closed, a later one may
+// have the same number.
+unsigned devcache_generation(devcache_t *cache) {
+    return wg_ctx_generation(cache->wg);
+}
+
+void devcache_handle_readable(devcache_t *cache) {
+    if (!cache->refreshing)
+        return;
+
+    const int ret = peertable_dump_step(&cache->scratch, cache->wg);
+
+    if (ret > 0)
+        return;
+
+    cache->refreshing = false;
+
+    if (ret == -EINTR) {
+        // the peers changed during the dump
+        start_refresh(cache);
+        return;
+    }
+
+    if (ret < 0) {
+        LOG(ERROR, "failed to get device %s: %s.", cache->name, strerror(-ret));
+        return;
+    }
+
+    swap_tables(cache);
+
+    LOG(DEBUG, "device cache refreshed, %zu peers", cache->peers.size);
+}
+
+// Records endpoints just set on the device, so the cache doesn't have to be
+// dumped again to know them.
+void devcache_set_endpoints(devcache_t *cache, const wg_peer_endpoint *entries, size_t nentries) {
+    for (size_t i = 0; i < nentries; i++) {
+        set_endpoint(&cache->peers, &entries[i]);
+
+        if (cache->refreshing)
+            batch_add(&cache->written, entries[i].public_key, &entries[i].endpoint);
+    }
+}
+
+void devcache_invalidate(devcache_t *cache) {
+    cache->valid = false;
+
+    // the dump in progress might predate whatever made the cache invalid
+    if (cache->refreshing)
+        cache->stale = true;
+}
+
+void devcache_free(devcache_t *cache) {
+    wg_ctx_free(cache->wg);
+    peertable_free(&cache->peers);
+    peertable_free(&cache->scratch);
+    batch_free(&cache->written);
+
+    cache->wg = NULL;
+    cache->valid = false;
+    cache->refreshing = false;
+}
@@ -0,0 +1,44 @@
+#ifndef DEVCACHE_H
+#define DEVCACHE_H
+
+#include <net/if.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "wireguard.h"
+
+#include "batch.h"
+#include "peertable.h"
+
+#define DEVCACHE_REFRESH_INTERVAL 30 // s
+
+// Cached table of the wireguard device's peers. The first dump is done right
+// away; after that, the cache is dumped again in the background once it is
+// older than the refresh interval or after it has been invalidated, and keeps
+// serving the old table until the new one is complete. The dump is driven by
+// polling devcache_fd() and calling devcache_handle_readable().
+
+typedef struct {
+    wg_ctx *wg; // only used for dumps, so they can't block endpoint updates
+    char name[IFNAMSIZ];
+    wg_key public_key;
+    peertable_t peers;
+    peertable_t scratch; // filled by a dump, swapped with peers on success
+    batch_t written; // endpoints set during the dump, which may predate them
+    time_t refreshed;
+    bool valid;
+    bool refreshing;
+    bool stale; // invalidated while refreshing
+} devcache_t;
+
+bool devcache_init(devcache_t *cache, const char *name);
+const peertable_t *devcache_get(devcache_t *cache);
+wg_endpoint *devcache_find_endpoint(devcache_t *cache, const wg_key key);
+int devcache_fd(devcache_t *cache);
+unsigned devcache_generation(devcache_t *cache);
+void devcache_handle_readable(devcache_t *cache);
+void devcache_set_endpoints(devcache_t *cache, const wg_peer_endpoint *entries, size_t nentries);
+void devcache_invalidate(devcache_t *cache);
+void devcache_free(devcache_t *cache);
+
+#endif
@@ -77,7 +77,7 @@ bool fwd_add(fwd_t *fwd, int i_fwd, const char *peer_key, const char *endpoint,
     return true;
 }
 
-void fwd_set_endpoint(fwd_t *fwd, int i_fwd, struct sockaddr_in *addr) {
+void fwd_set_endpoint(fwd_t *fwd, int i_fwd, const struct sockaddr_in *addr) {
     struct fwd *entry = &fwd->fwds[i_fwd];
 
     if (net_addr_and_port_matches(&entry->curr_endpoint, addr))
@@ -98,18 +98,6 @@ void fwd_set_endpoint(fwd_t *fwd, int i_fwd, struct sockaddr_in *addr) {
     entry->curr_endpoint = *addr;
 }
 
-void fwd_setup_poll_connect(fwd_t *fwd, int i_fwd, struct pollfd *fd) {
-    fd->fd = fwd->fwds[i_fwd].connect_sock_fd;
-    fd->events = POLLIN;
-    fd->revents = 0;
-}
-
-void fwd_setup_poll_listen(fwd_t *fwd, int i_fwd, struct pollfd *fd) {
-    fd->fd = fwd->fwds[i_fwd].listen_sock_fd;
-    fd->events = POLLIN;
-    fd->revents = 0;
-}
-
 static void clear_pipe(int pipe_fds[2]) {
     struct pollfd pfd = {
         .fd = pipe_fds[0],
@@ -141,57 +129,55 @@ static bool forward_packet(fwd_t *fwd, int fd_recv, int fd_send) {
     return true;
 }
 
-bool fwd_check_poll_connect(fwd_t *fwd, int i_fwd, struct pollfd *fd) {
-    if (fd->revents & POLLIN) {
-        fd->revents &= ~POLLIN;
-
-        struct fwd *entry = &fwd->fwds[i_fwd];
-
-        if (!entry->listener_connected)
-            return true;
+// Called when the socket connected to the peer is readable.
+bool fwd_handle_connect(fwd_t *fwd, int i_fwd) {
+    struct fwd *entry = &fwd->fwds[i_fwd];
 
-        if (!forward_packet(fwd, entry->connect_sock_fd, entry->listen_sock_fd)) {
-            struct sockaddr_in addr = {
-                .sin_family = AF_UNSPEC
-            };
+    // nobody to forward to, drop the datagram rather than being woken up for
+    // it again and again
+    if (!entry->listener_connected) {
+        recv(entry->connect_sock_fd, NULL, 0, MSG_DONTWAIT);
+        return true;
+    }
 
-            if (connect(entry->listen_sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-                LOG(ERROR, "connect() failed: %s", strerror(errno));
-                return false;
-            }
+    if (!forward_packet(fwd, entry->connect_sock_fd, entry->listen_sock_fd)) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_UNSPEC
+        };
 
-            entry->listener_connected = false;
+        if (connect(entry->listen_sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            LOG(ERROR, "connect() failed: %s", strerror(errno));
+            return false;
         }
+
+        entry->listener_connected = false;
     }
 
     return true;
 }
 
-bool fwd_check_poll_listen(fwd_t *fwd, int i_fwd, struct pollfd *fd) {
-    if (fd->revents & POLLIN) {
-        fd->revents &= ~POLLIN;
-
-        struct fwd *entry = &fwd->fwds[i_fwd];
-
-        if (!entry->listener_connected) {
-            struct sockaddr_in addr;
-            socklen_t addr_len = sizeof(addr);
+// Called when the local listening socket is readable.
+bool fwd_handle_listen(fwd_t *fwd, int i_fwd) {
+    struct fwd *entry = &fwd->fwds[i_fwd];
 
-            if (recvfrom(entry->listen_sock_fd, NULL, 0, MSG_PEEK, (struct sockaddr *)&addr, &addr_len) == -1) {
-                LOG(ERROR, "recvfrom() failed: %s", strerror(errno));
-                return false;
-            }
+    if (!entry->listener_connected) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
 
-            if (connect(entry->listen_sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-                LOG(ERROR, "connect() failed: %s", strerror(errno));
-                return false;
-            }
+        if (recvfrom(entry->listen_sock_fd, NULL, 0, MSG_PEEK, (struct sockaddr *)&addr, &addr_len) == -1) {
+            LOG(ERROR, "recvfrom() failed: %s", strerror(errno));
+            return false;
+        }
 
-            entry->listener_connected = true;
+        if (connect(entry->listen_sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            LOG(ERROR, "connect() failed: %s", strerror(errno));
+            return false;
         }
 
-        forward_packet(fwd, entry->listen_sock_fd, entry->connect_sock_fd);
+        entry->listener_connected = true;
     }
 
+    forward_packet(fwd, entry->listen_sock_fd, entry->connect_sock_fd);
+
     return true;
 }
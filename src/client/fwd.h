@@ -2,7 +2,6 @@
 #define FWD_H
 
 #include <netinet/in.h>
-#include <poll.h>
 #include <stdbool.h>
 
 #include "wireguard.h"
@@ -24,10 +23,8 @@ typedef struct {
 
 bool fwd_init(fwd_t *fwd, int bind_port, int nfwds);
 bool fwd_add(fwd_t *fwd, int i_fwd, const char *peer_key, const char *endpoint, unsigned short listen_port);
-void fwd_set_endpoint(fwd_t *fwd, int i_fwd, struct sockaddr_in *addr);
-void fwd_setup_poll_connect(fwd_t *fwd, int i_fwd, struct pollfd *fd);
-void fwd_setup_poll_listen(fwd_t *fwd, int i_fwd, struct pollfd *fd);
-bool fwd_check_poll_connect(fwd_t *fwd, int i_fwd, struct pollfd *fd);
-bool fwd_check_poll_listen(fwd_t *fwd, int i_fwd, struct pollfd *fd);
+void fwd_set_endpoint(fwd_t *fwd, int i_fwd, const struct sockaddr_in *addr);
+bool fwd_handle_connect(fwd_t *fwd, int i_fwd);
+bool fwd_handle_listen(fwd_t *fwd, int i_fwd);
 
 #endif
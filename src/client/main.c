@@ -7,34 +7,46 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <poll.h>
+#include <signal.h>
 
 #include <wireguard.h>
 
+#include "batch.h"
+#include "devcache.h"
 #include "fwd.h"
+#include "loop.h"
 #include "mem.h"
 #include "wgutil.h"
 #include "args.h"
 #include "net.h"
 #include "client.h"
+#include "resync.h"
 #include "log.h"
 #include "packets.h"
+#include "peertable.h"
 
-#define RECONNECT_INTERVAL 5
-#define KEEPALIVE_INTERVAL 25
-
-#define POLL_TIMEOUT 5000
-#define POLL_FD_IDX_CLIENT 0
-#define POLL_FD_IDX_FWD_BASE 1
+#define RECONNECT_INTERVAL 5 // s
+#define KEEPALIVE_INTERVAL 25 // s
+#define SYNC_INTERVAL 5 // s, how often subscriptions are matched to the device
 
 typedef struct {
     args_t *args;
     client_t *client;
-    wg_device *device;
+    wg_ctx *wg;
+    devcache_t cache;
+    batch_t batch;
     wg_key public_key;
     struct sockaddr_in host;
-    nfds_t nfds;
-    struct pollfd *fds;
+    loop_t loop;
+    loop_io client_io;
+    loop_io devcache_io; // watched while the device is dumped
+    unsigned devcache_generation; // of the socket devcache_io was started on
+    loop_io *fwd_ios; // the listening sockets, then the connected ones
+    loop_timer reconnect_timer;
+    loop_timer keepalive_timer;
+    loop_timer sync_timer;
+    loop_timer batch_timer;
+    bool failed;
     int npeers;
     struct peer {
         wg_key public_key;
@@ -42,7 +54,9 @@ typedef struct {
     } *peers;
     bool fwd_mode;
     fwd_t fwd;
-    time_t last_keepalive;
+    keymap_t subscribed; // peers the server pushes endpoint changes for, mapped to ctx
+    bool subscribed_valid;
+    resync_t resync;
 } client_ctx_t;
 
 static int send_public_key(client_t *client, wg_key key) {
@@ -67,7 +81,7 @@ cleanup:
     return ret;
 }
 
-static void update_endpoint_fwd(client_ctx_t *ctx, wg_key public_key, struct sockaddr_in *addr) {
+static void update_endpoint_fwd(client_ctx_t *ctx, const wg_key public_key, const struct sockaddr_in *addr) {
     for (int i = 0; i < ctx->fwd.nfwds; i++) {
         if (wgutil_key_matches(ctx->fwd.fwds[i].peer_key, public_key)) {
             if (net_addr_matches(addr, &ctx->host)) {
@@ -85,132 +99,354 @@ static void update_endpoint_fwd(client_ctx_t *ctx, wg_key public_key, struct soc
     }
 }
 
-static void peer_set_endpoint(client_ctx_t *ctx, wg_peer *peer, struct sockaddr_in *addr) {
-    if (net_addr_and_port_matches(&peer->endpoint.addr4, addr))
-        return;
+static void flush_endpoints(client_ctx_t *ctx) {
+    batch_t *batch = &ctx->batch;
 
-    char old_addr[ADDR_MAX_LEN], new_addr[ADDR_MAX_LEN];
+    if (!batch->nentries) {
+        resync_commit(&ctx->resync);
+        return;
+    }
 
-    LOG(INFO, "%s:%d -> %s:%d", net_addr_to_str(&peer->endpoint.addr4, old_addr),
-                                ntohs(peer->endpoint.addr4.sin_port),
-                                net_addr_to_str(addr, new_addr),
-                                ntohs(addr->sin_port));
+    LOG(DEBUG, "applying %zu endpoint updates", batch->nentries);
 
-    peer->endpoint.addr4 = *addr;
+    if (wg_ctx_set_endpoints(ctx->wg, ctx->cache.name, batch->entries, batch->nentries) < 0) {
+        LOG(ERROR, "failed to set endpoints on device %s: %s.", ctx->cache.name, strerror(errno));
+        devcache_invalidate(&ctx->cache);
+        resync_miss(&ctx->resync);
+    }
+    else {
+        devcache_set_endpoints(&ctx->cache, batch->entries, batch->nentries);
+    }
 
-    wg_set_device(ctx->device);
+    batch_clear(batch);
+    resync_commit(&ctx->resync);
 }
 
-static void update_endpoint(client_ctx_t *ctx, wg_key public_key, struct sockaddr_in *addr) {
-    wg_device *device = ctx->device;
+// current is the endpoint the device cache knows the peer by.
+static void peer_set_endpoint(client_ctx_t *ctx, const wg_key public_key, const wg_endpoint *current, const wg_endpoint *endpoint) {
+    const wg_endpoint *pending = batch_find(&ctx->batch, public_key);
+
+    if (pending)
+        current = pending;
 
-    if (wg_get_device(&ctx->device, device->name) < 0) {
-        LOG(ERROR, "failed to get device %s: %s.", ctx->device->name, strerror(errno));
+    if (net_endpoint_matches(current, endpoint))
         return;
+
+    if (endpoint->addr.sa_family == AF_INET) {
+        char old_addr[ADDR_MAX_LEN], new_addr[ADDR_MAX_LEN];
+
+        LOG(INFO, "%s:%d -> %s:%d", net_addr_to_str(&current->addr4, old_addr),
+                                    ntohs(current->addr4.sin_port),
+                                    net_addr_to_str(&endpoint->addr4, new_addr),
+                                    ntohs(endpoint->addr4.sin_port));
     }
 
-    wg_free_device(device);
+    batch_add(&ctx->batch, public_key, endpoint);
 
-    wg_peer *peer;
+    if (ctx->args->coalesce <= 0)
+        flush_endpoints(ctx);
+    else if (!loop_timer_pending(&ctx->batch_timer))
+        loop_timer_start(&ctx->loop, &ctx->batch_timer, ctx->args->coalesce, 0);
+}
 
-    wg_for_each_peer(ctx->device, peer) {
-        if (!wgutil_key_matches(peer->public_key, public_key))
-            continue;
+static void update_endpoint(client_ctx_t *ctx, const wg_key public_key, const wg_endpoint *endpoint) {
+    const wg_endpoint *current = devcache_find_endpoint(&ctx->cache, public_key);
 
-        if (net_addr_matches(addr, &ctx->host)) {
-            for (int i = 0; i < ctx->npeers; i++) {
-                if (!wgutil_key_matches(ctx->peers[i].public_key, peer->public_key))
-                    continue;
+    if (!current) {
+        resync_miss(&ctx->resync);
+        return;
+    }
 
-                peer_set_endpoint(ctx, peer, &ctx->peers[i].default_endpoint);
+    if (endpoint->addr.sa_family == AF_INET && net_addr_matches(&endpoint->addr4, &ctx->host)) {
+        for (int i = 0; i < ctx->npeers; i++) {
+            if (!wgutil_key_matches(ctx->peers[i].public_key, public_key))
+                continue;
 
-                return;
-            }
+            const wg_endpoint default_endpoint = {
+                .addr4 = ctx->peers[i].default_endpoint
+            };
+
+            peer_set_endpoint(ctx, public_key, current, &default_endpoint);
+
+            return;
         }
-        else {
-            peer_set_endpoint(ctx, peer, addr);
+    }
+    else {
+        peer_set_endpoint(ctx, public_key, current, endpoint);
+    }
+}
+
+static int send_keys_bulk(client_ctx_t *ctx, uint16_t type, wg_key *keys, size_t nkeys) {
+    const uint32_t capacity = packet_bulk_capacity(type, ctx->client->max_frame_size);
+    const size_t frames = (nkeys + capacity - 1) / capacity;
+
+    if (type == PACKET_TYPE_RESYNC_REQ)
+        resync_start(&ctx->resync, frames);
+
+    for (size_t i = 0; i < nkeys; i += capacity) {
+        const uint32_t count = nkeys - i < capacity ? nkeys - i : capacity;
+
+        packet_t *packet = packet_allocate_bulk(type, count);
+
+        memcpy(packet_bulk_keys(packet), keys + i, count * sizeof(wg_key));
+
+        if (type == PACKET_TYPE_RESYNC_REQ) {
+            packet->resync_req.more = frames - 1 - i / capacity;
+            packet->resync_req.epoch = ctx->resync.epoch;
+            packet->resync_req.seq = ctx->resync.seq;
         }
 
-        return;
+        LOG(DEBUG, "sending %u keys (type = 0x%x)", count, type);
+
+        const int ret = client_send_packet(ctx->client, packet);
+
+        free(packet);
+
+        if (ret == -1)
+            return -1;
     }
+
+    return 0;
 }
 
-static void handle_endpoint_info_res(client_ctx_t *ctx, packet_endpoint_info_res *packet) {
-    LOG(DEBUG, "PACKET_TYPE_ENDPOINT_INFO_RES");
+static int request_endpoints(client_ctx_t *ctx) {
+    wg_key *keys;
+    size_t nkeys = 0;
 
-    struct sockaddr_in in = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = packet->addr,
-        .sin_port = packet->port
-    };
+    if (ctx->fwd_mode) {
+        keys = mem_alloc(ctx->fwd.nfwds * sizeof(wg_key));
+
+        for (int i = 0; i < ctx->fwd.nfwds; i++)
+            memcpy(keys[nkeys++], ctx->fwd.fwds[i].peer_key, sizeof(wg_key));
+    }
+    else {
+        const peertable_t *peers = devcache_get(&ctx->cache);
+
+        if (!peers)
+            return -1;
+
+        keys = mem_alloc(peers->size * sizeof(wg_key));
+        nkeys = peers->size;
+
+        memcpy(keys, peers->keys, nkeys * sizeof(wg_key));
+    }
 
-    {
-        char addr[20];
-        inet_ntop(AF_INET, &in.sin_addr, addr, 20);
-        LOG(DEBUG, "%s:%d", addr, ntohs(in.sin_port));
+    int ret = 0;
+
+    if (ctx->client->max_frame_size) {
+        // only the peers changed since the last sequence number are answered
+        ret = send_keys_bulk(ctx, PACKET_TYPE_RESYNC_REQ, keys, nkeys);
+    }
+    else {
+        for (size_t i = 0; i < nkeys && ret == 0; i++)
+            ret = send_public_key(ctx->client, keys[i]);
     }
 
-    {
+    // requesting an endpoint subscribes to its changes
+    if (ret == 0 && !ctx->fwd_mode) {
+        for (size_t i = 0; i < nkeys; i++)
+            keymap_put(&ctx->subscribed, keys[i], ctx);
+
+        ctx->subscribed_valid = true;
+    }
+
+    free(keys);
+
+    return ret;
+}
+
+// Subscribes to peers added to the device since the endpoints were requested
+// and unsubscribes from the removed ones.
+static void sync_subscriptions(client_ctx_t *ctx) {
+    if (ctx->fwd_mode || !ctx->subscribed_valid || !ctx->client->connected || !ctx->client->max_frame_size)
+        return;
+
+    const peertable_t *peers = devcache_get(&ctx->cache);
+
+    if (!peers)
+        return;
+
+    wg_key *keys = mem_alloc((peers->size + ctx->subscribed.size) * sizeof(wg_key));
+    size_t nkeys = 0;
+
+    for (size_t i = 0; i < peers->size; i++) {
+        if (!keymap_get(&ctx->subscribed, peers->keys[i]))
+            memcpy(keys[nkeys++], peers->keys[i], sizeof(wg_key));
+    }
+
+    if (nkeys && send_keys_bulk(ctx, PACKET_TYPE_ENDPOINT_INFO_BULK_REQ, keys, nkeys) == 0) {
+        for (size_t i = 0; i < nkeys; i++)
+            keymap_put(&ctx->subscribed, keys[i], ctx);
+    }
+
+    nkeys = 0;
+
+    keymap_entry *entry;
+
+    keymap_for_each(&ctx->subscribed, entry) {
+        if (peertable_find(peers, entry->key) == PEERTABLE_NONE)
+            memcpy(keys[nkeys++], entry->key, sizeof(wg_key));
+    }
+
+    if (nkeys && send_keys_bulk(ctx, PACKET_TYPE_UNSUBSCRIBE, keys, nkeys) == 0) {
+        for (size_t i = 0; i < nkeys; i++)
+            keymap_remove(&ctx->subscribed, keys[i]);
+    }
+
+    free(keys);
+}
+
+static void handle_endpoint(client_ctx_t *ctx, const wg_key public_key, const wg_endpoint *endpoint) {
+    if (endpoint->addr.sa_family == AF_INET) {
+        char addr[ADDR_MAX_LEN];
+        LOG(DEBUG, "%s:%d", net_addr_to_str(&endpoint->addr4, addr), ntohs(endpoint->addr4.sin_port));
+    }
+
+    if (g_log_level >= DEBUG) {
         wg_key_b64_string key;
 
         wg_key_to_base64(key, ctx->public_key);
         LOG(DEBUG, "ctx->device->public_key = %s", key);
 
-        wg_key_to_base64(key, packet->public_key);
+        wg_key_to_base64(key, public_key);
         LOG(DEBUG, "packet->public_key = %s", key);
-
     }
 
-    if (wgutil_key_matches(ctx->public_key, packet->public_key)) {
+    if (wgutil_key_matches(ctx->public_key, public_key)) {
         LOG(DEBUG, "got host address.");
 
-        ctx->host = in;
+        struct sockaddr_in host = {};
 
-        if (ctx->fwd_mode) {
-            for (int i = 0; i < ctx->fwd.nfwds; i++) {
-                if (send_public_key(ctx->client, ctx->fwd.fwds[i].peer_key) == -1)
-                    return;
-            }
-        }
-        else {
-            wg_peer *peer;
+        if (endpoint->addr.sa_family == AF_INET)
+            host = endpoint->addr4;
 
-            wg_for_each_peer(ctx->device, peer) {
-                if (send_public_key(ctx->client, peer->public_key) == -1)
-                    return;
-            }
-        }
+        // which peers share our address changed, all endpoints have to be checked again
+        if (!net_addr_matches(&host, &ctx->host))
+            resync_reset(&ctx->resync);
+
+        ctx->host = host;
+
+        request_endpoints(ctx);
 
         return;
     }
 
     if (ctx->fwd_mode) {
-        update_endpoint_fwd(ctx, packet->public_key, &in);
+        if (endpoint->addr.sa_family == AF_INET)
+            update_endpoint_fwd(ctx, public_key, &endpoint->addr4);
     }
     else {
-        update_endpoint(ctx, packet->public_key, &in);
+        update_endpoint(ctx, public_key, endpoint);
     }
 }
 
+static void handle_endpoint_info_res(client_ctx_t *ctx, packet_endpoint_info_res *packet) {
+    LOG(DEBUG, "PACKET_TYPE_ENDPOINT_INFO_RES");
+
+    const wg_endpoint endpoint = {
+        .addr4 = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = packet->addr,
+            .sin_port = packet->port
+        }
+    };
+
+    handle_endpoint(ctx, packet->public_key, &endpoint);
+}
+
+static void handle_endpoint_info_bulk_res(client_ctx_t *ctx, packet_endpoint_info_bulk_res *packet) {
+    LOG(DEBUG, "PACKET_TYPE_ENDPOINT_INFO_BULK_RES (%u records)", packet->count);
+
+    for (uint32_t i = 0; i < packet->count; i++) {
+        wg_endpoint endpoint;
+
+        if (!packet_decode_endpoint(&packet->records[i], &endpoint))
+            continue;
+
+        handle_endpoint(ctx, packet->records[i].public_key, &endpoint);
+    }
+}
+
+static void handle_seq(client_ctx_t *ctx, packet_seq *packet) {
+    LOG(DEBUG, "at sequence number %lu", (unsigned long)packet->seq);
+
+    resync_receive(&ctx->resync, packet->epoch, packet->seq);
+
+    // the updates up to it may still wait in the batch
+    if (!ctx->batch.nentries)
+        resync_commit(&ctx->resync);
+}
+
+static void handle_hello(client_ctx_t *ctx, packet_hello *packet) {
+    if (packet->max_frame_size < PACKET_MIN_FRAME_SIZE) {
+        LOG(ERROR, "server frame size %u is too small.", packet->max_frame_size);
+        return;
+    }
+
+    const uint32_t max_frame_size = packet->max_frame_size < PACKET_MAX_FRAME_SIZE ? packet->max_frame_size : PACKET_MAX_FRAME_SIZE;
+
+    packet_t *res = PACKET_NEW(HELLO);
+
+    res->hello.max_frame_size = max_frame_size;
+
+    const int ret = client_send_packet(ctx->client, res);
+
+    free(res);
+
+    if (ret == -1)
+        return;
+
+    ctx->client->max_frame_size = max_frame_size;
+
+    LOG(DEBUG, "negotiated frame size %u", max_frame_size);
+}
+
 static bool handle_client_connected(client_ctx_t *ctx) {
+    loop_timer_stop(&ctx->loop, &ctx->reconnect_timer);
+    loop_timer_start(&ctx->loop, &ctx->keepalive_timer, KEEPALIVE_INTERVAL * 1000, KEEPALIVE_INTERVAL * 1000);
+    loop_io_modify(&ctx->loop, &ctx->client_io, EPOLLIN);
+
+    // the server forgot the subscriptions along with the connection
+    keymap_clear(&ctx->subscribed);
+    ctx->subscribed_valid = false;
+
+    resync_disconnected(&ctx->resync);
+
+    packet_t *packet = PACKET_NEW(HELLO_REQ);
+
+    const int ret = client_send_packet(ctx->client, packet);
+
+    free(packet);
+
+    if (ret == -1)
+        return false;
+
     if (send_public_key(ctx->client, ctx->public_key) == -1)
         return false;
 
     return true;
 }
 
+// Connects with a new socket, at most once per RECONNECT_INTERVAL. The
+// reconnect timer tries again unless the connection is up by then.
 static bool client_try_connect(client_ctx_t *ctx) {
-    if (ctx->client->connect_failed || !ctx->client->connected) {
-        if (time(NULL) - ctx->client->last_conn < RECONNECT_INTERVAL)
-            return false;
+    const time_t since = time(NULL) - ctx->client->last_conn;
 
-        client_close(ctx->client);
+    if (since < RECONNECT_INTERVAL) {
+        loop_timer_start(&ctx->loop, &ctx->reconnect_timer, (RECONNECT_INTERVAL - since) * 1000, 0);
+        return false;
+    }
 
-        if (client_init(ctx->client) == -1)
-            return false;
+    loop_timer_start(&ctx->loop, &ctx->reconnect_timer, RECONNECT_INTERVAL * 1000, 0);
+    loop_io_stop(&ctx->loop, &ctx->client_io);
 
-        client_setup_poll(ctx->client, &ctx->fds[POLL_FD_IDX_CLIENT]);
-    }
+    client_close(ctx->client);
+
+    if (client_init(ctx->client) == -1)
+        return false;
+
+    if (loop_io_start(&ctx->loop, &ctx->client_io, ctx->client->fd, EPOLLIN | EPOLLOUT) == -1)
+        return false;
 
     if (client_connect(ctx->client, ctx->args->address, ctx->args->port) == -1)
         return false;
@@ -218,41 +454,172 @@ static bool client_try_connect(client_ctx_t *ctx) {
     return handle_client_connected(ctx);
 }
 
-static bool handle_client_received_packet(client_ctx_t *ctx) {
-    packet_t *packet;
+// Watches the connected socket for EPOLLOUT while some of the data sent to the
+// server is still queued.
+static void watch_client(client_ctx_t *ctx) {
+    const uint32_t events = client_pending(ctx->client) ? EPOLLIN | EPOLLOUT : EPOLLIN;
 
-    if (client_read_packet(ctx->client, &packet) == -1)
-        return true;
+    loop_io_modify(&ctx->loop, &ctx->client_io, events);
+}
+
+// Starts over once the connection failed or was lost, in whatever way.
+static void check_connection(client_ctx_t *ctx) {
+    if (ctx->client->connected) {
+        watch_client(ctx);
+        return;
+    }
+
+    // the socket isn't watched until the next attempt
+    if (ctx->client->connect_failed)
+        loop_io_stop(&ctx->loop, &ctx->client_io);
+
+    // still connecting, or waiting to
+    if (loop_timer_pending(&ctx->reconnect_timer))
+        return;
+
+    loop_timer_stop(&ctx->loop, &ctx->keepalive_timer);
+
+    if (client_try_connect(ctx))
+        watch_client(ctx);
+}
+
+// Watches the netlink socket while the device cache is being refreshed. Any
+// lookup in the cache may have started a dump.
+static void watch_devcache(client_ctx_t *ctx) {
+    if (ctx->fwd_mode)
+        return;
+
+    const int fd = devcache_fd(&ctx->cache);
+    const unsigned generation = devcache_generation(&ctx->cache);
+
+    // the socket is replaced after a failed or restarted dump, and the new one
+    // may have the same fd without being watched
+    if (generation != ctx->devcache_generation) {
+        loop_io_closed(&ctx->loop, &ctx->devcache_io);
+        ctx->devcache_generation = generation;
+    }
 
+    if (fd == ctx->devcache_io.fd)
+        return;
+
+    loop_io_stop(&ctx->loop, &ctx->devcache_io);
+
+    if (fd >= 0)
+        loop_io_start(&ctx->loop, &ctx->devcache_io, fd, EPOLLIN);
+}
+
+static void handle_packet(client_ctx_t *ctx, packet_t *packet) {
     switch (packet->header.type) {
         default:
             LOG(DEBUG, "unknown packet type: 0x%x.", packet->header.type);
             break;
+        case PACKET_TYPE_HELLO:
+            handle_hello(ctx, &packet->hello);
+            break;
         case PACKET_TYPE_ENDPOINT_INFO_RES: {
             handle_endpoint_info_res(ctx, &packet->endpoint_info_res);
             break;
         }
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_RES:
+            handle_endpoint_info_bulk_res(ctx, &packet->endpoint_info_bulk_res);
+            break;
+        case PACKET_TYPE_SEQ:
+            handle_seq(ctx, &packet->seq);
+            break;
     }
+}
+
+static bool handle_client_received_packet(client_ctx_t *ctx) {
+    if (client_receive(ctx->client) == -1)
+        return true;
+
+    packet_t *packet;
+
+    // handle every complete frame the read brought in, the rest stays buffered
+    while (ctx->client->connected && client_read_packet(ctx->client, &packet) == 0)
+        handle_packet(ctx, packet);
 
     return true;
 }
 
-static bool handle_poll_timeout(client_ctx_t *ctx) {
-    time_t now = time(NULL);
+static void handle_client_io(loop_io *io, uint32_t events) {
+    client_ctx_t *ctx = io->data;
 
-    bool ret = true;
+    const int status = client_check_events(ctx->client, events);
 
-    if (now - ctx->last_keepalive >= KEEPALIVE_INTERVAL && ctx->client->connected) {
-        ctx->last_keepalive = now;
+    if (status == CLIENT_CONNECTED) {
+        handle_client_connected(ctx);
+    }
+    else if (status == CLIENT_RECEIVED_PACKET) {
+        handle_client_received_packet(ctx);
+    }
 
-        packet_t *packet = PACKET_NEW(KEEPALIVE);
+    check_connection(ctx);
+    watch_devcache(ctx);
+}
 
-        client_send_packet(ctx->client, packet);
+static void handle_devcache_io(loop_io *io, uint32_t events) {
+    client_ctx_t *ctx = io->data;
 
-        free(packet);
+    (void)events;
+
+    devcache_handle_readable(&ctx->cache);
+    watch_devcache(ctx);
+}
+
+static void handle_fwd_io(loop_io *io, uint32_t events) {
+    client_ctx_t *ctx = io->data;
+    const int i = io - ctx->fwd_ios;
+
+    (void)events;
+
+    const bool ok = i < ctx->fwd.nfwds ? fwd_handle_listen(&ctx->fwd, i)
+                                       : fwd_handle_connect(&ctx->fwd, i - ctx->fwd.nfwds);
+
+    if (!ok) {
+        ctx->failed = true;
+        loop_stop(&ctx->loop);
     }
+}
 
-    return ret;
+static void handle_reconnect_timer(loop_timer *timer) {
+    client_ctx_t *ctx = timer->data;
+
+    client_try_connect(ctx);
+    check_connection(ctx);
+}
+
+static void handle_keepalive_timer(loop_timer *timer) {
+    client_ctx_t *ctx = timer->data;
+
+    packet_t *packet = PACKET_NEW(KEEPALIVE);
+
+    client_send_packet(ctx->client, packet);
+
+    free(packet);
+
+    check_connection(ctx);
+}
+
+static void handle_sync_timer(loop_timer *timer) {
+    client_ctx_t *ctx = timer->data;
+
+    sync_subscriptions(ctx);
+
+    check_connection(ctx);
+    watch_devcache(ctx);
+}
+
+static void handle_batch_timer(loop_timer *timer) {
+    flush_endpoints(timer->data);
+}
+
+static void handle_stop_signal(int signo, void *data) {
+    client_ctx_t *ctx = data;
+
+    LOG(INFO, "caught signal %d, stopping.", signo);
+
+    loop_stop(&ctx->loop);
 }
 
 int main(int argc, char *argv[]) {
@@ -272,13 +639,27 @@ int main(int argc, char *argv[]) {
     client_ctx_t ctx = {
         .args = &args,
         .client = client,
-        .device = NULL,
+        .wg = NULL,
         .host.sin_port = 0,
         .npeers = 0,
         .peers = NULL,
         .fwd_mode = args.nfwds
     };
 
+    batch_init(&ctx.batch);
+    keymap_init(&ctx.subscribed);
+    resync_init(&ctx.resync);
+
+    loop_io_init(&ctx.client_io, handle_client_io, &ctx);
+    loop_io_init(&ctx.devcache_io, handle_devcache_io, &ctx);
+    loop_timer_init(&ctx.reconnect_timer, handle_reconnect_timer, &ctx);
+    loop_timer_init(&ctx.keepalive_timer, handle_keepalive_timer, &ctx);
+    loop_timer_init(&ctx.sync_timer, handle_sync_timer, &ctx);
+    loop_timer_init(&ctx.batch_timer, handle_batch_timer, &ctx);
+
+    if (loop_init(&ctx.loop) == -1)
+        goto error;
+
     if (args.npeers) {
         ctx.peers = mem_alloc(args.npeers * sizeof(struct peer));
 
@@ -314,92 +695,54 @@ int main(int argc, char *argv[]) {
 
         LOG(INFO, "Using device: %s", device_name);
 
-        if (wg_get_device(&ctx.device, device_name) < 0) {
-            LOG(ERROR, "Failed to get device %s: %s.", device_name, strerror(errno));
+        if (!(ctx.wg = wg_ctx_new()))
             goto error;
-        }
 
-        memcpy(ctx.public_key, ctx.device->public_key, sizeof(wg_key));
-    }
+        if (!devcache_init(&ctx.cache, device_name))
+            goto error;
 
-    if (ctx.fwd_mode) {
-        ctx.nfds = 1 + 2 * args.nfwds;
-    }
-    else {
-        ctx.nfds = 1;
+        memcpy(ctx.public_key, ctx.cache.public_key, sizeof(wg_key));
     }
 
-    ctx.fds = mem_alloc(ctx.nfds * sizeof(struct pollfd));
-
     if (client_init(client) == -1)
         goto error;
 
-    client_setup_poll(client, &ctx.fds[POLL_FD_IDX_CLIENT]);
-
     if (ctx.fwd_mode) {
-        for (int i = 0; i < args.nfwds; i++) {
-            fwd_setup_poll_listen(&ctx.fwd, i, &ctx.fds[POLL_FD_IDX_FWD_BASE + i]);
-            fwd_setup_poll_connect(&ctx.fwd, i, &ctx.fds[POLL_FD_IDX_FWD_BASE + args.nfwds + i]);
-        }
-    }
+        ctx.fwd_ios = mem_alloc(2 * args.nfwds * sizeof(loop_io));
 
-    client_try_connect(&ctx);
-
-    while (true) {
-        int ret;
-
-        if (ctx.client->connect_failed || !ctx.client->connected) {
-            client_try_connect(&ctx);
-        }
-
-        if (client->connect_failed) {
-            ret = poll(ctx.fds + 1, ctx.nfds - 1, POLL_TIMEOUT);
-        }
-        else {
-            ret = poll(ctx.fds, ctx.nfds, POLL_TIMEOUT);
-        }
+        for (int i = 0; i < args.nfwds; i++) {
+            loop_io_init(&ctx.fwd_ios[i], handle_fwd_io, &ctx);
+            loop_io_init(&ctx.fwd_ios[args.nfwds + i], handle_fwd_io, &ctx);
 
-        if (ret == -1) {
-            LOG(ERROR, "poll() failed: %s", strerror(errno));
-            goto error;
-        }
-        else if (ret == 0) {
-            if (!handle_poll_timeout(&ctx))
+            if (loop_io_start(&ctx.loop, &ctx.fwd_ios[i], ctx.fwd.fwds[i].listen_sock_fd, EPOLLIN) == -1 ||
+                loop_io_start(&ctx.loop, &ctx.fwd_ios[args.nfwds + i], ctx.fwd.fwds[i].connect_sock_fd, EPOLLIN) == -1)
                 goto error;
-
-            continue;
-        }
-
-        const int status = client_check_poll(client, &ctx.fds[POLL_FD_IDX_CLIENT]);
-
-        if (status == CLIENT_CONNECTED) {
-            handle_client_connected(&ctx);
         }
-        else if (status == CLIENT_RECEIVED_PACKET) {
-            handle_client_received_packet(&ctx);
-        }
-
-        if (!ctx.fwd_mode)
-            continue;
-
-        for (int i = 0; i < args.nfwds; i++) {
-            struct pollfd *listen_fd = &ctx.fds[POLL_FD_IDX_FWD_BASE + i];
+    }
 
-            if (!fwd_check_poll_listen(&ctx.fwd, i, listen_fd))
-                goto error;
+    if (loop_signal(&ctx.loop, SIGINT, handle_stop_signal, &ctx) == -1 ||
+        loop_signal(&ctx.loop, SIGTERM, handle_stop_signal, &ctx) == -1)
+        goto error;
 
-            struct pollfd *connect_fd = &ctx.fds[POLL_FD_IDX_FWD_BASE + args.nfwds + i];
+    loop_timer_start(&ctx.loop, &ctx.sync_timer, SYNC_INTERVAL * 1000, SYNC_INTERVAL * 1000);
 
-            if (!fwd_check_poll_connect(&ctx.fwd, i, connect_fd))
-                goto error;
+    client_try_connect(&ctx);
+    check_connection(&ctx);
+    watch_devcache(&ctx);
 
-        }
-    }
+    if (loop_run(&ctx.loop) == -1 || ctx.failed)
+        goto error;
 
 cleanup:
     args_free(&args);
 
-    free(ctx.fds);
+    loop_free(&ctx.loop);
+    free(ctx.fwd_ios);
+
+    batch_free(&ctx.batch);
+    keymap_free(&ctx.subscribed);
+    devcache_free(&ctx.cache);
+    wg_ctx_free(ctx.wg);
 
     if (client) {
         client_free(client);
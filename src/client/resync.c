@@ -0,0 +1,71 @@
+#include "resync.h"
+
+#include <string.h>
+
+#include "log.h"
+
+void resync_init(resync_t *resync) {
+    memset(resync, 0, sizeof(*resync));
+}
+
+// The server answers each frame of a resync request with a SEQ of its own.
+void resync_start(resync_t *resync, size_t frames) {
+    resync->unanswered = frames;
+}
+
+void resync_receive(resync_t *resync, uint64_t epoch, uint64_t seq) {
+    resync->next_epoch = epoch;
+    resync->next_seq = seq;
+    resync->pending = true;
+
+    if (resync->unanswered)
+        resync->unanswered--;
+}
+
+// Takes the sequence number received last, unless an update before it was
+// missed: the server wouldn't send that one again on a resync from there, so
+// the next resync has to be a full one. Call once the updates received are
+// applied. Returns false while the number can't be taken yet.
+bool resync_commit(resync_t *resync) {
+    if (!resync->pending || resync->unanswered)
+        return false;
+
+    resync->pending = false;
+
+    if (resync->missed) {
+        LOG(DEBUG, "updates were missed, next resync is a full one.");
+
+        resync_reset(resync);
+        return true;
+    }
+
+    resync->epoch = resync->next_epoch;
+    resync->seq = resync->next_seq;
+
+    return true;
+}
+
+void resync_miss(resync_t *resync) {
+    resync->missed = true;
+}
+
+// Makes the next resync a full one.
+void resync_reset(resync_t *resync) {
+    resync->epoch = 0;
+    resync->seq = 0;
+    resync->missed = false;
+}
+
+// The frames left unanswered by a lost connection won't be answered anymore,
+// the number received for the others doesn't cover their peers.
+void resync_disconnected(resync_t *resync) {
+    if (!resync->unanswered)
+        return;
+
+    LOG(DEBUG, "resync wasn't answered completely, next resync is a full one.");
+
+    resync->unanswered = 0;
+    resync->pending = false;
+
+    resync_reset(resync);
+}
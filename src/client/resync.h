@@ -0,0 +1,31 @@
+#ifndef RESYNC_H
+#define RESYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Tracks the sequence number the next resync starts from. A received number
+// is only taken once the updates up to it are applied and every frame of the
+// resync request was answered: the peers of an unanswered frame may have
+// changed before it, and a resync from there wouldn't tell.
+
+typedef struct {
+    uint64_t epoch; // from the last PACKET_TYPE_SEQ taken, 0 if there was none
+    uint64_t seq;
+    uint64_t next_epoch; // received, not taken yet
+    uint64_t next_seq;
+    bool pending;
+    bool missed; // an update since the last sequence number wasn't applied
+    size_t unanswered; // frames of the last resync request without their SEQ
+} resync_t;
+
+void resync_init(resync_t *resync);
+void resync_start(resync_t *resync, size_t frames);
+void resync_receive(resync_t *resync, uint64_t epoch, uint64_t seq);
+bool resync_commit(resync_t *resync);
+void resync_miss(resync_t *resync);
+void resync_reset(resync_t *resync);
+void resync_disconnected(resync_t *resync);
+
+#endif
@@ -0,0 +1,153 @@
+#include "keymap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+#define KEYMAP_MIN_CAP 16
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// The seed goes into the first round and every word is mixed into a state
+// derived from it, so which keys collide differs from map to map.
+static uint64_t hash_key(const keymap_t *map, const wg_key key) {
+    uint64_t words[4];
+
+    memcpy(words, key, sizeof(words));
+
+    uint64_t h = mix(map->seed ^ words[0]);
+
+    h = mix(h ^ words[1]);
+    h = mix(h ^ words[2]);
+    h = mix(h ^ words[3]);
+
+    return h;
+}
+
+static size_t find_slot(const keymap_t *map, const wg_key key) {
+    const size_t mask = map->cap - 1;
+
+    size_t i = hash_key(map, key) & mask;
+
+    while (map->entries[i].value && memcmp(map->entries[i].key, key, sizeof(wg_key)) != 0)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+static void rehash(keymap_t *map, size_t cap) {
+    keymap_entry *entries = map->entries;
+    const size_t old_cap = map->cap;
+
+    map->entries = mem_zalloc(cap * sizeof(keymap_entry));
+    map->cap = cap;
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!entries[i].value)
+            continue;
+
+        map->entries[find_slot(map, entries[i].key)] = entries[i];
+    }
+
+    free(entries);
+}
+
+void keymap_init(keymap_t *map) {
+    map->entries = NULL;
+    map->size = 0;
+    map->cap = 0;
+
+    // keys can come from clients, a secret seed keeps them from knowing
+    // which ones collide
+    if (getentropy(&map->seed, sizeof(map->seed)) == -1)
+        map->seed = mix((uint64_t)time(NULL) ^ (uintptr_t)map);
+}
+
+void keymap_reserve(keymap_t *map, size_t size) {
+    size_t cap = map->cap ? map->cap : KEYMAP_MIN_CAP;
+
+    // keep the load factor at or below 3/4
+    while (size > cap / 4 * 3)
+        cap *= 2;
+
+    if (cap != map->cap)
+        rehash(map, cap);
+}
+
+void *keymap_get(const keymap_t *map, const wg_key key) {
+    if (!map->size)
+        return NULL;
+
+    return map->entries[find_slot(map, key)].value;
+}
+
+void *keymap_put(keymap_t *map, const wg_key key, void *value) {
+    keymap_reserve(map, map->size + 1);
+
+    keymap_entry *entry = &map->entries[find_slot(map, key)];
+    void *old = entry->value;
+
+    if (!old) {
+        memcpy(entry->key, key, sizeof(wg_key));
+        map->size++;
+    }
+
+    entry->value = value;
+
+    return old;
+}
+
+void *keymap_remove(keymap_t *map, const wg_key key) {
+    if (!map->size)
+        return NULL;
+
+    const size_t mask = map->cap - 1;
+
+    size_t i = find_slot(map, key);
+    void *old = map->entries[i].value;
+
+    if (!old)
+        return NULL;
+
+    // backward-shift the following entries so no tombstones are needed
+    for (size_t j = (i + 1) & mask; map->entries[j].value; j = (j + 1) & mask) {
+        const size_t home = hash_key(map, map->entries[j].key) & mask;
+
+        if (((j - home) & mask) < ((j - i) & mask))
+            continue;
+
+        map->entries[i] = map->entries[j];
+        i = j;
+    }
+
+    map->entries[i].value = NULL;
+    map->size--;
+
+    return old;
+}
+
+void keymap_clear(keymap_t *map) {
+    if (map->entries)
+        memset(map->entries, 0, map->cap * sizeof(keymap_entry));
+
+    map->size = 0;
+}
+
+void keymap_free(keymap_t *map) {
+    free(map->entries);
+
+    map->entries = NULL;
+    map->size = 0;
+    map->cap = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wireguard.h"
+
+// Open-addressing hash map from a wireguard public key to a non-NULL pointer.
+
+typedef struct {
+    wg_key key;
+    void *value;
+} keymap_entry;
+
+typedef struct {
+    keymap_entry *entries;
+    size_t size;
+    size_t cap;
+    uint64_t seed;
+} keymap_t;
+
+void keymap_init(keymap_t *map);
+void keymap_reserve(keymap_t *map, size_t size);
+void *keymap_get(const keymap_t *map, const wg_key key);
+void *keymap_put(keymap_t *map, const wg_key key, void *value);
+void *keymap_remove(keymap_t *map, const wg_key key);
+void keymap_clear(keymap_t *map);
+void keymap_free(keymap_t *map);
+
+#define keymap_for_each(__map, __entry) \
+    for ((__entry) = (__map)->entries; (__entry) < (__map)->entries + (__map)->cap; (__entry)++) \
+        if ((__entry)->value)
+
+#endif
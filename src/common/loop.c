@@ -0,0 +1,425 @@
+#include "loop.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "log.h"
+#include "mem.h"
+
+uint64_t loop_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void swap_timers(loop_t *loop, size_t a, size_t b) {
+    loop_timer *timer = loop->timers[a];
+
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = timer;
+
+    loop->timers[a]->idx = a;
+    loop->timers[b]->idx = b;
+}
+
+static void sift_up(loop_t *loop, size_t i) {
+    while (i > 1 && loop->timers[i]->expires < loop->timers[i / 2]->expires) {
+        swap_timers(loop, i, i / 2);
+        i /= 2;
+    }
+}
+
+static void sift_down(loop_t *loop, size_t i) {
+    while (true) {
+        size_t min = i;
+
+        if (2 * i <= loop->ntimers && loop->timers[2 * i]->expires < loop->timers[min]->expires)
+            min = 2 * i;
+
+        if (2 * i + 1 <= loop->ntimers && loop->timers[2 * i + 1]->expires < loop->timers[min]->expires)
+            min = 2 * i + 1;
+
+        if (min == i)
+            return;
+
+        swap_timers(loop, i, min);
+        i = min;
+    }
+}
+
+// Sets the timerfd to the earliest timer, if that changed since the last
+// wait. Called once before every wait rather than on every change.
+static void arm_timer(loop_t *loop) {
+    const uint64_t expires = loop->ntimers ? loop->timers[1]->expires : 0;
+
+    if (expires == loop->armed)
+        return;
+
+    // an expiry of 0 disarms it
+    const struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = expires / 1000,
+            .tv_nsec = (expires % 1000) * 1000000
+        }
+    };
+
+    if (timerfd_settime(loop->timer_io.fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        LOG(ERROR, "timerfd_settime() failed: %s", strerror(errno));
+        return;
+    }
+
+    loop->armed = expires;
+}
+
+static void handle_timers(loop_io *io, uint32_t events) {
+    loop_t *loop = io->data;
+    uint64_t expirations;
+
+    (void)events;
+
+    if (read(io->fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        LOG(ERROR, "failed to read timerfd: %s.", strerror(errno));
+    }
+
+    loop->armed = 0;
+
+    const uint64_t now = loop_now();
+
+    while (loop->ntimers && loop->timers[1]->expires <= now) {
+        loop_timer *timer = loop->timers[1];
+
+        if (timer->interval) {
+            timer->expires += timer->interval;
+
+            // don't run a late timer over and over to catch up
+            if (timer->expires <= now)
+                timer->expires = now + timer->interval;
+
+            sift_down(loop, 1);
+        }
+        else {
+            loop_timer_stop(loop, timer);
+        }
+
+        timer->cb(timer);
+    }
+}
+
+static void handle_signals(loop_io *io, uint32_t events) {
+    loop_t *loop = io->data;
+    struct signalfd_siginfo info;
+
+    (void)events;
+
+    while (read(io->fd, &info, sizeof(info)) == sizeof(info)) {
+        for (size_t i = 0; i < loop->nhandlers; i++) {
+            if (loop->handlers[i].signo == (int)info.ssi_signo)
+                loop->handlers[i].cb(info.ssi_signo, loop->handlers[i].data);
+        }
+    }
+}
+
+int loop_init(loop_t *loop) {
+    memset(loop, 0, sizeof(*loop));
+
+    loop->tasks_tail = &loop->tasks;
+
+    loop_io_init(&loop->timer_io, handle_timers, loop);
+    loop_io_init(&loop->signal_io, handle_signals, loop);
+    sigemptyset(&loop->signals);
+
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        LOG(ERROR, "epoll_create1() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (timer_fd == -1) {
+        LOG(ERROR, "timerfd_create() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (loop_io_start(loop, &loop->timer_io, timer_fd, EPOLLIN) == -1) {
+        close(timer_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void loop_io_init(loop_io *io, loop_io_cb cb, void *data) {
+    io->fd = -1;
+    io->events = 0;
+    io->cb = cb;
+    io->data = data;
+}
+
+int loop_io_start(loop_t *loop, loop_io *io, int fd, uint32_t events) {
+    struct epoll_event event = {
+        .data.ptr = io,
+        .events = events
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        LOG(ERROR, "epoll_ctl() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    io->fd = fd;
+    io->events = events;
+
+    return 0;
+}
+
+int loop_io_modify(loop_t *loop, loop_io *io, uint32_t events) {
+    if (io->fd == -1 || io->events == events)
+        return 0;
+
+    struct epoll_event event = {
+        .data.ptr = io,
+        .events = events
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, io->fd, &event) == -1) {
+        LOG(ERROR, "epoll_ctl() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    io->events = events;
+
+    return 0;
+}
+
+// Call before closing the fd. Events already taken for the watcher in this
+// iteration are dropped, so it can be started again on a new fd right away.
+void loop_io_stop(loop_t *loop, loop_io *io) {
+    if (io->fd == -1)
+        return;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, io->fd, NULL) == -1) {
+        LOG(ERROR, "epoll_ctl() failed: %s", strerror(errno));
+    }
+
+    loop_io_closed(loop, io);
+}
+
+// Like loop_io_stop(), once the fd was closed by somebody else: closing it
+// already took it out of the epoll set, and its number may be in use again.
+void loop_io_closed(loop_t *loop, loop_io *io) {
+    if (io->fd == -1)
+        return;
+
+    for (int i = loop->event_idx + 1; i < loop->nevents; i++) {
+        if (loop->events[i].data.ptr == io)
+            loop->events[i].data.ptr = NULL;
+    }
+
+    io->fd = -1;
+}
+
+void loop_timer_init(loop_timer *timer, loop_timer_cb cb, void *data) {
+    timer->expires = 0;
+    timer->interval = 0;
+    timer->idx = 0;
+    timer->cb = cb;
+    timer->data = data;
+}
+
+// Runs the timer after ms, then every interval ms unless that's 0. Starting a
+// pending timer reschedules it.
+void loop_timer_start(loop_t *loop, loop_timer *timer, uint64_t after, uint64_t interval) {
+    loop_timer_stop(loop, timer);
+
+    timer->expires = loop_now() + after;
+    timer->interval = interval;
+
+    if (loop->ntimers + 1 >= loop->timers_cap) {
+        loop->timers_cap = loop->timers_cap ? loop->timers_cap * 2 : 16;
+        loop->timers = mem_realloc(loop->timers, loop->timers_cap * sizeof(loop_timer *));
+    }
+
+    timer->idx = ++loop->ntimers;
+    loop->timers[timer->idx] = timer;
+
+    sift_up(loop, timer->idx);
+}
+
+void loop_timer_stop(loop_t *loop, loop_timer *timer) {
+    const size_t idx = timer->idx;
+
+    if (!idx)
+        return;
+
+    timer->idx = 0;
+
+    if (idx == loop->ntimers--)
+        return;
+
+    loop_timer *last = loop->timers[loop->ntimers + 1];
+
+    loop->timers[idx] = last;
+    last->idx = idx;
+
+    sift_up(loop, idx);
+    sift_down(loop, last->idx);
+}
+
+bool loop_timer_pending(const loop_timer *timer) {
+    return timer->idx != 0;
+}
+
+void loop_task_init(loop_task *task, loop_task_cb cb, void *data) {
+    task->next = NULL;
+    task->queued = false;
+    task->cb = cb;
+    task->data = data;
+}
+
+// Runs the task once the events of this iteration were handled, and the next
+// wait doesn't block until it ran. Deferring a queued task again does nothing.
+void loop_defer(loop_t *loop, loop_task *task) {
+    if (task->queued)
+        return;
+
+    task->queued = true;
+    task->next = NULL;
+
+    *loop->tasks_tail = task;
+    loop->tasks_tail = &task->next;
+}
+
+// Tasks deferred by the tasks run in the next iteration, after the events
+// that came in meanwhile.
+static void run_tasks(loop_t *loop) {
+    loop_task *task = loop->tasks;
+
+    loop->tasks = NULL;
+    loop->tasks_tail = &loop->tasks;
+
+    while (task) {
+        loop_task *next = task->next;
+
+        task->next = NULL;
+        task->queued = false;
+        task->cb(task);
+
+        task = next;
+    }
+}
+
+// Blocks the signal in the calling thread and has the loop handle it instead.
+// Threads started afterwards inherit the mask, so set up signals before them.
+int loop_signal(loop_t *loop, int signo, loop_signal_cb cb, void *data) {
+    if (loop->nhandlers == LOOP_MAX_SIGNALS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    sigaddset(&loop->signals, signo);
+
+    const int err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (err) {
+        LOG(ERROR, "pthread_sigmask() failed: %s", strerror(err));
+        return -1;
+    }
+
+    if (loop->signal_io.fd != -1) {
+        if (signalfd(loop->signal_io.fd, &loop->signals, 0) == -1) {
+            LOG(ERROR, "signalfd() failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    else {
+        const int fd = signalfd(-1, &loop->signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        if (fd == -1) {
+            LOG(ERROR, "signalfd() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        if (loop_io_start(loop, &loop->signal_io, fd, EPOLLIN) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    loop->handlers[loop->nhandlers].signo = signo;
+    loop->handlers[loop->nhandlers].cb = cb;
+    loop->handlers[loop->nhandlers].data = data;
+    loop->nhandlers++;
+
+    return 0;
+}
+
+// Runs until loop_stop() is called from a callback, returns -1 if waiting
+// failed.
+int loop_run(loop_t *loop) {
+    while (!loop->stopped) {
+        arm_timer(loop);
+
+        const int ret = epoll_wait(loop->epoll_fd, loop->events, LOOP_MAX_EVENTS, loop->tasks ? 0 : -1);
+
+        if (ret == -1) {
+            // io_uring task work interrupts the wait too, then shows up as
+            // the ring fd becoming readable
+            if (errno == EINTR)
+                continue;
+
+            LOG(ERROR, "epoll_wait() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        loop->nevents = ret;
+
+        for (loop->event_idx = 0; loop->event_idx < loop->nevents; loop->event_idx++) {
+            loop_io *io = loop->events[loop->event_idx].data.ptr;
+
+            // stopped while handling an earlier event
+            if (io)
+                io->cb(io, loop->events[loop->event_idx].events);
+        }
+
+        loop->nevents = 0;
+        loop->event_idx = 0;
+
+        run_tasks(loop);
+    }
+
+    return 0;
+}
+
+void loop_stop(loop_t *loop) {
+    loop->stopped = true;
+}
+
+void loop_free(loop_t *loop) {
+    if (loop->timer_io.fd != -1)
+        close(loop->timer_io.fd);
+
+    if (loop->signal_io.fd != -1)
+        close(loop->signal_io.fd);
+
+    if (loop->epoll_fd != -1)
+        close(loop->epoll_fd);
+
+    free(loop->timers);
+
+    loop->timers = NULL;
+    loop->timer_io.fd = -1;
+    loop->signal_io.fd = -1;
+    loop->epoll_fd = -1;
+}
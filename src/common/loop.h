@@ -0,0 +1,102 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/epoll.h>
+
+#define LOOP_MAX_EVENTS 64
+#define LOOP_MAX_SIGNALS 8
+
+// Event loop of one thread: fd watchers on epoll, timers on the monotonic
+// clock and tasks deferred to the end of the current iteration. The timers
+// sit in a min-heap with the earliest one armed on a timerfd, and signals
+// come in through a signalfd, so the wait never has to time out: the thread
+// only wakes up when an fd is ready or a timer is due. Watchers, timers and
+// tasks are owned by the caller and must not move while started.
+
+typedef struct loop_io loop_io;
+typedef struct loop_timer loop_timer;
+typedef struct loop_task loop_task;
+
+typedef void (*loop_io_cb)(loop_io *io, uint32_t events);
+typedef void (*loop_timer_cb)(loop_timer *timer);
+typedef void (*loop_task_cb)(loop_task *task);
+typedef void (*loop_signal_cb)(int signo, void *data);
+
+struct loop_io {
+    int fd; // -1 while not watched
+    uint32_t events;
+    loop_io_cb cb;
+    void *data;
+};
+
+struct loop_timer {
+    uint64_t expires;  // ms, CLOCK_MONOTONIC
+    uint64_t interval; // ms, 0 for a one-shot timer
+    size_t idx;        // in the heap, 0 while stopped
+    loop_timer_cb cb;
+    void *data;
+};
+
+struct loop_task {
+    loop_task *next;
+    bool queued;
+    loop_task_cb cb;
+    void *data;
+};
+
+typedef struct {
+    int epoll_fd;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int nevents;
+    int event_idx; // being dispatched
+
+    loop_io timer_io;
+    loop_timer **timers; // min-heap by expiry, from index 1
+    size_t ntimers;
+    size_t timers_cap;
+    uint64_t armed; // expiry the timerfd is set to, 0 if disarmed
+
+    loop_io signal_io; // fd -1 until a signal is handled
+    sigset_t signals;
+    struct {
+        int signo;
+        loop_signal_cb cb;
+        void *data;
+    } handlers[LOOP_MAX_SIGNALS];
+    size_t nhandlers;
+
+    loop_task *tasks;
+    loop_task **tasks_tail;
+
+    bool stopped;
+} loop_t;
+
+int loop_init(loop_t *loop);
+uint64_t loop_now(void);
+
+void loop_io_init(loop_io *io, loop_io_cb cb, void *data);
+int loop_io_start(loop_t *loop, loop_io *io, int fd, uint32_t events);
+int loop_io_modify(loop_t *loop, loop_io *io, uint32_t events);
+void loop_io_stop(loop_t *loop, loop_io *io);
+void loop_io_closed(loop_t *loop, loop_io *io);
+
+void loop_timer_init(loop_timer *timer, loop_timer_cb cb, void *data);
+void loop_timer_start(loop_t *loop, loop_timer *timer, uint64_t after, uint64_t interval);
+void loop_timer_stop(loop_t *loop, loop_timer *timer);
+bool loop_timer_pending(const loop_timer *timer);
+
+void loop_task_init(loop_task *task, loop_task_cb cb, void *data);
+void loop_defer(loop_t *loop, loop_task *task);
+
+int loop_signal(loop_t *loop, int signo, loop_signal_cb cb, void *data);
+
+int loop_run(loop_t *loop);
+void loop_stop(loop_t *loop);
+void loop_free(loop_t *loop);
+
+#endif
@@ -26,3 +26,13 @@ void *mem_zalloc(size_t size) {
 
     return ptr;
 }
+void *mem_realloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+
+    if (!ptr && size) {
+        LOG(ERROR, "realloc() failed: %s", strerror(errno));
+        abort();
+    }
+
+    return ptr;
+}
@@ -5,5 +5,6 @@
 
 void *mem_alloc(size_t size);
 void *mem_zalloc(size_t size);
+void *mem_realloc(void *ptr, size_t size);
 
 #endif
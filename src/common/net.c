@@ -9,12 +9,28 @@
 
 #include "log.h"
 
-bool net_addr_matches(struct sockaddr_in *a, struct sockaddr_in *b) {
+bool net_addr_matches(const struct sockaddr_in *a, const struct sockaddr_in *b) {
     return a->sin_addr.s_addr == b->sin_addr.s_addr;
 }
-bool net_addr_and_port_matches(struct sockaddr_in *a, struct sockaddr_in *b) {
+bool net_addr_and_port_matches(const struct sockaddr_in *a, const struct sockaddr_in *b) {
     return net_addr_matches(a, b) && a->sin_port == b->sin_port;
 }
+bool net_endpoint_matches(const wg_endpoint *a, const wg_endpoint *b) {
+    if (a->addr.sa_family != b->addr.sa_family)
+        return false;
+
+    switch (a->addr.sa_family) {
+        case AF_INET:
+            return a->addr4.sin_addr.s_addr == b->addr4.sin_addr.s_addr &&
+                   a->addr4.sin_port == b->addr4.sin_port;
+        case AF_INET6:
+            return memcmp(&a->addr6.sin6_addr, &b->addr6.sin6_addr, sizeof(struct in6_addr)) == 0 &&
+                   a->addr6.sin6_port == b->addr6.sin6_port &&
+                   a->addr6.sin6_scope_id == b->addr6.sin6_scope_id;
+    }
+
+    return true;
+}
 bool net_resolve_host(const char *host, struct sockaddr_in *addr) {
     struct addrinfo *info;
 
@@ -63,7 +79,7 @@ error:
     free(str);
     return false;
 }
-char *net_addr_to_str(struct sockaddr_in *addr, char buf[ADDR_MAX_LEN]) {
+char *net_addr_to_str(const struct sockaddr_in *addr, char buf[ADDR_MAX_LEN]) {
     if (inet_ntop(AF_INET, &addr->sin_addr, buf, ADDR_MAX_LEN) == NULL) {
         LOG(ERROR, "inet_ntop() failed: %s", strerror(errno));
         buf[0] = '\0';
@@ -1,7 +1,9 @@
 #include "packets.h"
 
+#include <endian.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "log.h"
 #include "mem.h"
@@ -16,19 +18,88 @@ packet_t *packet_allocate(const uint16_t type) {
     return packet;
 }
 
+packet_t *packet_allocate_bulk(const uint16_t type, const uint32_t count) {
+    packet_t *packet = mem_alloc(packet_bulk_frame_size(type, count));
+
+    packet_init_bulk(packet, type, count);
+
+    return packet;
+}
+
+void packet_init_bulk(packet_t *packet, const uint16_t type, const uint32_t count) {
+    packet->header.version = PROTOCOL_VERSION;
+    packet->header.type = type;
+    packet->header.size = packet_get_size(type) + count * packet_get_record_size(type);
+
+    // every bulk packet starts with its record count
+    packet->endpoint_info_bulk_req.count = count;
+}
+
+uint32_t packet_bulk_frame_size(const uint16_t type, const uint32_t count) {
+    return sizeof(packet_header) + packet_get_size(type) + count * packet_get_record_size(type);
+}
+
 uint32_t packet_get_size(const uint16_t type) {
     switch (type) {
         case PACKET_TYPE_KEEPALIVE:
+        case PACKET_TYPE_HELLO_REQ:
             return 0;
+        case PACKET_TYPE_HELLO:
+            return sizeof(packet_hello);
         case PACKET_TYPE_ENDPOINT_INFO_REQ:
             return sizeof(packet_endpoint_info_req);
         case PACKET_TYPE_ENDPOINT_INFO_RES:
             return sizeof(packet_endpoint_info_res);
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_REQ:
+            return sizeof(packet_endpoint_info_bulk_req);
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_RES:
+            return sizeof(packet_endpoint_info_bulk_res);
+        case PACKET_TYPE_UNSUBSCRIBE:
+            return sizeof(packet_unsubscribe);
+        case PACKET_TYPE_RESYNC_REQ:
+            return sizeof(packet_resync_req);
+        case PACKET_TYPE_SEQ:
+            return sizeof(packet_seq);
     }
 
     return 0;
 }
 
+uint32_t packet_get_record_size(const uint16_t type) {
+    switch (type) {
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_REQ:
+        case PACKET_TYPE_UNSUBSCRIBE:
+        case PACKET_TYPE_RESYNC_REQ:
+            return sizeof(wg_key);
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_RES:
+            return sizeof(packet_endpoint_record);
+    }
+
+    return 0;
+}
+
+// The keys of a packet made of a list of them, NULL for any other type.
+wg_key *packet_bulk_keys(packet_t *packet) {
+    switch (packet->header.type) {
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_REQ:
+            return packet->endpoint_info_bulk_req.public_keys;
+        case PACKET_TYPE_UNSUBSCRIBE:
+            return packet->unsubscribe.public_keys;
+        case PACKET_TYPE_RESYNC_REQ:
+            return packet->resync_req.public_keys;
+    }
+
+    return NULL;
+}
+
+uint32_t packet_bulk_capacity(const uint16_t type, const uint32_t max_frame_size) {
+    const uint32_t overhead = sizeof(packet_header) + packet_get_size(type);
+
+    if (max_frame_size <= overhead)
+        return 0;
+
+    return (max_frame_size - overhead) / packet_get_record_size(type);
+}
 
 int packet_parse_header(packet_header *header) {
     header->version = ntohs(header->version);
@@ -43,10 +114,120 @@ int packet_parse_header(packet_header *header) {
     LOG(DEBUG, "type = %x", header->type);
     LOG(DEBUG, "size = %d", header->size);
 
-    if (packet_get_size(header->type) != header->size) {
+    const uint32_t size = packet_get_size(header->type);
+    const uint32_t record_size = packet_get_record_size(header->type);
+
+    if (record_size) {
+        if (header->size < size || header->size > PACKET_MAX_FRAME_SIZE - sizeof(packet_header) ||
+            (header->size - size) % record_size != 0) {
+            LOG(ERROR, "error parsing packet: size mismatch.");
+            return -1;
+        }
+    }
+    else if (size != header->size) {
         LOG(ERROR, "error parsing packet: size mismatch.");
         return -1;
     }
 
     return 0;
 }
+
+int packet_parse_payload(packet_t *packet) {
+    switch (packet->header.type) {
+        case PACKET_TYPE_HELLO:
+            packet->hello.max_frame_size = ntohl(packet->hello.max_frame_size);
+            break;
+        case PACKET_TYPE_SEQ:
+            packet->seq.epoch = be64toh(packet->seq.epoch);
+            packet->seq.seq = be64toh(packet->seq.seq);
+            break;
+        case PACKET_TYPE_RESYNC_REQ:
+            packet->resync_req.more = ntohl(packet->resync_req.more);
+            packet->resync_req.epoch = be64toh(packet->resync_req.epoch);
+            packet->resync_req.seq = be64toh(packet->resync_req.seq);
+            // the key count is checked like for the other bulk packets
+            /* fallthrough */
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_REQ:
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_RES:
+        case PACKET_TYPE_UNSUBSCRIBE: {
+            const uint32_t count = ntohl(packet->endpoint_info_bulk_req.count);
+            const uint32_t records = (packet->header.size - packet_get_size(packet->header.type)) /
+                                     packet_get_record_size(packet->header.type);
+
+            if (count != records) {
+                LOG(ERROR, "error parsing packet: record count mismatch.");
+                return -1;
+            }
+
+            packet->endpoint_info_bulk_req.count = count;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void packet_to_network(packet_t *packet) {
+    switch (packet->header.type) {
+        case PACKET_TYPE_HELLO:
+            packet->hello.max_frame_size = htonl(packet->hello.max_frame_size);
+            break;
+        case PACKET_TYPE_SEQ:
+            packet->seq.epoch = htobe64(packet->seq.epoch);
+            packet->seq.seq = htobe64(packet->seq.seq);
+            break;
+        case PACKET_TYPE_RESYNC_REQ:
+            packet->resync_req.more = htonl(packet->resync_req.more);
+            packet->resync_req.epoch = htobe64(packet->resync_req.epoch);
+            packet->resync_req.seq = htobe64(packet->resync_req.seq);
+            /* fallthrough */
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_REQ:
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_RES:
+        case PACKET_TYPE_UNSUBSCRIBE:
+            packet->endpoint_info_bulk_req.count = htonl(packet->endpoint_info_bulk_req.count);
+            break;
+    }
+
+    packet->header.version = htons(packet->header.version);
+    packet->header.type = htons(packet->header.type);
+    packet->header.size = htonl(packet->header.size);
+}
+
+bool packet_encode_endpoint(packet_endpoint_record *record, const wg_key public_key, const wg_endpoint *endpoint) {
+    memset(record, 0, sizeof(*record));
+    memcpy(record->public_key, public_key, sizeof(wg_key));
+
+    switch (endpoint->addr.sa_family) {
+        case AF_INET:
+            record->family = PACKET_ADDR_IPV4;
+            record->port = endpoint->addr4.sin_port;
+            memcpy(record->addr, &endpoint->addr4.sin_addr, sizeof(struct in_addr));
+            return true;
+        case AF_INET6:
+            record->family = PACKET_ADDR_IPV6;
+            record->port = endpoint->addr6.sin6_port;
+            memcpy(record->addr, &endpoint->addr6.sin6_addr, sizeof(struct in6_addr));
+            return true;
+    }
+
+    return false;
+}
+
+bool packet_decode_endpoint(const packet_endpoint_record *record, wg_endpoint *endpoint) {
+    memset(endpoint, 0, sizeof(*endpoint));
+
+    switch (record->family) {
+        case PACKET_ADDR_IPV4:
+            endpoint->addr4.sin_family = AF_INET;
+            endpoint->addr4.sin_port = record->port;
+            memcpy(&endpoint->addr4.sin_addr, record->addr, sizeof(struct in_addr));
+            return true;
+        case PACKET_ADDR_IPV6:
+            endpoint->addr6.sin6_family = AF_INET6;
+            endpoint->addr6.sin6_port = record->port;
+            memcpy(&endpoint->addr6.sin6_addr, record->addr, sizeof(struct in6_addr));
+            return true;
+    }
+
+    return false;
+}
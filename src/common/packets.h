@@ -7,9 +7,40 @@
 
 #define PROTOCOL_VERSION 1
 
-#define PACKET_TYPE_KEEPALIVE         0x30
-#define PACKET_TYPE_ENDPOINT_INFO_REQ 0x3E
-#define PACKET_TYPE_ENDPOINT_INFO_RES 0x3F
+#define PACKET_TYPE_KEEPALIVE              0x30
+#define PACKET_TYPE_HELLO_REQ              0x31
+#define PACKET_TYPE_HELLO                  0x32
+#define PACKET_TYPE_ENDPOINT_INFO_REQ      0x3E
+#define PACKET_TYPE_ENDPOINT_INFO_RES      0x3F
+#define PACKET_TYPE_ENDPOINT_INFO_BULK_REQ 0x40
+#define PACKET_TYPE_ENDPOINT_INFO_BULK_RES 0x41
+#define PACKET_TYPE_UNSUBSCRIBE            0x42
+#define PACKET_TYPE_RESYNC_REQ             0x43
+#define PACKET_TYPE_SEQ                    0x44
+
+// New packet types are only sent once the other side has shown it knows them:
+// an older peer can't skip a packet it doesn't know the size of. A client
+// sends the empty HELLO_REQ, the server answers with HELLO carrying its
+// maximum frame size and the client confirms the negotiated size with its
+// own HELLO. Bulk packets are used from then on.
+
+// Asking for the endpoint of a peer subscribes the client to its changes,
+// which the server then pushes as they happen. PACKET_TYPE_UNSUBSCRIBE ends
+// the subscription, e.g. once the peer was removed from the client's device.
+
+// Every change the server pushes gets a sequence number, valid within the
+// epoch the server picked at startup. Clients asking with
+// PACKET_TYPE_RESYNC_REQ are told the sequence number they are at with
+// PACKET_TYPE_SEQ. After a reconnect they send it back, and only the peers
+// changed since then are answered, unless the server no longer remembers that
+// far back.
+
+// largest frame, header included, either side is willing to receive
+#define PACKET_MAX_FRAME_SIZE 65536
+#define PACKET_MIN_FRAME_SIZE 512
+
+#define PACKET_ADDR_IPV4 4
+#define PACKET_ADDR_IPV6 6
 
 typedef struct PACKET_ATTR {
     uint16_t version;
@@ -17,6 +48,10 @@ typedef struct PACKET_ATTR {
     uint32_t size;
 } packet_header;
 
+typedef struct PACKET_ATTR {
+    uint32_t max_frame_size;
+} packet_hello;
+
 typedef struct PACKET_ATTR {
     wg_key public_key;
 } packet_endpoint_info_req;
@@ -27,21 +62,75 @@ typedef struct PACKET_ATTR {
     unsigned short port;
 } packet_endpoint_info_res;
 
+typedef struct PACKET_ATTR {
+    wg_key public_key;
+    uint8_t family;
+    uint8_t reserved;
+    uint16_t port;
+    uint8_t addr[16];
+} packet_endpoint_record;
+
+typedef struct PACKET_ATTR {
+    uint32_t count;
+    wg_key public_keys[];
+} packet_endpoint_info_bulk_req;
+
+typedef struct PACKET_ATTR {
+    uint32_t count;
+    packet_endpoint_record records[];
+} packet_endpoint_info_bulk_res;
+
+typedef struct PACKET_ATTR {
+    uint32_t count;
+    wg_key public_keys[];
+} packet_unsubscribe;
+
+typedef struct PACKET_ATTR {
+    uint32_t count;
+    uint32_t more; // frames of the same request still following, 0 from older clients
+    uint64_t epoch; // 0 asks for the endpoints of all peers
+    uint64_t seq;
+    wg_key public_keys[];
+} packet_resync_req;
+
+typedef struct PACKET_ATTR {
+    uint64_t epoch;
+    uint64_t seq;
+} packet_seq;
+
 typedef struct PACKET_ATTR {
     packet_header header;
 
     union {
         void *data;
+        packet_hello hello;
         packet_endpoint_info_req endpoint_info_req;
         packet_endpoint_info_res endpoint_info_res;
+        packet_endpoint_info_bulk_req endpoint_info_bulk_req;
+        packet_endpoint_info_bulk_res endpoint_info_bulk_res;
+        packet_unsubscribe unsubscribe;
+        packet_resync_req resync_req;
+        packet_seq seq;
     };
 } packet_t;
 
 packet_t *packet_allocate(const uint16_t type);
+packet_t *packet_allocate_bulk(const uint16_t type, const uint32_t count);
+void packet_init_bulk(packet_t *packet, const uint16_t type, const uint32_t count);
+uint32_t packet_bulk_frame_size(const uint16_t type, const uint32_t count);
+wg_key *packet_bulk_keys(packet_t *packet);
 uint32_t packet_get_size(const uint16_t type);
+uint32_t packet_get_record_size(const uint16_t type);
+uint32_t packet_bulk_capacity(const uint16_t type, const uint32_t max_frame_size);
 
 #define PACKET_NEW(packet) packet_allocate(PACKET_TYPE_##packet)
+#define PACKET_NEW_BULK(packet, count) packet_allocate_bulk(PACKET_TYPE_##packet, count)
 
 int packet_parse_header(packet_header *header);
+int packet_parse_payload(packet_t *packet);
+void packet_to_network(packet_t *packet);
+
+bool packet_encode_endpoint(packet_endpoint_record *record, const wg_key public_key, const wg_endpoint *endpoint);
+bool packet_decode_endpoint(const packet_endpoint_record *record, wg_endpoint *endpoint);
 
 #endif
@@ -0,0 +1,247 @@
+#include "peertable.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "net.h"
+
+void peertable_init(peertable_t *table) {
+    table->keys = NULL;
+    table->endpoints = NULL;
+    table->size = 0;
+    table->cap = 0;
+}
+
+void peertable_reserve(peertable_t *table, size_t size) {
+    if (size <= table->cap)
+        return;
+
+    size_t cap = table->cap ? table->cap : 16;
+
+    while (cap < size)
+        cap *= 2;
+
+    table->keys = mem_realloc(table->keys, cap * sizeof(wg_key));
+    table->endpoints = mem_realloc(table->endpoints, cap * sizeof(wg_endpoint));
+    table->cap = cap;
+}
+
+// Appends without keeping the order, sort the table once filled.
+void peertable_append(peertable_t *table, const wg_key key, const wg_endpoint *endpoint) {
+    peertable_reserve(table, table->size + 1);
+
+    memcpy(table->keys[table->size], key, sizeof(wg_key));
+    table->endpoints[table->size] = *endpoint;
+    table->size++;
+}
+
+static int compare_records(const void *a, const void *b) {
+    return memcmp(((const wg_peer_endpoint *)a)->public_key, ((const wg_peer_endpoint *)b)->public_key, sizeof(wg_key));
+}
+
+// Sorts the peers by public key, keeping the first of any duplicates.
+void peertable_sort(peertable_t *table) {
+    if (table->size < 2)
+        return;
+
+    wg_peer_endpoint *records = mem_alloc(table->size * sizeof(wg_peer_endpoint));
+
+    for (size_t i = 0; i < table->size; i++) {
+        memcpy(records[i].public_key, table->keys[i], sizeof(wg_key));
+        records[i].endpoint = table->endpoints[i];
+    }
+
+    qsort(records, table->size, sizeof(wg_peer_endpoint), compare_records);
+
+    size_t size = 0;
+
+    for (size_t i = 0; i < table->size; i++) {
+        if (size && memcmp(table->keys[size - 1], records[i].public_key, sizeof(wg_key)) == 0)
+            continue;
+
+        memcpy(table->keys[size], records[i].public_key, sizeof(wg_key));
+        table->endpoints[size] = records[i].endpoint;
+        size++;
+    }
+
+    table->size = size;
+
+    free(records);
+}
+
+size_t peertable_find(const peertable_t *table, const wg_key key) {
+    size_t low = 0, high = table->size;
+
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        const int cmp = memcmp(table->keys[mid], key, sizeof(wg_key));
+
+        if (cmp == 0)
+            return mid;
+
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return PEERTABLE_NONE;
+}
+
+void peertable_compare(const peertable_t *old, const peertable_t *new, peertable_compare_cb cb, void *data) {
+    size_t i = 0, j = 0;
+
+    while (i < old->size || j < new->size) {
+        int cmp;
+
+        if (i == old->size)
+            cmp = 1;
+        else if (j == new->size)
+            cmp = -1;
+        else
+            cmp = memcmp(old->keys[i], new->keys[j], sizeof(wg_key));
+
+        if (cmp < 0) {
+            cb(i++, PEERTABLE_NONE, data);
+        }
+        else if (cmp > 0) {
+            cb(PEERTABLE_NONE, j++, data);
+        }
+        else {
+            if (!net_endpoint_matches(&old->endpoints[i], &new->endpoints[j]))
+                cb(i, j, data);
+
+            i++;
+            j++;
+        }
+    }
+}
+
+static int append_peer(const wg_peer *peer, void *data) {
+    peertable_append(data, peer->public_key, &peer->endpoint);
+
+    return 0;
+}
+
+// Fills the table with the public keys and endpoints of the device's peers,
+// which is all the daemons look at. If device isn't NULL, it receives the
+// device's own fields but no peers.
+int peertable_dump(peertable_t *table, wg_ctx *wg, const char *name, wg_device *device) {
+    int ret;
+
+    do {
+        table->size = 0;
+
+        if (device)
+            memset(device, 0, sizeof(wg_device));
+
+        ret = wg_ctx_dump_peers(wg, name, device, WGPEER_FIELD_ENDPOINT, append_peer, table);
+    } while (ret == -EINTR);
+
+    if (ret < 0) {
+        table->size = 0;
+        errno = -ret;
+        return ret;
+    }
+
+    peertable_sort(table);
+
+    return 0;
+}
+
+// Starts an asynchronous peertable_dump(), see wg_ctx_dump_peers_start().
+int peertable_dump_start(peertable_t *table, wg_ctx *wg, const char *name, wg_device *device) {
+    table->size = 0;
+
+    if (device)
+        memset(device, 0, sizeof(wg_device));
+
+    return wg_ctx_dump_peers_start(wg, name, device, WGPEER_FIELD_ENDPOINT, append_peer, table);
+}
+
+// Returns 1 while the dump goes on and 0 once the table is complete. An
+// interrupted dump fails with -EINTR and has to be started again.
+int peertable_dump_step(peertable_t *table, wg_ctx *wg) {
+    const int ret = wg_ctx_dump_peers_step(wg);
+
+    if (ret < 0) {
+        table->size = 0;
+        return ret;
+    }
+
+    if (ret == 0)
+        peertable_sort(table);
+
+    return ret;
+}
+
+void peertable_from_device(peertable_t *table, const wg_device *device) {
+    wg_peer *peer;
+
+    table->size = 0;
+
+    wg_for_each_peer(device, peer) {
+        peertable_append(table, peer->public_key, &peer->endpoint);
+    }
+
+    peertable_sort(table);
+}
+
+// Builds a device for wg_set_device() that sets the endpoints of the peers.
+// The device and its peers are a single allocation, free it with
+// wg_free_device(). Returns NULL with errno set if it can't be allocated.
+wg_device *peertable_to_device(const peertable_t *table, const char *name) {
+    // the size of the device and its peers must not overflow
+    if (table->size > (SIZE_MAX - sizeof(wg_device)) / sizeof(wg_peer)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    wg_arena *arena = wg_arena_new();
+
+    if (!arena) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    wg_device *device = wg_arena_alloc(arena, sizeof(wg_device) + table->size * sizeof(wg_peer));
+
+    if (!device) {
+        wg_arena_free(arena);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    wg_peer *peers = (wg_peer *)(device + 1);
+
+    strncpy(device->name, name, sizeof(device->name) - 1);
+    device->arena = arena;
+
+    for (size_t i = 0; i < table->size; i++) {
+        peers[i].flags = WGPEER_HAS_PUBLIC_KEY;
+        memcpy(peers[i].public_key, table->keys[i], sizeof(wg_key));
+        peers[i].endpoint = table->endpoints[i];
+        peers[i].next_peer = i + 1 < table->size ? &peers[i + 1] : NULL;
+    }
+
+    if (table->size) {
+        device->first_peer = &peers[0];
+        device->last_peer = &peers[table->size - 1];
+    }
+
+    return device;
+}
+
+void peertable_clear(peertable_t *table) {
+    table->size = 0;
+}
+
+void peertable_free(peertable_t *table) {
+    free(table->keys);
+    free(table->endpoints);
+
+    peertable_init(table);
+}
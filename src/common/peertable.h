@@ -0,0 +1,40 @@
+#ifndef PEERTABLE_H
+#define PEERTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wireguard.h"
+
+#define PEERTABLE_NONE ((size_t)-1)
+
+// Peers of a device as an array of public keys sorted for binary search, with
+// their endpoints in a parallel array. Two tables are compared in a single
+// merge pass over both.
+
+typedef struct {
+    wg_key *keys;
+    wg_endpoint *endpoints;
+    size_t size;
+    size_t cap;
+} peertable_t;
+
+// Called for each peer only in old (new_index is PEERTABLE_NONE), only in new
+// (old_index is PEERTABLE_NONE) or in both with a different endpoint.
+typedef void (*peertable_compare_cb)(size_t old_index, size_t new_index, void *data);
+
+void peertable_init(peertable_t *table);
+void peertable_reserve(peertable_t *table, size_t size);
+void peertable_append(peertable_t *table, const wg_key key, const wg_endpoint *endpoint);
+void peertable_sort(peertable_t *table);
+size_t peertable_find(const peertable_t *table, const wg_key key);
+void peertable_compare(const peertable_t *old, const peertable_t *new, peertable_compare_cb cb, void *data);
+int peertable_dump(peertable_t *table, wg_ctx *wg, const char *name, wg_device *device);
+int peertable_dump_start(peertable_t *table, wg_ctx *wg, const char *name, wg_device *device);
+int peertable_dump_step(peertable_t *table, wg_ctx *wg);
+void peertable_from_device(peertable_t *table, const wg_device *device);
+wg_device *peertable_to_device(const peertable_t *table, const char *name);
+void peertable_clear(peertable_t *table);
+void peertable_free(peertable_t *table);
+
+#endif
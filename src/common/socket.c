@@ -1,14 +1,19 @@
+#define _GNU_SOURCE
+
 #include "socket.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "packets.h"
 #include "log.h"
+#include "mem.h"
 
 int socket_create_tcp() {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -58,14 +63,17 @@ int socket_set_non_blocking(const int fd) {
     return 0;
 }
 
-int socket_accept(const int fd) {
-    struct sockaddr_in addr;
-    socklen_t size = sizeof(addr);
+// Accepts a connection as a non-blocking socket, returns -1 with errno set to
+// EAGAIN once none are pending. Other errors are left to the caller to report,
+// they tend to repeat for every pending connection.
+int socket_accept(const int fd, struct sockaddr_in *addr) {
+    socklen_t size = sizeof(*addr);
+    int ret;
 
-    const int ret = accept(fd, (struct sockaddr *)&addr, &size);
+    while ((ret = accept4(fd, (struct sockaddr *)addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+        if (errno == EINTR)
+            continue;
 
-    if (ret < 0) {
-        LOG(ERROR, "accept() failed: %s", strerror(errno));
         return -1;
     }
 
@@ -93,57 +101,262 @@ int socket_send(const int fd, const void *data, const size_t size) {
     return SOCK_OK;
 }
 
-int socket_read(const int fd, void *data, const size_t size) {
-    ssize_t bytesRead = 0;
+int socket_send_packet(const int fd, packet_t *packet) {
+    const uint32_t size = packet->header.size;
+
+    packet_to_network(packet);
+
+    return socket_send(fd, packet, sizeof(packet->header) + size);
+}
+
+void socket_buffer_reset(socket_buffer *buf) {
+    buf->start = 0;
+    buf->end = 0;
+    buf->need = 0;
+}
+
+void socket_buffer_free(socket_buffer *buf) {
+    free(buf->data);
+
+    buf->data = NULL;
+    buf->cap = 0;
+
+    socket_buffer_reset(buf);
+}
+
+static void resize_buffer(socket_buffer *buf) {
+    size_t cap = buf->cap;
+
+    // grow for a large frame, shrink back once nothing is buffered anymore
+    if (buf->need > cap)
+        cap = buf->need;
+    else if (!buf->end || !cap)
+        cap = SOCKET_BUFFER_MIN_SIZE;
+
+    if (cap == buf->cap)
+        return;
+
+    buf->data = mem_realloc(buf->data, cap);
+    buf->cap = cap;
+}
+
+// Frames handed out by socket_next_packet() are no longer referenced once
+// more data is to be received.
+static void compact_buffer(socket_buffer *buf) {
+    if (!buf->start)
+        return;
+
+    memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+
+    buf->end -= buf->start;
+    buf->start = 0;
+}
+
+int socket_fill(const int fd, socket_buffer *buf) {
+    compact_buffer(buf);
+    resize_buffer(buf);
+
+    // the frames already buffered have to be consumed first
+    if (buf->end == buf->cap)
+        return SOCK_OK;
 
-    while (bytesRead != size) {
-        ssize_t ret = read(fd, data + bytesRead, size - bytesRead);
+    ssize_t ret;
 
-        if (ret == 0)
+    while ((ret = recv(fd, buf->data + buf->end, buf->cap - buf->end, 0)) < 0) {
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return SOCK_AGAIN;
+
+        if (errno == ECONNRESET)
             return SOCK_DISCONNECTED;
 
-        if (ret < 0) {
-            if (errno == EAGAIN)
-                return SOCK_AGAIN;
+        LOG(ERROR, "recv() failed: %s", strerror(errno));
 
-            LOG(ERROR, "read() failed: %s", strerror(errno));
+        return SOCK_ERROR;
+    }
 
-            return SOCK_ERROR;
-        }
+    if (ret == 0)
+        return SOCK_DISCONNECTED;
+
+    buf->end += ret;
+
+    return SOCK_OK;
+}
+
+// Takes data received without socket_fill(), e.g. into an io_uring provided
+// buffer. Unlike socket_fill() the buffer grows to take all of it.
+void socket_buffer_append(socket_buffer *buf, const void *data, size_t size) {
+    compact_buffer(buf);
+
+    size_t cap = buf->end && buf->cap ? buf->cap : SOCKET_BUFFER_MIN_SIZE;
 
-        bytesRead += ret;
+    while (cap < buf->end + size)
+        cap *= 2;
+
+    if (cap != buf->cap) {
+        buf->data = mem_realloc(buf->data, cap);
+        buf->cap = cap;
     }
 
+    memcpy(buf->data + buf->end, data, size);
+    buf->end += size;
+}
+
+// Whether a complete frame is buffered, the frame itself isn't checked.
+bool socket_buffer_ready(const socket_buffer *buf) {
+    const size_t available = buf->end - buf->start;
+
+    if (available < sizeof(packet_header) || buf->need > available)
+        return false;
+
+    packet_header header;
+
+    memcpy(&header, buf->data + buf->start, sizeof(header));
+
+    return sizeof(header) + ntohl(header.size) <= available;
+}
+
+int socket_next_packet(socket_buffer *buf, packet_t **packet) {
+    const size_t available = buf->end - buf->start;
+
+    if (available < sizeof(packet_header))
+        return SOCK_AGAIN;
+
+    if (buf->need > available)
+        return SOCK_AGAIN;
+
+    // work on a copy, the frame is only converted in place once all of it arrived
+    packet_header header;
+
+    memcpy(&header, buf->data + buf->start, sizeof(header));
+
+    if (packet_parse_header(&header) == -1)
+        return SOCK_ERROR;
+
+    const size_t size = sizeof(header) + header.size;
+
+    if (size > available) {
+        buf->need = size;
+        return SOCK_AGAIN;
+    }
+
+    packet_t *frame = (packet_t *)(buf->data + buf->start);
+
+    frame->header = header;
+
+    if (packet_parse_payload(frame) == -1)
+        return SOCK_ERROR;
+
+    buf->start += size;
+    buf->need = 0;
+
+    *packet = frame;
+
     return SOCK_OK;
+}
+
+void socket_queue_push(socket_queue *queue, wirebuf_t *buf) {
+    if (queue->count == queue->cap) {
+        const size_t cap = queue->cap ? queue->cap * 2 : 16;
+        wirebuf_t **bufs = mem_alloc(cap * sizeof(wirebuf_t *));
 
+        for (size_t i = 0; i < queue->count; i++)
+            bufs[i] = queue->bufs[(queue->head + i) & (queue->cap - 1)];
+
+        free(queue->bufs);
+
+        queue->bufs = bufs;
+        queue->head = 0;
+        queue->cap = cap;
+    }
+
+    queue->bufs[(queue->head + queue->count++) & (queue->cap - 1)] = wirebuf_ref(buf);
+    queue->size += buf->size;
 }
 
-int socket_send_packet(const int fd, packet_t *packet) {
-    const uint32_t size = packet->header.size;
+// Fills iov with the queued data, at most max entries. Returns the number of
+// entries filled.
+size_t socket_queue_peek(const socket_queue *queue, struct iovec *iov, size_t max) {
+    size_t niov = 0;
 
-    packet->header.version = htons(packet->header.version);
-    packet->header.type = htons(packet->header.type);
-    packet->header.size = htonl(packet->header.size);
+    for (size_t i = 0; i < queue->count && niov < max; i++) {
+        wirebuf_t *buf = queue->bufs[(queue->head + i) & (queue->cap - 1)];
+        const size_t offset = i ? 0 : queue->offset;
 
-    return socket_send(fd, packet, sizeof(packet->header) + size);
+        iov[niov].iov_base = buf->data + offset;
+        iov[niov].iov_len = buf->size - offset;
+        niov++;
+    }
+
+    return niov;
 }
 
-int socket_read_packet(const int fd, packet_t *packet) {
-    if (!packet)
-        return -1;
+// Drops size bytes from the front of the queue after they were sent.
+void socket_queue_consume(socket_queue *queue, size_t size) {
+    queue->size -= size;
 
-    packet_header *header = &packet->header;
+    while (size) {
+        wirebuf_t *buf = queue->bufs[queue->head];
+        const size_t left = buf->size - queue->offset;
 
-    int ret;
+        if (size < left) {
+            queue->offset += size;
+            return;
+        }
 
-    if ((ret = socket_read(fd, header, sizeof(*header))) != SOCK_OK)
-        return ret;
+        size -= left;
 
-    if (packet_parse_header(header) == -1)
-        return -1;
+        wirebuf_unref(buf);
+
+        queue->head = (queue->head + 1) & (queue->cap - 1);
+        queue->count--;
+        queue->offset = 0;
+    }
+}
 
-    if ((ret = socket_read(fd, &packet->data, header->size)) != SOCK_OK)
-        return ret;
+// Sends as much of the queue as the socket takes without blocking, gathering
+// the queued frames into one sendmsg() call. Returns SOCK_AGAIN if some of it
+// is still queued.
+int socket_queue_flush(const int fd, socket_queue *queue) {
+    while (queue->count) {
+        struct iovec iov[SOCKET_QUEUE_MAX_IOV];
+        const size_t niov = socket_queue_peek(queue, iov, SOCKET_QUEUE_MAX_IOV);
 
-    return 0;
+        const struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = niov
+        };
+
+        const ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return SOCK_AGAIN;
+
+            if (errno == ECONNRESET || errno == EPIPE)
+                return SOCK_DISCONNECTED;
+
+            LOG(ERROR, "sendmsg() failed: %s", strerror(errno));
+
+            return SOCK_ERROR;
+        }
+
+        socket_queue_consume(queue, ret);
+    }
+
+    return SOCK_OK;
+}
+
+void socket_queue_free(socket_queue *queue) {
+    for (size_t i = 0; i < queue->count; i++)
+        wirebuf_unref(queue->bufs[(queue->head + i) & (queue->cap - 1)]);
+
+    free(queue->bufs);
+
+    memset(queue, 0, sizeof(*queue));
 }
@@ -1,21 +1,59 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
 #include "packets.h"
+#include "wirebuf.h"
 
 #define SOCK_OK 0
 #define SOCK_ERROR -1
 #define SOCK_DISCONNECTED -2
 #define SOCK_AGAIN -3
 
+#define SOCKET_BUFFER_MIN_SIZE 4096
+#define SOCKET_QUEUE_MAX_IOV 64
+
+// Receive buffer for one connection. Frames are parsed in place and stay
+// valid until the next socket_fill().
+typedef struct {
+    uint8_t *data;
+    size_t start; // first byte not handed out as a frame yet
+    size_t end;   // end of the received data
+    size_t cap;
+    size_t need;  // size of the incomplete frame at start, 0 if not known yet
+} socket_buffer;
+
+// Transmit queue of shared frames, sent with as few syscalls as possible.
+typedef struct {
+    wirebuf_t **bufs; // ring of cap entries starting at head
+    size_t head;
+    size_t count;
+    size_t cap;
+    size_t offset;    // bytes of the first frame already sent
+    size_t size;      // bytes still to send
+} socket_queue;
+
 int socket_create_tcp();
 int socket_create_udp();
 int socket_set_reuseport(const int fd);
 int socket_set_non_blocking(const int fd);
-int socket_accept(const int fd);
+int socket_accept(const int fd, struct sockaddr_in *addr);
 int socket_send(const int fd, const void *data, const size_t size);
-int socket_read(const int fd, void *data, const size_t size);
 int socket_send_packet(const int fd, packet_t *packet);
-int socket_read_packet(const int fd, packet_t *packet);
+void socket_buffer_reset(socket_buffer *buf);
+void socket_buffer_free(socket_buffer *buf);
+int socket_fill(const int fd, socket_buffer *buf);
+bool socket_buffer_ready(const socket_buffer *buf);
+void socket_buffer_append(socket_buffer *buf, const void *data, size_t size);
+int socket_next_packet(socket_buffer *buf, packet_t **packet);
+void socket_queue_push(socket_queue *queue, wirebuf_t *buf);
+size_t socket_queue_peek(const socket_queue *queue, struct iovec *iov, size_t max);
+void socket_queue_consume(socket_queue *queue, size_t size);
+int socket_queue_flush(const int fd, socket_queue *queue);
+void socket_queue_free(socket_queue *queue);
 
 #endif
@@ -34,7 +34,7 @@ char *wgutil_choose_device(const char *interface) {
     return chosen_device;
 }
 
-bool wgutil_key_matches(wg_key a, wg_key b) {
+bool wgutil_key_matches(const wg_key a, const wg_key b) {
     return memcmp(a, b, 32) == 0;
 }
 
@@ -4,7 +4,7 @@
 #include "wireguard.h"
 
 char *wgutil_choose_device(const char *interface);
-bool wgutil_key_matches(wg_key a, wg_key b);
+bool wgutil_key_matches(const wg_key a, const wg_key b);
 bool wgutil_key_from_base64(wg_key key, const char *b64str);
 
 #endif
@@ -0,0 +1,62 @@
+#include "wirebuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+wirebuf_t *wirebuf_new(size_t size) {
+    wirebuf_t *buf = mem_alloc(sizeof(wirebuf_t) + size);
+
+    buf->refs = 1;
+    buf->size = size;
+
+    return buf;
+}
+
+// Room for a bulk packet of up to count records, built in place.
+wirebuf_t *wirebuf_new_bulk(const uint16_t type, const uint32_t count) {
+    wirebuf_t *buf = wirebuf_new(packet_bulk_frame_size(type, count));
+
+    packet_init_bulk(wirebuf_packet(buf), type, count);
+
+    return buf;
+}
+
+wirebuf_t *wirebuf_from_packet(const packet_t *packet) {
+    const size_t size = sizeof(packet->header) + packet->header.size;
+
+    wirebuf_t *buf = wirebuf_new(size);
+
+    memcpy(buf->data, packet, size);
+
+    wirebuf_finish(buf);
+
+    return buf;
+}
+
+// Gives access to a packet being built in place, before wirebuf_finish().
+packet_t *wirebuf_packet(wirebuf_t *buf) {
+    return (packet_t *)buf->data;
+}
+
+// Converts the packet built in place to network byte order and sizes the
+// buffer to it, it must not be changed afterwards.
+void wirebuf_finish(wirebuf_t *buf) {
+    packet_t *packet = wirebuf_packet(buf);
+
+    buf->size = sizeof(packet->header) + packet->header.size;
+
+    packet_to_network(packet);
+}
+
+wirebuf_t *wirebuf_ref(wirebuf_t *buf) {
+    buf->refs++;
+
+    return buf;
+}
+
+void wirebuf_unref(wirebuf_t *buf) {
+    if (buf && --buf->refs == 0)
+        free(buf);
+}
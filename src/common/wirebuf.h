@@ -0,0 +1,25 @@
+#ifndef WIREBUF_H
+#define WIREBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packets.h"
+
+// Immutable, reference counted frame in network byte order. The same buffer
+// is queued to every client receiving it, so it's encoded only once.
+typedef struct {
+    unsigned refs;
+    size_t size;
+    uint8_t data[];
+} wirebuf_t;
+
+wirebuf_t *wirebuf_new(size_t size);
+wirebuf_t *wirebuf_new_bulk(const uint16_t type, const uint32_t count);
+wirebuf_t *wirebuf_from_packet(const packet_t *packet);
+packet_t *wirebuf_packet(wirebuf_t *buf);
+void wirebuf_finish(wirebuf_t *buf);
+wirebuf_t *wirebuf_ref(wirebuf_t *buf);
+void wirebuf_unref(wirebuf_t *buf);
+
+#endif
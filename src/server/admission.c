@@ -0,0 +1,105 @@
+#include "admission.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+#define ADMISSION_SLOTS 4096 // a power of 2
+#define ADMISSION_PROBE 8
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t refill(const admission_t *admission, const admission_slot *slot, uint64_t now) {
+    const uint64_t full = (uint64_t)admission->burst * 1000;
+    const uint64_t tokens = slot->tokens + (now - slot->updated) * admission->rate;
+
+    return tokens < full ? tokens : full;
+}
+
+void admission_init(admission_t *admission, uint32_t rate, uint32_t burst) {
+    admission->rate = rate;
+    admission->burst = burst ? burst : 1;
+    admission->slots = rate ? mem_zalloc(ADMISSION_SLOTS * sizeof(admission_slot)) : NULL;
+
+    pthread_mutex_init(&admission->lock, NULL);
+
+    // sources pick their addresses, don't let them pick the collisions
+    if (getentropy(&admission->seed, sizeof(admission->seed)) == -1)
+        admission->seed = mix((uint64_t)time(NULL) ^ (uintptr_t)admission);
+}
+
+// Takes a token from the source's bucket, returns false if there was none.
+bool admission_allow(admission_t *admission, const struct sockaddr_in *addr) {
+    if (!admission->rate)
+        return true;
+
+    const in_addr_t source = addr->sin_addr.s_addr;
+    const size_t home = mix(admission->seed ^ source);
+
+    admission_slot *slot = NULL;
+    uint64_t tokens = 0;
+
+    pthread_mutex_lock(&admission->lock);
+
+    const uint64_t now = now_ms();
+
+    for (size_t i = 0; i < ADMISSION_PROBE; i++) {
+        admission_slot *probe = &admission->slots[(home + i) & (ADMISSION_SLOTS - 1)];
+
+        if (probe->addr == source) {
+            slot = probe;
+            tokens = refill(admission, probe, now);
+            break;
+        }
+
+        // a free slot, or else the one whose source is the furthest from
+        // being limited anyway
+        const uint64_t probe_tokens = probe->addr ? refill(admission, probe, now) : UINT64_MAX;
+
+        if (!slot || probe_tokens > tokens) {
+            slot = probe;
+            tokens = probe_tokens;
+        }
+    }
+
+    if (slot->addr != source) {
+        slot->addr = source;
+        tokens = (uint64_t)admission->burst * 1000;
+    }
+
+    slot->updated = now;
+
+    const bool allowed = tokens >= 1000;
+
+    slot->tokens = allowed ? tokens - 1000 : tokens;
+
+    pthread_mutex_unlock(&admission->lock);
+
+    return allowed;
+}
+
+void admission_free(admission_t *admission) {
+    free(admission->slots);
+
+    admission->slots = NULL;
+
+    pthread_mutex_destroy(&admission->lock);
+}
@@ -0,0 +1,37 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#define ADMISSION_DEFAULT_RATE 256   // connections per second and source
+#define ADMISSION_DEFAULT_BURST 1024 // connections
+
+// Token bucket per source address, limiting how fast a single address can
+// open connections. The buckets live in a fixed size table, so a flood of
+// sources can't grow it; a new source takes over the slot of the idlest one
+// it probes. The table may be shared by several event loops, it is only
+// touched on accept so a lock is cheap enough.
+
+typedef struct {
+    in_addr_t addr;   // 0 for a free slot
+    uint64_t tokens;  // thousandths of a connection
+    uint64_t updated; // ms since an arbitrary point
+} admission_slot;
+
+typedef struct {
+    admission_slot *slots;
+    uint64_t seed;
+    uint32_t rate; // 0 admits everything
+    uint32_t burst;
+    pthread_mutex_t lock;
+} admission_t;
+
+void admission_init(admission_t *admission, uint32_t rate, uint32_t burst);
+bool admission_allow(admission_t *admission, const struct sockaddr_in *addr);
+void admission_free(admission_t *admission);
+
+#endif
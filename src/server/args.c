@@ -4,30 +4,76 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "admission.h"
+#include "journal.h"
 #include "log.h"
+#include "scheduler.h"
 #include "net.h"
+#include "server.h"
 
 const char *Usage =
     "[option...]\n"
     "\n"
     "Options:\n"
-    "  -h, --help       show this help message and exit\n"
-    "  -v, --verbose    enable verbose logging\n"
-    "  -i, --interface  wireguard interface\n"
-    "  -p, --port       port to listen\n";
+    "  -h, --help         show this help message and exit\n"
+    "  -v, --verbose      enable verbose logging\n"
+    "  -i, --interface    wireguard interface\n"
+    "  -p, --port         port to listen\n"
+    "  -m, --max-clients  maximum number of connected clients\n"
+    "  -q, --max-queue    bytes queued for a client before it's dropped\n"
+    "  -j, --journal      endpoint changes remembered for resyncing clients\n"
+    "  -s, --scan         device scan interval in ms while peers change\n"
+    "  -S, --scan-max     device scan interval in ms while nothing changes\n"
+    "  -w, --workers      event loop threads, each with its own listening socket\n"
+    "  -a, --pin          pin each worker thread to a cpu of its own\n"
+    "  -b, --backend      epoll or io_uring, falls back to epoll if unsupported\n"
+    "  -B, --backlog      pending connections queued by the kernel\n"
+    "  -r, --accept-rate  connections per second accepted from one address by all workers together, 0 for any\n"
+    "  -R, --accept-burst connections accepted from one address in a burst, by all workers together\n"
+    "  -e, --events       events taken from the kernel at once\n"
+    "  -f, --frames       frames handled per client before the others' turn\n"
+    "  -t, --idle-timeout seconds without a frame before a client is dropped, 0 for never\n";
 
 const struct option LongOptions[] = {
     {"help", no_argument, NULL, 'h'},
     {"verbose", no_argument, NULL, 'v'},
     {"interface", required_argument, NULL, 'i'},
     {"port", required_argument, NULL, 'p'},
+    {"max-clients", required_argument, NULL, 'm'},
+    {"max-queue", required_argument, NULL, 'q'},
+    {"journal", required_argument, NULL, 'j'},
+    {"scan", required_argument, NULL, 's'},
+    {"scan-max", required_argument, NULL, 'S'},
+    {"workers", required_argument, NULL, 'w'},
+    {"pin", no_argument, NULL, 'a'},
+    {"backend", required_argument, NULL, 'b'},
+    {"backlog", required_argument, NULL, 'B'},
+    {"accept-rate", required_argument, NULL, 'r'},
+    {"accept-burst", required_argument, NULL, 'R'},
+    {"events", required_argument, NULL, 'e'},
+    {"frames", required_argument, NULL, 'f'},
+    {"idle-timeout", required_argument, NULL, 't'},
     {}
 };
 
 args_t args_get_defaults() {
     args_t args = {
-        .port = DEFAULT_PORT
+        .port = DEFAULT_PORT,
+        .max_clients = SERVER_DEFAULT_MAX_CLIENTS,
+        .max_queue = SERVER_DEFAULT_MAX_QUEUE,
+        .journal_size = JOURNAL_DEFAULT_SIZE,
+        .scan_interval = SCHEDULER_DEFAULT_INTERVAL,
+        .max_scan_interval = SCHEDULER_DEFAULT_MAX_INTERVAL,
+        .workers = 1,
+        .backend = SERVER_BACKEND_EPOLL,
+        .backlog = SERVER_DEFAULT_BACKLOG,
+        .accept_rate = ADMISSION_DEFAULT_RATE,
+        .accept_burst = ADMISSION_DEFAULT_BURST,
+        .max_events = SERVER_DEFAULT_REVENTS,
+        .frame_budget = SERVER_DEFAULT_FRAME_BUDGET,
+        .idle_timeout = SERVER_DEFAULT_IDLE_TIMEOUT
     };
 
     return args;
@@ -40,7 +86,7 @@ static void print_usage(const char *exec) {
 int args_parse(int argc, char *argv[], args_t *args) {
     int ch, optionIndex = 0;
 
-    while ((ch = getopt_long(argc, argv, "hvi:p:", LongOptions, &optionIndex)) != -1) {
+    while ((ch = getopt_long(argc, argv, "hvi:p:m:q:j:s:S:w:ab:B:r:R:e:f:t:", LongOptions, &optionIndex)) != -1) {
         switch (ch) {
             default:
                 print_usage(argv[0]);
@@ -57,6 +103,57 @@ int args_parse(int argc, char *argv[], args_t *args) {
             case 'p':
                 args->port = atoi(optarg);
                 break;
+            case 'm':
+                args->max_clients = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                args->max_queue = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                args->journal_size = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                args->scan_interval = atoi(optarg);
+                break;
+            case 'S':
+                args->max_scan_interval = atoi(optarg);
+                break;
+            case 'w':
+                args->workers = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                args->pin_workers = true;
+                break;
+            case 'b':
+                if (strcmp(optarg, "epoll") == 0) {
+                    args->backend = SERVER_BACKEND_EPOLL;
+                }
+                else if (strcmp(optarg, "io_uring") == 0) {
+                    args->backend = SERVER_BACKEND_URING;
+                }
+                else {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'B':
+                args->backlog = atoi(optarg);
+                break;
+            case 'r':
+                args->accept_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                args->accept_burst = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                args->max_events = atoi(optarg);
+                break;
+            case 'f':
+                args->frame_budget = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                args->idle_timeout = strtoul(optarg, NULL, 10);
+                break;
         }
     }
 
@@ -1,9 +1,28 @@
 #ifndef ARGS_H
 #define ARGS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "server.h"
+
 typedef struct {
     char *interface;
     unsigned short port;
+    size_t max_clients;
+    size_t max_queue;
+    size_t journal_size;
+    int scan_interval;
+    int max_scan_interval;
+    size_t workers;
+    bool pin_workers;
+    server_backend backend;
+    int backlog;
+    unsigned accept_rate;
+    unsigned accept_burst;
+    int max_events;
+    size_t frame_budget;
+    unsigned idle_timeout;
 } args_t;
 
 args_t args_get_defaults();
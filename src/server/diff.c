@@ -0,0 +1,42 @@
+#include "diff.h"
+
+#include <stdlib.h>
+
+#include "mem.h"
+
+static void add_change(peer_changes_t *changes, peer_change_type type, size_t peer) {
+    if (changes->nchanges == changes->cap) {
+        changes->cap = changes->cap ? changes->cap * 2 : 16;
+        changes->changes = mem_realloc(changes->changes, changes->cap * sizeof(peer_change));
+    }
+
+    changes->changes[changes->nchanges++] = (peer_change){
+        .type = type,
+        .peer = peer
+    };
+}
+
+static void compare_cb(size_t old_index, size_t new_index, void *data) {
+    peer_changes_t *changes = data;
+
+    if (new_index == PEERTABLE_NONE)
+        add_change(changes, PEER_REMOVED, old_index);
+    else if (old_index == PEERTABLE_NONE)
+        add_change(changes, PEER_ADDED, new_index);
+    else
+        add_change(changes, PEER_ENDPOINT_CHANGED, new_index);
+}
+
+void diff_peers(const peertable_t *old, const peertable_t *new, peer_changes_t *changes) {
+    changes->nchanges = 0;
+
+    peertable_compare(old, new, compare_cb, changes);
+}
+
+void diff_free(peer_changes_t *changes) {
+    free(changes->changes);
+
+    changes->changes = NULL;
+    changes->nchanges = 0;
+    changes->cap = 0;
+}
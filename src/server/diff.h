@@ -0,0 +1,28 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stddef.h>
+
+#include "peertable.h"
+
+typedef enum {
+    PEER_ADDED,
+    PEER_REMOVED,
+    PEER_ENDPOINT_CHANGED
+} peer_change_type;
+
+typedef struct {
+    peer_change_type type;
+    size_t peer; // index in the new table, or in the old one if removed
+} peer_change;
+
+typedef struct {
+    peer_change *changes;
+    size_t nchanges;
+    size_t cap;
+} peer_changes_t;
+
+void diff_peers(const peertable_t *old, const peertable_t *new, peer_changes_t *changes);
+void diff_free(peer_changes_t *changes);
+
+#endif
@@ -0,0 +1,52 @@
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+uint64_t journal_new_epoch(void) {
+    uint64_t epoch;
+
+    // sequence numbers of a previous run must not be taken for ours
+    if (getentropy(&epoch, sizeof(epoch)) == -1)
+        epoch = (uint64_t)time(NULL) << 32 | (uint32_t)getpid();
+
+    // epoch 0 is what clients send when they have none
+    return epoch ? epoch : 1;
+}
+
+void journal_init(journal_t *journal, size_t cap, uint64_t epoch) {
+    journal->cap = cap ? cap : JOURNAL_DEFAULT_SIZE;
+    journal->entries = mem_zalloc(journal->cap * sizeof(journal_entry));
+    journal->epoch = epoch;
+    journal->seq = 0;
+}
+
+uint64_t journal_append(journal_t *journal, const wg_key key) {
+    journal_entry *entry = &journal->entries[++journal->seq % journal->cap];
+
+    entry->seq = journal->seq;
+    memcpy(entry->key, key, sizeof(wg_key));
+
+    return journal->seq;
+}
+
+// Whether every change after seq is still in the journal.
+bool journal_covers(const journal_t *journal, uint64_t epoch, uint64_t seq) {
+    return epoch == journal->epoch && seq <= journal->seq && journal->seq - seq <= journal->cap;
+}
+
+const journal_entry *journal_get(const journal_t *journal, uint64_t seq) {
+    const journal_entry *entry = &journal->entries[seq % journal->cap];
+
+    return seq && entry->seq == seq ? entry : NULL;
+}
+
+void journal_free(journal_t *journal) {
+    free(journal->entries);
+
+    journal->entries = NULL;
+}
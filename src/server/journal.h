@@ -0,0 +1,36 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wireguard.h"
+
+#define JOURNAL_DEFAULT_SIZE 65536 // entries
+
+// Ring of the most recent endpoint changes. Every change is numbered within
+// the epoch picked at startup, so a reconnecting client can ask for the peers
+// changed since the last sequence number it saw. Workers share the epoch and
+// append the same changes in the same order, so their numbers agree.
+
+typedef struct {
+    uint64_t seq;
+    wg_key key;
+} journal_entry;
+
+typedef struct {
+    journal_entry *entries;
+    size_t cap;
+    uint64_t epoch;
+    uint64_t seq; // last assigned sequence number, 0 before the first change
+} journal_t;
+
+uint64_t journal_new_epoch(void);
+void journal_init(journal_t *journal, size_t cap, uint64_t epoch);
+uint64_t journal_append(journal_t *journal, const wg_key key);
+bool journal_covers(const journal_t *journal, uint64_t epoch, uint64_t seq);
+const journal_entry *journal_get(const journal_t *journal, uint64_t seq);
+void journal_free(journal_t *journal);
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,65 +8,606 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
 #include "wireguard.h"
 
+#include "admission.h"
 #include "args.h"
+#include "diff.h"
+#include "journal.h"
+#include "keymap.h"
+#include "loop.h"
+#include "mem.h"
 #include "wgutil.h"
+#include "scanner.h"
 #include "server.h"
+#include "snapshot.h"
+#include "subs.h"
 #include "net.h"
 #include "log.h"
 #include "packets.h"
+#include "peertable.h"
+#include "wirebuf.h"
 
 #define MAX_PEERS 32
+#define DRAIN_BATCH 64 // server_poll() results handled before the loop's other events
+#define IDLE_TICK 1000 // ms, how often idle clients are looked for
+#define MAX_UNKNOWN_SUBSCRIPTIONS 1024 // per client, to peers not on the device
 
+// Per-client state, attached to client_t.data.
+typedef struct {
+    client_t *client;
+    subs_client subs;
+    keymap_t unknown; // subscribed keys the device didn't have, bounded by MAX_UNKNOWN_SUBSCRIPTIONS
+    size_t *pending; // changes to deliver in the current broadcast
+    size_t npending;
+    size_t pending_cap;
+    bool resync; // the client understands PACKET_TYPE_SEQ
+    bool resyncing; // more frames of its resync request follow
+} client_state;
+
+// One event loop with its own listening socket, clients and subscriptions.
+// The workers only share the scanner and the snapshots it publishes.
 typedef struct {
+    loop_t loop;
+    loop_io server_io;
+    loop_io notify_io;
+    loop_io stop_io;
+    loop_timer idle_tick;
+    loop_task drain;
     server_t *server;
-    wg_device *device;
+    snapshot_t *snapshot; // the device as last seen, its changes broadcast
+    subs_t subs;
+    journal_t journal;
+    scanner_t *scanner;
+    int notify_fd; // readable when the scanner published new snapshots
+    size_t subscribers; // last reported to the scanner
+    client_state **touched; // clients with pending changes
+    size_t ntouched;
+    size_t touched_cap;
+    int stop_fd; // shared eventfd, readable once the workers are to stop
+    int cpu; // pinned to, -1 if not pinned
+    pthread_t thread;
+    bool running;
+    int ret;
 } server_ctx;
 
-static void send_endpoint_info(server_t *server, client_t *client, wg_peer *peer) {
-    packet_t *packet = PACKET_NEW(ENDPOINT_INFO_RES);
+// Frames encoded once and queued to any number of clients.
+typedef struct {
+    wirebuf_t **frames;
+    size_t nframes;
+    size_t cap;
+} frame_list;
+
+static void frames_push(frame_list *list, wirebuf_t *frame) {
+    if (list->nframes == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 8;
+        list->frames = mem_realloc(list->frames, list->cap * sizeof(wirebuf_t *));
+    }
+
+    list->frames[list->nframes++] = frame;
+}
 
-    memcpy(packet->endpoint_info_res.public_key, peer->public_key, 32);
+static void frames_send(server_t *server, client_t *client, const frame_list *list) {
+    for (size_t i = 0; i < list->nframes; i++) {
+        if (server_send(server, client, list->frames[i]) == -1)
+            return;
+    }
+}
 
-    packet->endpoint_info_res.addr = peer->endpoint.addr4.sin_addr.s_addr;
-    packet->endpoint_info_res.port = peer->endpoint.addr4.sin_port;
+static void frames_free(frame_list *list) {
+    for (size_t i = 0; i < list->nframes; i++)
+        wirebuf_unref(list->frames[i]);
 
-    if (server_send_packet(server, client, packet) == -1)
-        goto cleanup;
+    free(list->frames);
 
-    {
+    list->frames = NULL;
+    list->nframes = 0;
+    list->cap = 0;
+}
+
+static wirebuf_t *encode_endpoint_info(const wg_key key, const wg_endpoint *endpoint) {
+    if (endpoint->addr.sa_family != AF_INET) {
+        LOG(DEBUG, "endpoint of address family %d can't be sent.", endpoint->addr.sa_family);
+        return NULL;
+    }
+
+    wirebuf_t *buf = wirebuf_new(sizeof(packet_header) + sizeof(packet_endpoint_info_res));
+    packet_t *packet = wirebuf_packet(buf);
+
+    packet->header.version = PROTOCOL_VERSION;
+    packet->header.type = PACKET_TYPE_ENDPOINT_INFO_RES;
+    packet->header.size = sizeof(packet_endpoint_info_res);
+
+    memcpy(packet->endpoint_info_res.public_key, key, 32);
+
+    packet->endpoint_info_res.addr = endpoint->addr4.sin_addr.s_addr;
+    packet->endpoint_info_res.port = endpoint->addr4.sin_port;
+
+    if (g_log_level >= DEBUG) {
         char addr[20];
-        inet_ntop(AF_INET, &peer->endpoint.addr4.sin_addr, addr, 20);
-        LOG(DEBUG, "%s:%d", addr, ntohs(peer->endpoint.addr4.sin_port));
+        inet_ntop(AF_INET, &endpoint->addr4.sin_addr, addr, 20);
+        LOG(DEBUG, "%s:%d", addr, ntohs(endpoint->addr4.sin_port));
     }
 
-cleanup:
+    wirebuf_finish(buf);
+
+    return buf;
+}
+
+static void send_endpoint_info(server_t *server, client_t *client, const wg_key key, const wg_endpoint *endpoint) {
+    wirebuf_t *buf = encode_endpoint_info(key, endpoint);
+
+    if (!buf)
+        return;
+
+    server_send(server, client, buf);
+    wirebuf_unref(buf);
+}
+
+// Packs endpoint records into as few ENDPOINT_INFO_BULK_RES frames as the frame
+// size allows.
+typedef struct {
+    frame_list *frames;
+    wirebuf_t *buf;
+    uint32_t capacity;
+} record_writer;
+
+static void writer_init(record_writer *writer, frame_list *frames, uint32_t max_frame_size) {
+    writer->frames = frames;
+    writer->buf = NULL;
+    writer->capacity = packet_bulk_capacity(PACKET_TYPE_ENDPOINT_INFO_BULK_RES, max_frame_size);
+}
+
+static void writer_flush(record_writer *writer) {
+    if (!writer->buf)
+        return;
+
+    packet_t *packet = wirebuf_packet(writer->buf);
+
+    packet->header.size = packet_get_size(PACKET_TYPE_ENDPOINT_INFO_BULK_RES) +
+                          packet->endpoint_info_bulk_res.count * sizeof(packet_endpoint_record);
+
+    LOG(DEBUG, "encoded %u endpoint records", packet->endpoint_info_bulk_res.count);
+
+    wirebuf_finish(writer->buf);
+    frames_push(writer->frames, writer->buf);
+
+    writer->buf = NULL;
+}
+
+static packet_endpoint_record *writer_next(record_writer *writer) {
+    if (!writer->buf) {
+        writer->buf = wirebuf_new_bulk(PACKET_TYPE_ENDPOINT_INFO_BULK_RES, writer->capacity);
+        wirebuf_packet(writer->buf)->endpoint_info_bulk_res.count = 0;
+    }
+
+    packet_endpoint_info_bulk_res *res = &wirebuf_packet(writer->buf)->endpoint_info_bulk_res;
+
+    return &res->records[res->count];
+}
+
+static void writer_commit(record_writer *writer) {
+    if (++wirebuf_packet(writer->buf)->endpoint_info_bulk_res.count == writer->capacity)
+        writer_flush(writer);
+}
+
+static void writer_add(record_writer *writer, const wg_key key, const wg_endpoint *endpoint) {
+    if (packet_encode_endpoint(writer_next(writer), key, endpoint))
+        writer_commit(writer);
+}
+
+static void writer_add_record(record_writer *writer, const packet_endpoint_record *record) {
+    memcpy(writer_next(writer), record, sizeof(*record));
+    writer_commit(writer);
+}
+
+static void send_hello(server_t *server, client_t *client) {
+    packet_t *packet = PACKET_NEW(HELLO);
+
+    packet->hello.max_frame_size = PACKET_MAX_FRAME_SIZE;
+
+    server_send_packet(server, client, packet);
+
     free(packet);
 }
 
 static void handle_new_connection(client_t *client) {
     LOG(DEBUG, "new connection.");
+
+    client_state *state = mem_zalloc(sizeof(client_state));
+
+    state->client = client;
+    subs_client_init(&state->subs, client);
+    keymap_init(&state->unknown);
+
+    client->data = state;
+}
+
+static void handle_client_close(client_t *client, void *arg) {
+    server_ctx *ctx = arg;
+    client_state *state = client->data;
+
+    if (!state)
+        return;
+
+    subs_remove_client(&ctx->subs, &state->subs);
+    keymap_free(&state->unknown);
+
+    free(state->pending);
+    free(state);
+}
+
+// Subscribes the client to the peer and returns its index in the snapshot.
+// Peers the device doesn't have yet are subscribed to as well, so the client
+// hears about them once a scan finds them; the count of those is bounded as
+// nothing else limits which keys a client asks for.
+static size_t subscribe_peer(server_ctx *ctx, client_t *client, const wg_key key) {
+    const size_t i = peertable_find(&ctx->snapshot->peers, key);
+    client_state *state = client->data;
+
+    if (i != PEERTABLE_NONE) {
+        subs_add(&ctx->subs, &state->subs, key);
+        keymap_remove(&state->unknown, key);
+    }
+    else if (state->unknown.size < MAX_UNKNOWN_SUBSCRIPTIONS && subs_add(&ctx->subs, &state->subs, key)) {
+        keymap_put(&state->unknown, key, state);
+    }
+
+    return i;
+}
+
+// The subscribers of a peer the device has now are no longer charged for it.
+static void forget_unknown(server_ctx *ctx, const wg_key key) {
+    const subs_peer *peer = subs_find(&ctx->subs, key);
+
+    if (!peer)
+        return;
+
+    for (size_t i = 0; i < peer->size; i++) {
+        client_state *state = peer->subscribers[i].client->client->data;
+
+        keymap_remove(&state->unknown, key);
+    }
 }
 
 static void handle_endpoint_info_request(server_ctx *ctx, client_t *client, packet_t *packet) {
-    for (int i = 0; i < 32; i++) {
-        printf("%x", packet->endpoint_info_req.public_key[i]);
+    if (g_log_level >= DEBUG) {
+        wg_key_b64_string key;
+        wg_key_to_base64(key, packet->endpoint_info_req.public_key);
+
+        LOG(DEBUG, "key = %s", key);
     }
 
-    wg_key_b64_string key;
-    wg_key_to_base64(key, packet->endpoint_info_req.public_key);
+    const peertable_t *peers = &ctx->snapshot->peers;
+    const size_t i = subscribe_peer(ctx, client, packet->endpoint_info_req.public_key);
+
+    if (i == PEERTABLE_NONE)
+        return;
+
+    send_endpoint_info(ctx->server, client, peers->keys[i], &peers->endpoints[i]);
+}
+
+static void handle_hello(client_t *client, packet_t *packet) {
+    const uint32_t max_frame_size = packet->hello.max_frame_size;
+
+    if (max_frame_size < PACKET_MIN_FRAME_SIZE) {
+        LOG(ERROR, "client frame size %u is too small.", max_frame_size);
+        return;
+    }
+
+    client->max_frame_size = max_frame_size < PACKET_MAX_FRAME_SIZE ? max_frame_size : PACKET_MAX_FRAME_SIZE;
+
+    LOG(DEBUG, "negotiated frame size %u", client->max_frame_size);
+}
+
+static void handle_endpoint_info_bulk_request(server_ctx *ctx, client_t *client, packet_t *packet) {
+    const packet_endpoint_info_bulk_req *req = &packet->endpoint_info_bulk_req;
+
+    if (!client->max_frame_size) {
+        LOG(ERROR, "bulk request from client that didn't negotiate a frame size.");
+        return;
+    }
+
+    LOG(DEBUG, "bulk request for %u keys", req->count);
+
+    const peertable_t *peers = &ctx->snapshot->peers;
+    frame_list frames = {};
+    record_writer writer;
+
+    writer_init(&writer, &frames, client->max_frame_size);
+
+    for (uint32_t i = 0; i < req->count; i++) {
+        const size_t j = subscribe_peer(ctx, client, req->public_keys[i]);
+
+        if (j == PEERTABLE_NONE)
+            continue;
+
+        if (peers->endpoints[j].addr.sa_family)
+            writer_add(&writer, peers->keys[j], &peers->endpoints[j]);
+    }
+
+    writer_flush(&writer);
+
+    frames_send(ctx->server, client, &frames);
+    frames_free(&frames);
+}
+
+static void handle_unsubscribe(server_ctx *ctx, client_t *client, packet_t *packet) {
+    const packet_unsubscribe *req = &packet->unsubscribe;
+    client_state *state = client->data;
+
+    LOG(DEBUG, "unsubscribing from %u peers", req->count);
+
+    for (uint32_t i = 0; i < req->count; i++) {
+        if (subs_remove(&ctx->subs, &state->subs, req->public_keys[i]))
+            keymap_remove(&state->unknown, req->public_keys[i]);
+    }
+}
+
+static void send_seq(server_ctx *ctx, client_t *client) {
+    packet_t *packet = PACKET_NEW(SEQ);
+
+    packet->seq.epoch = ctx->journal.epoch;
+    packet->seq.seq = ctx->journal.seq;
+
+    server_send_packet(ctx->server, client, packet);
+
+    free(packet);
+}
+
+// Answers with the endpoints of the requested peers changed since the client's
+// sequence number, or of all of them if the journal doesn't reach back that far.
+static void handle_resync_request(server_ctx *ctx, client_t *client, packet_t *packet) {
+    const packet_resync_req *req = &packet->resync_req;
+    client_state *state = client->data;
+
+    if (!client->max_frame_size) {
+        LOG(ERROR, "resync request from client that didn't negotiate a frame size.");
+        return;
+    }
+
+    state->resync = true;
+    state->resyncing = req->more > 0;
+
+    const bool delta = journal_covers(&ctx->journal, req->epoch, req->seq);
+
+    LOG(DEBUG, "resync of %u keys from %s", req->count, delta ? "journal" : "snapshot");
+
+    const peertable_t *peers = &ctx->snapshot->peers;
+    keymap_t wanted; // public key -> endpoint in peers
+
+    keymap_init(&wanted);
+    keymap_reserve(&wanted, req->count);
+
+    for (uint32_t i = 0; i < req->count; i++) {
+        const size_t j = subscribe_peer(ctx, client, req->public_keys[i]);
+
+        if (j == PEERTABLE_NONE)
+            continue;
+
+        keymap_put(&wanted, peers->keys[j], &peers->endpoints[j]);
+    }
+
+    frame_list frames = {};
+    record_writer writer;
+
+    writer_init(&writer, &frames, client->max_frame_size);
+
+    if (delta) {
+        // newest first, each peer is only sent once with its current endpoint
+        for (uint64_t seq = ctx->journal.seq; seq > req->seq && wanted.size; seq--) {
+            const journal_entry *entry = journal_get(&ctx->journal, seq);
+
+            if (!entry)
+                break;
+
+            const wg_endpoint *endpoint = keymap_remove(&wanted, entry->key);
+
+            if (endpoint && endpoint->addr.sa_family)
+                writer_add(&writer, entry->key, endpoint);
+        }
+    }
+    else {
+        keymap_entry *entry;
+
+        keymap_for_each(&wanted, entry) {
+            const wg_endpoint *endpoint = entry->value;
+
+            if (endpoint->addr.sa_family)
+                writer_add(&writer, entry->key, endpoint);
+        }
+    }
+
+    writer_flush(&writer);
+
+    frames_send(ctx->server, client, &frames);
+    frames_free(&frames);
+    keymap_free(&wanted);
+
+    send_seq(ctx, client);
+}
+
+// A change encoded once for all of its subscribers. The frames are only built
+// once a subscriber needs them.
+typedef struct {
+    packet_endpoint_record record;
+    wirebuf_t *legacy; // ENDPOINT_INFO_RES
+    bool legacy_done;
+    wirebuf_t *single; // ENDPOINT_INFO_BULK_RES holding only this record
+} change_frames;
+
+static wirebuf_t *legacy_frame(server_ctx *ctx, change_frames *frames, size_t i) {
+    if (!frames[i].legacy_done) {
+        const peertable_t *peers = &ctx->snapshot->peers;
+        const size_t peer = ctx->snapshot->changes.changes[i].peer;
+
+        frames[i].legacy = encode_endpoint_info(peers->keys[peer], &peers->endpoints[peer]);
+        frames[i].legacy_done = true;
+    }
+
+    return frames[i].legacy;
+}
+
+static wirebuf_t *single_frame(change_frames *frames, size_t i) {
+    if (!frames[i].single) {
+        wirebuf_t *buf = wirebuf_new_bulk(PACKET_TYPE_ENDPOINT_INFO_BULK_RES, 1);
+
+        wirebuf_packet(buf)->endpoint_info_bulk_res.records[0] = frames[i].record;
+        wirebuf_finish(buf);
+
+        frames[i].single = buf;
+    }
+
+    return frames[i].single;
+}
+
+static void deliver_changes(server_ctx *ctx, client_state *state, change_frames *frames) {
+    client_t *client = state->client;
+
+    if (!client->max_frame_size) {
+        for (size_t i = 0; i < state->npending; i++) {
+            wirebuf_t *frame = legacy_frame(ctx, frames, state->pending[i]);
+
+            if (frame && server_send(ctx->server, client, frame) == -1)
+                return;
+        }
+    }
+    else if (state->npending == 1) {
+        // the common case of a single change is shared by all of its subscribers
+        server_send(ctx->server, client, single_frame(frames, state->pending[0]));
+    }
+    else {
+        frame_list list = {};
+        record_writer writer;
+
+        writer_init(&writer, &list, client->max_frame_size);
+
+        for (size_t i = 0; i < state->npending; i++)
+            writer_add_record(&writer, &frames[state->pending[i]].record);
+
+        writer_flush(&writer);
+
+        frames_send(ctx->server, client, &list);
+        frames_free(&list);
+    }
+
+    // the client counts a SEQ per resync frame, one in between would be taken
+    // for an answer
+    if (state->resync && !state->resyncing)
+        send_seq(ctx, client);
+}
+
+static void add_pending(server_ctx *ctx, client_state *state, size_t change) {
+    if (!state->npending) {
+        if (ctx->ntouched == ctx->touched_cap) {
+            ctx->touched_cap = ctx->touched_cap ? ctx->touched_cap * 2 : 64;
+            ctx->touched = mem_realloc(ctx->touched, ctx->touched_cap * sizeof(client_state *));
+        }
+
+        ctx->touched[ctx->ntouched++] = state;
+    }
+
+    if (state->npending == state->pending_cap) {
+        state->pending_cap = state->pending_cap ? state->pending_cap * 2 : 8;
+        state->pending = mem_realloc(state->pending, state->pending_cap * sizeof(size_t));
+    }
+
+    state->pending[state->npending++] = change;
+}
+
+static void broadcast_changes(server_ctx *ctx) {
+    const peertable_t *peers = &ctx->snapshot->peers;
+    size_t nchanged = 0;
+
+    for (size_t i = 0; i < ctx->snapshot->changes.nchanges; i++) {
+        const peer_change *change = &ctx->snapshot->changes.changes[i];
 
-    LOG(DEBUG, "key = %s", key);
+        switch (change->type) {
+            case PEER_REMOVED:
+                LOG(DEBUG, "peer removed");
+                continue;
+            case PEER_ADDED:
+                LOG(DEBUG, "peer added");
+                forget_unknown(ctx, peers->keys[change->peer]);
+                break;
+            case PEER_ENDPOINT_CHANGED:
+                LOG(DEBUG, "peer endpoint details changed");
+                break;
+        }
 
-    wg_peer *peer;
+        if (peers->endpoints[change->peer].addr.sa_family)
+            nchanged++;
+    }
+
+    if (!nchanged)
+        return;
+
+    change_frames *frames = mem_zalloc(ctx->snapshot->changes.nchanges * sizeof(change_frames));
+
+    // collect the changes of every subscriber first, so each client gets them
+    // packed into as few frames as possible
+    for (size_t i = 0; i < ctx->snapshot->changes.nchanges; i++) {
+        const peer_change *change = &ctx->snapshot->changes.changes[i];
+
+        if (change->type == PEER_REMOVED || !peers->endpoints[change->peer].addr.sa_family)
+            continue;
+
+        const uint8_t *key = peers->keys[change->peer];
+
+        journal_append(&ctx->journal, key);
+
+        const subs_peer *peer = subs_find(&ctx->subs, key);
+
+        if (!peer)
+            continue;
 
-    wg_for_each_peer(ctx->device, peer) {
-        if (!wgutil_key_matches(peer->public_key, packet->endpoint_info_req.public_key))
+        if (!packet_encode_endpoint(&frames[i].record, key, &peers->endpoints[change->peer]))
             continue;
 
-        send_endpoint_info(ctx->server, client, peer);
+        for (size_t j = 0; j < peer->size; j++) {
+            client_state *state = peer->subscribers[j].client->client->data;
+
+            // dropped for being too slow, removed on the next poll
+            if (!state->client->closing)
+                add_pending(ctx, state, i);
+        }
+    }
+
+    LOG(DEBUG, "delivering changes to %zu clients", ctx->ntouched);
+
+    for (size_t i = 0; i < ctx->ntouched; i++) {
+        deliver_changes(ctx, ctx->touched[i], frames);
+        ctx->touched[i]->npending = 0;
+    }
+
+    ctx->ntouched = 0;
+
+    for (size_t i = 0; i < ctx->snapshot->changes.nchanges; i++) {
+        wirebuf_unref(frames[i].legacy);
+        wirebuf_unref(frames[i].single);
+    }
+
+    free(frames);
+}
+
+// Follows the snapshots published by the scanner since the last one seen and
+// broadcasts the changes of each.
+static void handle_snapshots(server_ctx *ctx) {
+    snapshot_t *next;
+
+    scanner_drain(ctx->notify_fd);
+
+    while ((next = snapshot_next(ctx->snapshot))) {
+        snapshot_ref(next);
+        snapshot_unref(ctx->snapshot);
+        ctx->snapshot = next;
+
+        broadcast_changes(ctx);
     }
 }
 
@@ -75,9 +618,24 @@ static int handle_packet(server_ctx *ctx, client_t *client, packet_t *packet) {
             break;
         case PACKET_TYPE_KEEPALIVE:
             break;
+        case PACKET_TYPE_HELLO_REQ:
+            send_hello(ctx->server, client);
+            break;
+        case PACKET_TYPE_HELLO:
+            handle_hello(client, packet);
+            break;
         case PACKET_TYPE_ENDPOINT_INFO_REQ:
             handle_endpoint_info_request(ctx, client, packet);
             break;
+        case PACKET_TYPE_ENDPOINT_INFO_BULK_REQ:
+            handle_endpoint_info_bulk_request(ctx, client, packet);
+            break;
+        case PACKET_TYPE_UNSUBSCRIBE:
+            handle_unsubscribe(ctx, client, packet);
+            break;
+        case PACKET_TYPE_RESYNC_REQ:
+            handle_resync_request(ctx, client, packet);
+            break;
     }
 
     return 0;
@@ -86,12 +644,14 @@ static int handle_packet(server_ctx *ctx, client_t *client, packet_t *packet) {
 static int handle_received_data(server_ctx *ctx, client_t *client) {
     LOG(DEBUG, "received data.");
 
-    packet_t *packet;
+    if (server_receive(ctx->server, client) == -1)
+        return 0;
 
-    while (true) {
-        if (server_read_packet(ctx->server, client, &packet) == -1)
-            break;
+    packet_t *packet;
 
+    // handle the complete frames up to the client's budget, the rest stays
+    // buffered for its next turn
+    while (server_read_packet(ctx->server, client, &packet) == 0) {
         if (handle_packet(ctx, client, packet) == -1)
             return -1;
     }
@@ -99,68 +659,198 @@ static int handle_received_data(server_ctx *ctx, client_t *client) {
     return 0;
 }
 
-static void check_endpoint_details(server_ctx *ctx) {
-    wg_device *device = ctx->device;
-
-    if (wg_get_device(&ctx->device, ctx->device->name) < 0) {
-        LOG(ERROR, "failed to get device %s: %s.", ctx->device->name, strerror(errno));
-        return;
+static void stop_workers(int stop_fd) {
+    if (eventfd_write(stop_fd, 1) == -1) {
+        LOG(ERROR, "failed to signal eventfd: %s.", strerror(errno));
     }
+}
 
-    wg_peer *p1, *p2;
+// Handles what the server has ready, a batch at a time so the snapshots and
+// timers aren't held up by a flood of frames. A batch that ran out continues
+// after the loop's other events.
+static void drain_server(server_ctx *ctx) {
+    LOG(DEBUG, "drain_server()");
 
-    wg_for_each_peer(ctx->device, p1) {
-        wg_for_each_peer(device, p2) {
-            if (!wgutil_key_matches(p1->public_key, p2->public_key))
-                continue;
-
-            if (net_addr_and_port_matches(&p1->endpoint.addr4, &p2->endpoint.addr4))
-                continue;
+    size_t handled = 0;
+    poll_status status;
+    client_t *client;
 
-            for (size_t i = 0; i < ctx->server->nclients; i++) {
-                send_endpoint_info(ctx->server, &ctx->server->clients[i], p1);
-            }
+    while ((status = server_poll(ctx->server, &client, 0)) != POLL_TIMEOUT) {
+        switch (status) {
+            default:
+                break;
+            case POLL_ERROR:
+                LOG(DEBUG, "poll error.");
+                ctx->ret = -6;
+                stop_workers(ctx->stop_fd);
+                return;
+            case POLL_NEW_CONNECTION:
+                handle_new_connection(client);
+                break;
+            case POLL_DISCONNECT:
+                LOG(DEBUG, "disconnect.");
+                break;
+            case POLL_RECEIVED_DATA:
+                handle_received_data(ctx, client);
+                break;
+        }
 
-            LOG(DEBUG, "peer endpoint details changed");
+        if (++handled == DRAIN_BATCH) {
+            loop_defer(&ctx->loop, &ctx->drain);
+            break;
         }
     }
 
-    wg_free_device(device);
+    // speeds up idle scans once somebody subscribes
+    if (ctx->subs.peers.size != ctx->subscribers) {
+        scanner_update_subscribers(ctx->scanner, ctx->subscribers, ctx->subs.peers.size);
+        ctx->subscribers = ctx->subs.peers.size;
+    }
 }
 
-static void handle_timeout(server_ctx *ctx) {
-    check_endpoint_details(ctx);
+static void handle_server_io(loop_io *io, uint32_t events) {
+    (void)events;
+
+    drain_server(io->data);
 }
 
-static int server_loop(server_ctx *ctx) {
-    LOG(DEBUG, "server_loop()");
-    client_t *client;
+static void handle_drain(loop_task *task) {
+    drain_server(task->data);
+}
 
-    poll_status status = server_poll(ctx->server, &client);
+static void handle_notify_io(loop_io *io, uint32_t events) {
+    server_ctx *ctx = io->data;
 
-    switch (status) {
-        case POLL_ERROR:
-            LOG(DEBUG, "poll error.");
-            return -1;
-        case POLL_NEW_CONNECTION:
-            handle_new_connection(client);
-            break;
-        case POLL_DISCONNECT:
-            LOG(DEBUG, "disconnect.");
-            break;
-        case POLL_RECEIVED_DATA: {
-            handle_received_data(ctx, client);
-            break;
+    (void)events;
+
+    handle_snapshots(ctx);
+
+    // sends the changes right away, they're only queued so far
+    loop_defer(&ctx->loop, &ctx->drain);
+}
+
+// server_poll() drops the idle clients, it only has to be called while
+// nothing else happens.
+static void handle_idle_tick(loop_timer *timer) {
+    server_ctx *ctx = timer->data;
+
+    loop_defer(&ctx->loop, &ctx->drain);
+}
+
+static void handle_stop_io(loop_io *io, uint32_t events) {
+    server_ctx *ctx = io->data;
+
+    (void)events;
+
+    loop_stop(&ctx->loop);
+}
+
+static void handle_stop_signal(int signo, void *data) {
+    const int *stop_fd = data;
+
+    LOG(INFO, "caught signal %d, stopping.", signo);
+
+    stop_workers(*stop_fd);
+}
+
+static int worker_init(server_ctx *ctx, const args_t *args, size_t max_clients, scanner_t *scanner,
+                       admission_t *admission, uint64_t epoch, int stop_fd, int cpu) {
+    ctx->scanner = scanner;
+    ctx->stop_fd = stop_fd;
+    ctx->cpu = cpu;
+
+    loop_io_init(&ctx->server_io, handle_server_io, ctx);
+    loop_io_init(&ctx->notify_io, handle_notify_io, ctx);
+    loop_io_init(&ctx->stop_io, handle_stop_io, ctx);
+    loop_timer_init(&ctx->idle_tick, handle_idle_tick, ctx);
+    loop_task_init(&ctx->drain, handle_drain, ctx);
+
+    if (loop_init(&ctx->loop) == -1)
+        return -4;
+
+    // every worker starts from the same snapshot, so they journal alike
+    ctx->snapshot = scanner_snapshot(scanner);
+
+    subs_init(&ctx->subs);
+    journal_init(&ctx->journal, args->journal_size, epoch);
+
+    if (!(ctx->server = server_new(max_clients, args->max_queue, args->backend)))
+        return -4;
+
+    server_set_close_cb(ctx->server, handle_client_close, ctx);
+    server_set_admission(ctx->server, admission);
+    server_set_batch(ctx->server, args->max_events, args->frame_budget);
+    server_set_idle_timeout(ctx->server, args->idle_timeout);
+
+    if (server_init(ctx->server) == -1 || server_listen(ctx->server, args->port, args->backlog) == -1)
+        return -5;
+
+    if ((ctx->notify_fd = scanner_add_notify(scanner)) == -1)
+        return -5;
+
+    if (loop_io_start(&ctx->loop, &ctx->server_io, server_fd(ctx->server), EPOLLIN) == -1 ||
+        loop_io_start(&ctx->loop, &ctx->notify_io, ctx->notify_fd, EPOLLIN) == -1 ||
+        loop_io_start(&ctx->loop, &ctx->stop_io, stop_fd, EPOLLIN) == -1)
+        return -5;
+
+    if (args->idle_timeout)
+        loop_timer_start(&ctx->loop, &ctx->idle_tick, IDLE_TICK, IDLE_TICK);
+
+    // sends whatever server_init() and server_listen() queued up
+    loop_defer(&ctx->loop, &ctx->drain);
+
+    return 0;
+}
+
+static void *worker_run(void *arg) {
+    server_ctx *ctx = arg;
+
+    if (ctx->cpu != -1) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(ctx->cpu, &set);
+
+        const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+        if (err) {
+            LOG(WARNING, "failed to pin worker to cpu %d: %s.", ctx->cpu, strerror(err));
         }
-        case POLL_TIMEOUT:
-            LOG(DEBUG, "timeout.");
-            handle_timeout(ctx);
-            break;
     }
 
-    LOG(DEBUG, "server_loop() end");
+    if (loop_run(&ctx->loop) == -1) {
+        ctx->ret = -6;
+        stop_workers(ctx->stop_fd);
+    }
 
-    return 0;
+    return NULL;
+}
+
+static void worker_free(server_ctx *ctx) {
+    loop_free(&ctx->loop);
+    server_close(ctx->server);
+
+    snapshot_unref(ctx->snapshot);
+    subs_free(&ctx->subs);
+    journal_free(&ctx->journal);
+    free(ctx->touched);
+}
+
+// The n-th cpu the process may run on, wrapping around when there are fewer.
+static int choose_cpu(const cpu_set_t *allowed, size_t n) {
+    const int count = CPU_COUNT(allowed);
+
+    if (!count)
+        return -1;
+
+    n %= count;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed) && !n--)
+            return cpu;
+    }
+
+    return -1;
 }
 
 int main(int argc, char *argv[]) {
@@ -169,8 +859,20 @@ int main(int argc, char *argv[]) {
     if (args_parse(argc, argv, &args) == -1)
         return -1;
 
+    if (!args.workers)
+        args.workers = 1;
+
     LOG(DEBUG, "Interface: %s", args.interface);
     LOG(DEBUG, "Port: %d", args.port);
+    LOG(DEBUG, "Max clients: %zu", args.max_clients);
+    LOG(DEBUG, "Max queue: %zu", args.max_queue);
+    LOG(DEBUG, "Journal size: %zu", args.journal_size);
+    LOG(DEBUG, "Scan interval: %d-%d ms", args.scan_interval, args.max_scan_interval);
+    LOG(DEBUG, "Workers: %zu%s", args.workers, args.pin_workers ? " (pinned)" : "");
+    LOG(DEBUG, "Backend: %s", args.backend == SERVER_BACKEND_URING ? "io_uring" : "epoll");
+    LOG(DEBUG, "Backlog: %d", args.backlog);
+    LOG(DEBUG, "Accept rate: %u/s, burst %u", args.accept_rate, args.accept_burst);
+    LOG(DEBUG, "Events per wait: %d, frames per turn: %zu", args.max_events, args.frame_budget);
 
     const char *deviceName = wgutil_choose_device(args.interface);
 
@@ -181,52 +883,108 @@ int main(int argc, char *argv[]) {
 
     LOG(INFO, "Using device: %s", deviceName);
 
-    wg_device *device;
+    scanner_t scanner;
 
-    if (wg_get_device(&device, deviceName) < 0) {
-        LOG(ERROR, "Failed to get device %s: %s.", deviceName, strerror(errno));
+    if (!scanner_init(&scanner, deviceName, args.scan_interval, args.max_scan_interval)) {
+        scanner_free(&scanner);
         return -3;
     }
 
     wg_key_b64_string key;
-    wg_key_to_base64(key, device->public_key);
+    wg_key_to_base64(key, scanner.public_key);
 
     LOG(DEBUG, "public_key = %s", key);
 
+    cpu_set_t allowed;
+
+    CPU_ZERO(&allowed);
+
+    if (args.pin_workers && sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        LOG(WARNING, "sched_getaffinity() failed, not pinning workers: %s", strerror(errno));
+        args.pin_workers = false;
+    }
+
+    // the client limit is for the whole daemon, the kernel spreads the
+    // connections evenly enough over the workers' sockets
+    const size_t max_clients = args.max_clients ? args.max_clients : SERVER_DEFAULT_MAX_CLIENTS;
+    const size_t worker_max_clients = (max_clients + args.workers - 1) / args.workers;
+
+    server_raise_fd_limit(worker_max_clients * args.workers);
+
+    // SO_REUSEPORT spreads a source's connections over every worker, the rate
+    // limits are for all of them together
+    admission_t admission;
+
+    admission_init(&admission, args.accept_rate, args.accept_burst);
+
+    server_ctx *workers = mem_zalloc(args.workers * sizeof(server_ctx));
+    size_t nworkers = 0; // freed on cleanup, even if only partly initialised
+    const uint64_t epoch = journal_new_epoch();
+    const int stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     int ret = 0;
 
-    server_t *net = server_new();
+    if (stop_fd == -1) {
+        LOG(ERROR, "eventfd() failed: %s", strerror(errno));
+        ret = -5;
+        goto cleanup;
+    }
 
-    if (!net)
-        return -4;
+    while (nworkers < args.workers) {
+        const int cpu = args.pin_workers ? choose_cpu(&allowed, nworkers) : -1;
 
-    if (server_init(net) == -1) {
+        if ((ret = worker_init(&workers[nworkers++], &args, worker_max_clients, &scanner, &admission, epoch, stop_fd, cpu)) < 0)
+            goto cleanup;
+    }
+
+    // the threads started from here on inherit the blocked signals, the first
+    // worker's loop takes them
+    if (loop_signal(&workers[0].loop, SIGINT, handle_stop_signal, (void *)&stop_fd) == -1 ||
+        loop_signal(&workers[0].loop, SIGTERM, handle_stop_signal, (void *)&stop_fd) == -1) {
         ret = -5;
         goto cleanup;
     }
 
-    if (server_listen(net, args.port) == -1) {
+    if (!scanner_start(&scanner)) {
         ret = -5;
         goto cleanup;
     }
 
-    server_ctx ctx = {
-        .server = net,
-        .device = device
-    };
+    // the first worker runs on the main thread
+    for (size_t i = 1; i < args.workers; i++) {
+        const int err = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
 
-    while (true) {
-        if (server_loop(&ctx) == -1) {
-            ret = -6;
-            goto cleanup;
+        if (err) {
+            LOG(ERROR, "failed to start worker thread: %s.", strerror(err));
+            stop_workers(stop_fd);
+            ret = -5;
+            break;
         }
 
+        workers[i].running = true;
+    }
+
+    worker_run(&workers[0]);
+
+    for (size_t i = 0; i < args.workers; i++) {
+        if (workers[i].running)
+            pthread_join(workers[i].thread, NULL);
+
+        if (!ret)
+            ret = workers[i].ret;
     }
 
 cleanup:
-    server_close(net);
+    scanner_stop(&scanner);
+
+    for (size_t i = 0; i < nworkers; i++)
+        worker_free(&workers[i]);
+
+    if (stop_fd != -1)
+        close(stop_fd);
 
-    wg_free_device(ctx.device);
+    free(workers);
+    admission_free(&admission);
+    scanner_free(&scanner);
 
     return ret;
 }
@@ -0,0 +1,249 @@
+#include "scanner.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "mem.h"
+
+static void signal_fd(int fd) {
+    const uint64_t value = 1;
+
+    // the counter only saturates when the reader is far behind, which still
+    // leaves it readable
+    if (write(fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        LOG(ERROR, "failed to signal eventfd: %s.", strerror(errno));
+    }
+}
+
+static void drain_fd(int fd) {
+    uint64_t value;
+
+    if (read(fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        LOG(ERROR, "failed to read eventfd: %s.", strerror(errno));
+    }
+}
+
+// Returns whether any peer changed since the last scan.
+static bool scan(scanner_t *scanner) {
+    if (peertable_dump(&scanner->table, scanner->wg, scanner->name, NULL) < 0) {
+        LOG(ERROR, "failed to get device %s: %s.", scanner->name, strerror(errno));
+        return false;
+    }
+
+    snapshot_t *snapshot = snapshot_new(&scanner->table, scanner->latest);
+
+    if (!snapshot->changes.nchanges) {
+        // most scans find nothing, keep their table for the next one
+        scanner->table = snapshot->peers;
+        peertable_init(&snapshot->peers);
+
+        snapshot_unref(snapshot);
+        return false;
+    }
+
+    // one reference is handed to the previous snapshot, one is kept as latest
+    snapshot_publish(scanner->latest, snapshot_ref(snapshot));
+    snapshot_unref(scanner->latest);
+    scanner->latest = snapshot;
+
+    for (size_t i = 0; i < scanner->nnotify; i++)
+        signal_fd(scanner->notify_fds[i]);
+
+    return true;
+}
+
+static void handle_timer(scanner_t *scanner) {
+    if (!scheduler_expired(&scanner->scheduler))
+        return;
+
+    const bool changed = scan(scanner);
+
+    // nobody would be told about a change, only keep the snapshot from going
+    // stale for the peers new subscriptions ask for
+    if (!atomic_load_explicit(&scanner->subscribers, memory_order_relaxed)) {
+        if (!scanner->scheduler.idle) {
+            LOG(DEBUG, "no subscribers, slowing down scans.");
+        }
+
+        scheduler_idle(&scanner->scheduler);
+        return;
+    }
+
+    scheduler_done(&scanner->scheduler, changed);
+}
+
+static void handle_wake(scanner_t *scanner) {
+    drain_fd(scanner->wake_fd);
+
+    if (!scanner->scheduler.idle ||
+        !atomic_load_explicit(&scanner->subscribers, memory_order_relaxed))
+        return;
+
+    LOG(DEBUG, "resuming scans.");
+
+    // catch up on the changes missed while idle
+    scan(scanner);
+    scheduler_resume(&scanner->scheduler);
+}
+
+static void *scanner_thread(void *arg) {
+    scanner_t *scanner = arg;
+
+    struct pollfd fds[2] = {
+        { .fd = scanner->scheduler.fd, .events = POLLIN },
+        { .fd = scanner->wake_fd, .events = POLLIN }
+    };
+
+    while (!atomic_load_explicit(&scanner->stop, memory_order_acquire)) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            LOG(ERROR, "scanner poll failed: %s.", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            handle_wake(scanner);
+
+        if (fds[0].revents & POLLIN)
+            handle_timer(scanner);
+    }
+
+    return NULL;
+}
+
+// Takes the first snapshot synchronously, so the event loop has peers to
+// answer from before the thread is started.
+bool scanner_init(scanner_t *scanner, const char *name, int min_interval, int max_interval) {
+    memset(scanner, 0, sizeof(scanner_t));
+
+    scanner->scheduler.fd = -1;
+    scanner->wake_fd = -1;
+
+    atomic_init(&scanner->stop, false);
+    atomic_init(&scanner->subscribers, 0);
+    peertable_init(&scanner->table);
+
+    strncpy(scanner->name, name, sizeof(scanner->name) - 1);
+
+    if (!(scanner->wg = wg_ctx_new()))
+        return false;
+
+    wg_device device;
+
+    if (peertable_dump(&scanner->table, scanner->wg, name, &device) < 0) {
+        LOG(ERROR, "failed to get device %s: %s.", name, strerror(errno));
+        return false;
+    }
+
+    memcpy(scanner->public_key, device.public_key, sizeof(wg_key));
+
+    scanner->latest = snapshot_new(&scanner->table, NULL);
+
+    if ((scanner->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        LOG(ERROR, "failed to create eventfd: %s.", strerror(errno));
+        return false;
+    }
+
+    return scheduler_init(&scanner->scheduler, min_interval, max_interval);
+}
+
+// The snapshot taken by scanner_init, only valid before the thread is started.
+snapshot_t *scanner_snapshot(scanner_t *scanner) {
+    return snapshot_ref(scanner->latest);
+}
+
+// Adds an fd signalled on every published snapshot, one per event loop
+// following the chain. Only allowed before the thread is started.
+int scanner_add_notify(scanner_t *scanner) {
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (fd == -1) {
+        LOG(ERROR, "failed to create eventfd: %s.", strerror(errno));
+        return -1;
+    }
+
+    scanner->notify_fds = mem_realloc(scanner->notify_fds, (scanner->nnotify + 1) * sizeof(int));
+    scanner->notify_fds[scanner->nnotify++] = fd;
+
+    return fd;
+}
+
+bool scanner_start(scanner_t *scanner) {
+    const int err = pthread_create(&scanner->thread, NULL, scanner_thread, scanner);
+
+    if (err) {
+        LOG(ERROR, "failed to start scanner thread: %s.", strerror(err));
+        return false;
+    }
+
+    scanner->running = true;
+
+    return true;
+}
+
+// Each event loop reports the change of its own subscriber count, old being
+// what it reported last. Wakes the thread up when the first subscriber of any
+// loop appears, so scans slowed down for the lack of subscribers speed up
+// right away.
+void scanner_update_subscribers(scanner_t *scanner, size_t old, size_t subscribers) {
+    if (subscribers > old) {
+        if (!atomic_fetch_add_explicit(&scanner->subscribers, subscribers - old, memory_order_relaxed))
+            signal_fd(scanner->wake_fd);
+    }
+    else if (subscribers < old) {
+        atomic_fetch_sub_explicit(&scanner->subscribers, old - subscribers, memory_order_relaxed);
+    }
+}
+
+// Acknowledges the notification on fd, call before following the snapshot
+// chain.
+void scanner_drain(int fd) {
+    drain_fd(fd);
+}
+
+void scanner_stop(scanner_t *scanner) {
+    if (!scanner->running)
+        return;
+
+    atomic_store_explicit(&scanner->stop, true, memory_order_release);
+    signal_fd(scanner->wake_fd);
+
+    pthread_join(scanner->thread, NULL);
+
+    scanner->running = false;
+}
+
+void scanner_free(scanner_t *scanner) {
+    scanner_stop(scanner);
+
+    snapshot_unref(scanner->latest);
+    scanner->latest = NULL;
+
+    peertable_free(&scanner->table);
+
+    if (scanner->wg)
+        wg_ctx_free(scanner->wg);
+
+    for (size_t i = 0; i < scanner->nnotify; i++)
+        close(scanner->notify_fds[i]);
+
+    free(scanner->notify_fds);
+
+    if (scanner->wake_fd != -1)
+        close(scanner->wake_fd);
+
+    scheduler_free(&scanner->scheduler);
+
+    scanner->wg = NULL;
+    scanner->notify_fds = NULL;
+    scanner->nnotify = 0;
+    scanner->wake_fd = -1;
+}
@@ -0,0 +1,47 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <net/if.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wireguard.h"
+
+#include "peertable.h"
+#include "scheduler.h"
+#include "snapshot.h"
+
+// Background thread scanning the device on the schedule and diffing it
+// against the previous scan. Each scan that found changes is published as a
+// new snapshot, see snapshot.h, after which every notification fd becomes
+// readable. The event loops never block on netlink and take no locks to read
+// the peers.
+
+typedef struct {
+    wg_ctx *wg;
+    char name[IFNAMSIZ];
+    wg_key public_key;
+    scheduler_t scheduler;
+    int *notify_fds; // eventfds, readable when new snapshots were published
+    size_t nnotify;
+    int wake_fd; // eventfd, wakes the thread up to resume or stop
+    atomic_bool stop;
+    atomic_size_t subscribers; // summed over every event loop
+    snapshot_t *latest; // owned by the thread once started
+    peertable_t table; // filled by each scan, kept while nothing changes
+    pthread_t thread;
+    bool running;
+} scanner_t;
+
+bool scanner_init(scanner_t *scanner, const char *name, int min_interval, int max_interval);
+snapshot_t *scanner_snapshot(scanner_t *scanner);
+int scanner_add_notify(scanner_t *scanner);
+bool scanner_start(scanner_t *scanner);
+void scanner_update_subscribers(scanner_t *scanner, size_t old, size_t subscribers);
+void scanner_drain(int fd);
+void scanner_stop(scanner_t *scanner);
+void scanner_free(scanner_t *scanner);
+
+#endif
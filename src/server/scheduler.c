@@ -0,0 +1,92 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static void arm(scheduler_t *sched, int interval) {
+    const struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = interval / 1000,
+            .tv_nsec = (long)(interval % 1000) * 1000000
+        }
+    };
+
+    if (timerfd_settime(sched->fd, 0, &spec, NULL) == -1) {
+        LOG(ERROR, "timerfd_settime() failed: %s", strerror(errno));
+    }
+}
+
+bool scheduler_init(scheduler_t *sched, int min_interval, int max_interval) {
+    sched->min_interval = min_interval > 0 ? min_interval : SCHEDULER_DEFAULT_INTERVAL;
+    sched->max_interval = max_interval > sched->min_interval ? max_interval : sched->min_interval;
+    sched->interval = sched->min_interval;
+    sched->idle = false;
+
+    sched->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (sched->fd == -1) {
+        LOG(ERROR, "timerfd_create() failed: %s", strerror(errno));
+        return false;
+    }
+
+    arm(sched, sched->interval);
+
+    return true;
+}
+
+// Consumes the expiration, false if there was none (e.g. it was re-armed since).
+bool scheduler_expired(scheduler_t *sched) {
+    uint64_t expirations;
+
+    if (read(sched->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        if (errno != EAGAIN) {
+            LOG(ERROR, "read() on timerfd failed: %s", strerror(errno));
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+void scheduler_done(scheduler_t *sched, bool changed) {
+    if (changed) {
+        sched->interval = sched->min_interval;
+    }
+    else if (sched->interval < sched->max_interval) {
+        sched->interval = sched->interval * 2 < sched->max_interval ? sched->interval * 2 : sched->max_interval;
+    }
+
+    LOG(DEBUG, "next scan in %d ms", sched->interval);
+
+    arm(sched, sched->interval);
+}
+
+void scheduler_idle(scheduler_t *sched) {
+    sched->idle = true;
+    sched->interval = sched->max_interval;
+
+    arm(sched, sched->interval);
+}
+
+void scheduler_resume(scheduler_t *sched) {
+    if (!sched->idle)
+        return;
+
+    sched->idle = false;
+    sched->interval = sched->min_interval;
+
+    arm(sched, sched->interval);
+}
+
+void scheduler_free(scheduler_t *sched) {
+    if (sched->fd != -1)
+        close(sched->fd);
+
+    sched->fd = -1;
+}
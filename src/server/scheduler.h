@@ -0,0 +1,29 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+
+#define SCHEDULER_DEFAULT_INTERVAL 1000      // ms
+#define SCHEDULER_DEFAULT_MAX_INTERVAL 16000 // ms
+
+// Timerfd driven schedule of the device scans. The interval drops back to the
+// minimum whenever a scan found changes and doubles up to the maximum while
+// nothing changes. While nobody would be told about a change it stays at the
+// maximum, which still keeps the snapshot fresh enough for new subscriptions.
+
+typedef struct {
+    int fd;
+    int min_interval;
+    int max_interval;
+    int interval;
+    bool idle;
+} scheduler_t;
+
+bool scheduler_init(scheduler_t *sched, int min_interval, int max_interval);
+bool scheduler_expired(scheduler_t *sched);
+void scheduler_done(scheduler_t *sched, bool changed);
+void scheduler_idle(scheduler_t *sched);
+void scheduler_resume(scheduler_t *sched);
+void scheduler_free(scheduler_t *sched);
+
+#endif
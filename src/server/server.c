@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "server.h"
 
 #include <net/if.h>
@@ -5,51 +7,242 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
+#include "admission.h"
 #include "log.h"
 #include "mem.h"
 #include "packets.h"
 #include "socket.h"
+#include "timewheel.h"
+
+#define DRAIN_TIMEOUT 2000 // ms, for the io_uring requests left on close
+#define RESERVED_FDS 16
+#define ACCEPT_ERROR_INTERVAL 1 // s, failed accepts are logged at most this often
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFERS 256 // provided to multishot recvs, a power of 2
+#define URING_BUFFER_GROUP 0
+#define URING_SUBMIT_BATCH 32 // completions handled before submitting anyway
+#define URING_MAX_RX (4 * PACKET_MAX_FRAME_SIZE) // buffered before a client's recv is paused
+
+// epoll_event.data carries the fd together with the generation of the client
+// it was registered for, so stale events for a reused fd can be told apart.
+// Generation 0 is used by the listening socket.
+static uint64_t make_handle(const int fd, const uint32_t generation) {
+    return (uint64_t)generation << 32 | (uint32_t)fd;
+}
+
+static int handle_fd(const uint64_t handle) {
+    return (int)(uint32_t)handle;
+}
+
+static uint32_t handle_generation(const uint64_t handle) {
+    return handle >> 32;
+}
+
+// io_uring user_data is a handle as well, with the operation in the top bits
+// of the fd.
+enum {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CANCEL
+};
+
+#define URING_OP_SHIFT 29
+#define URING_FD_MASK ((1U << URING_OP_SHIFT) - 1)
+
+static uint64_t make_op(const unsigned op, const int fd, const uint32_t generation) {
+    return (uint64_t)generation << 32 | op << URING_OP_SHIFT | (uint32_t)fd;
+}
+
+static unsigned op_type(const uint64_t user_data) {
+    return (uint32_t)user_data >> URING_OP_SHIFT;
+}
+
+static int op_fd(const uint64_t user_data) {
+    return (int)((uint32_t)user_data & URING_FD_MASK);
+}
 
-#define EPOLL_TIMEOUT 2000 // ms
+static uint64_t now_s(void) {
+    struct timespec ts;
 
-server_t *server_new() {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
+
+server_t *server_new(size_t max_clients, size_t max_queue, server_backend backend) {
     server_t *server = mem_zalloc(sizeof(server_t));
 
     server->fd = -1;
+    server->spare_fd = -1;
+    server->backend = backend;
     server->epoll_fd = -1;
+    server->uring.fd = -1;
+    server->max_revents = SERVER_DEFAULT_REVENTS;
+    server->frame_budget = SERVER_DEFAULT_FRAME_BUDGET;
+    server->idle_timeout = SERVER_DEFAULT_IDLE_TIMEOUT;
+    server->now = now_s();
+
+    timewheel_init(&server->idle_wheel, server->now);
+    admission_init(&server->own_admission, ADMISSION_DEFAULT_RATE, ADMISSION_DEFAULT_BURST);
+    server->admission = &server->own_admission;
+    server->max_clients = max_clients ? max_clients : SERVER_DEFAULT_MAX_CLIENTS;
+    server->max_queue = max_queue ? max_queue : SERVER_DEFAULT_MAX_QUEUE;
 
     return server;
 }
 
-int server_init(server_t *server) {
-    if (!server)
+// Raises the open file limit for max_clients, called by server_init() for its
+// own clients. Servers sharing the process need it raised for all of them.
+void server_raise_fd_limit(size_t max_clients) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        LOG(ERROR, "getrlimit() failed: %s", strerror(errno));
+        return;
+    }
+
+    const rlim_t needed = max_clients + RESERVED_FDS;
+
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= needed)
+        return;
+
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > needed ? needed : limit.rlim_max;
+
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        LOG(ERROR, "setrlimit() failed: %s", strerror(errno));
+        return;
+    }
+
+    if (limit.rlim_cur < needed) {
+        LOG(WARNING, "open file limit %lu is lower than required for %zu clients.",
+            (unsigned long)limit.rlim_cur, max_clients);
+    }
+}
+
+// Submits what is queued when the submission queue is full.
+static struct io_uring_sqe *get_sqe(server_t *server) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->uring);
+
+    if (!sqe && uring_submit(&server->uring) == 0)
+        sqe = uring_get_sqe(&server->uring);
+
+    if (!sqe) {
+        LOG(ERROR, "io_uring submission queue is full.");
+    }
+
+    return sqe;
+}
+
+static int arm_accept(server_t *server) {
+    struct io_uring_sqe *sqe = get_sqe(server);
+
+    if (!sqe)
         return -1;
 
-    server->revent_idx = 0;
-    server->nrevents = 0;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_op(URING_OP_ACCEPT, server->fd, 0);
 
-    server->epoll_fd = epoll_create1(0);
+    server->inflight++;
 
-    if (server->epoll_fd == -1) {
-        LOG(ERROR, "epoll_create1() failed: %s", strerror(errno));
+    return 0;
+}
+
+// The kernel picks a provided buffer for every chunk received, until it runs
+// out of them or the connection ends.
+static int arm_recv(server_t *server, client_t *client) {
+    struct io_uring_sqe *sqe = get_sqe(server);
+
+    if (!sqe)
         return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = make_op(URING_OP_RECV, client->fd, client->generation);
+
+    client->receiving = true;
+    client->inflight++;
+    server->inflight++;
+
+    return 0;
+}
+
+// Stops the client's multishot recv only, its sends keep going.
+static int cancel_recv(server_t *server, client_t *client) {
+    struct io_uring_sqe *sqe = get_sqe(server);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = make_op(URING_OP_RECV, client->fd, client->generation);
+    sqe->user_data = make_op(URING_OP_CANCEL, client->fd, client->generation);
+
+    server->inflight++;
+
+    return 0;
+}
+
+// Completes every request on the client's socket, a closing client is only
+// freed after all of them completed.
+static int cancel_client(server_t *server, client_t *client) {
+    struct io_uring_sqe *sqe = get_sqe(server);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = client->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = make_op(URING_OP_CANCEL, client->fd, client->generation);
+
+    server->inflight++;
+
+    return 0;
+}
+
+static bool init_uring(server_t *server) {
+    if (uring_init(&server->uring, URING_ENTRIES, URING_CQ_ENTRIES) == -1 ||
+        uring_setup_buffers(&server->uring, URING_BUFFER_GROUP, URING_BUFFERS, SOCKET_BUFFER_MIN_SIZE) == -1) {
+        LOG(WARNING, "io_uring is unavailable, falling back to epoll: %s", strerror(errno));
+        uring_free(&server->uring);
+        return false;
     }
 
-    server->fd = socket_create_tcp();
+    return true;
+}
 
-    if (server->fd == -1)
+static int init_epoll(server_t *server) {
+    server->epoll_fd = epoll_create1(0);
+
+    if (server->epoll_fd == -1) {
+        LOG(ERROR, "epoll_create1() failed: %s", strerror(errno));
         return -1;
+    }
 
     if (socket_set_non_blocking(server->fd) == -1)
         return -1;
 
     struct epoll_event event = {
-        .data.fd = server->fd,
+        .data.u64 = make_handle(server->fd, 0),
         .events = EPOLLIN | EPOLLRDHUP
     };
 
@@ -58,9 +251,44 @@ int server_init(server_t *server) {
         return -1;
     }
 
+    return 0;
+}
+
+int server_init(server_t *server) {
+    if (!server)
+        return -1;
+
+    server->revent_idx = 0;
+    server->nrevents = 0;
+    server->revents = mem_alloc(server->max_revents * sizeof(struct epoll_event));
+
+    server_raise_fd_limit(server->max_clients);
+
+    if (server->backend == SERVER_BACKEND_URING && !init_uring(server))
+        server->backend = SERVER_BACKEND_EPOLL;
+
+    server->fd = socket_create_tcp();
+
+    if (server->fd == -1)
+        return -1;
+
+    if ((server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1) {
+        LOG(ERROR, "open() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (server->backend == SERVER_BACKEND_EPOLL && init_epoll(server) == -1)
+        return -1;
+
     const int opt = 1;
 
-    if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+    if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        LOG(ERROR, "setsockopt() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // every worker listens on its own socket, the kernel spreads connections
+    if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
         LOG(ERROR, "setsockopt() failed: %s", strerror(errno));
         return -1;
     }
@@ -68,7 +296,39 @@ int server_init(server_t *server) {
     return 0;
 }
 
-int server_listen(server_t *server, unsigned short port) {
+// Limits how many connections a single source address can open per second,
+// and in a burst, by the buckets of admission instead of the server's own
+// default ones. Servers sharing a port have to share them as well, or a source
+// gets the limit from each. admission must outlive the server.
+void server_set_admission(server_t *server, admission_t *admission) {
+    server->admission = admission;
+}
+
+// How many events are taken from one epoll_wait(), and how many frames a
+// client gets handled in one turn before the others get theirs.
+void server_set_batch(server_t *server, int max_revents, size_t frame_budget) {
+    if (max_revents > 0)
+        server->max_revents = max_revents;
+
+    if (frame_budget)
+        server->frame_budget = frame_budget;
+}
+
+// How long a client may go without sending a frame, keepalives included,
+// before it's dropped. 0 keeps idle clients forever. Applies to clients
+// accepted afterwards.
+void server_set_idle_timeout(server_t *server, unsigned seconds) {
+    server->idle_timeout = seconds;
+}
+
+// The callback runs right before a client is freed, so whatever was attached
+// to client->data can be released.
+void server_set_close_cb(server_t *server, server_close_cb cb, void *arg) {
+    server->close_cb = cb;
+    server->close_cb_arg = arg;
+}
+
+int server_listen(server_t *server, unsigned short port, int backlog) {
     if (!server)
         return -1;
 
@@ -83,185 +343,937 @@ int server_listen(server_t *server, unsigned short port) {
         return -1;
     }
 
-    if (listen(server->fd, 0) == -1) {
+    // a reconnect storm must not overflow the queue, the kernel caps it at
+    // net.core.somaxconn
+    if (listen(server->fd, backlog > 0 ? backlog : SERVER_DEFAULT_BACKLOG) == -1) {
         LOG(ERROR, "listen() failed: %s", strerror(errno));
         return -1;
     }
 
+    if (server->backend == SERVER_BACKEND_URING)
+        return arm_accept(server);
+
     return 0;
 }
 
-static client_t *add_client(server_t *server, int fd) {
-    struct epoll_event event = {
-        .data.fd = fd,
-        .events = EPOLLIN
-    };
+// The fd to watch from an event loop, readable whenever server_poll() has
+// events to handle: the epoll fd, or the ring once completions are posted.
+int server_fd(server_t *server) {
+    return server->backend == SERVER_BACKEND_URING ? server->uring.fd : server->epoll_fd;
+}
 
-    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
-        LOG(ERROR, "epoll_ctl() failed: %s", strerror(errno));
-        return NULL;
+static bool reserve_fd_table(server_t *server, int fd) {
+    if ((size_t)fd < server->fd_table_size)
+        return true;
+
+    size_t size = server->fd_table_size ? server->fd_table_size : 64;
+
+    while (size <= (size_t)fd)
+        size *= 2;
+
+    client_t **fd_table = realloc(server->fd_table, size * sizeof(client_t *));
+
+    if (!fd_table) {
+        LOG(ERROR, "realloc() failed: %s", strerror(errno));
+        return false;
     }
 
-    client_t *client = &server->clients[server->nclients++];
+    memset(fd_table + server->fd_table_size, 0, (size - server->fd_table_size) * sizeof(client_t *));
+
+    server->fd_table = fd_table;
+    server->fd_table_size = size;
+
+    return true;
+}
+
+static bool reserve_clients(server_t *server) {
+    if (server->nclients < server->clients_cap)
+        return true;
+
+    size_t cap = server->clients_cap ? server->clients_cap * 2 : 64;
+
+    if (cap > server->max_clients)
+        cap = server->max_clients;
+
+    client_t **clients = realloc(server->clients, cap * sizeof(client_t *));
+
+    if (!clients) {
+        LOG(ERROR, "realloc() failed: %s", strerror(errno));
+        return false;
+    }
+
+    server->clients = clients;
+    server->clients_cap = cap;
+
+    return true;
+}
+
+static client_t *add_client(server_t *server, int fd) {
+    if (!reserve_fd_table(server, fd) || !reserve_clients(server))
+        return NULL;
+
+    client_t *client = mem_zalloc(sizeof(client_t));
 
     client->fd = fd;
 
+    // generation 0 is reserved for the listening socket
+    if (++server->generation == 0)
+        ++server->generation;
+
+    client->generation = server->generation;
+
+    if (server->backend == SERVER_BACKEND_URING) {
+        if (arm_recv(server, client) == -1) {
+            free(client);
+            return NULL;
+        }
+    }
+    else {
+        struct epoll_event event = {
+            .data.u64 = make_handle(fd, client->generation),
+            .events = EPOLLIN
+        };
+
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            LOG(ERROR, "epoll_ctl() failed: %s", strerror(errno));
+            free(client);
+            return NULL;
+        }
+    }
+
+    client->last_active = server->now;
+    client->idle.data = client;
+
+    if (server->idle_timeout)
+        timewheel_add(&server->idle_wheel, &client->idle, server->now + server->idle_timeout);
+
+    client->idx = server->nclients;
+
+    server->clients[server->nclients++] = client;
+    server->fd_table[fd] = client;
+
     return client;
 }
 
+static void list_forget(client_list *list, client_t *client) {
+    for (size_t i = 0; i < list->size; i++) {
+        if (list->items[i] == client)
+            list->items[i] = NULL;
+    }
+}
+
 static void remove_client(server_t *server, client_t *client) {
-    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+    if (server->close_cb)
+        server->close_cb(client, server->close_cb_arg);
+
+    if (server->backend == SERVER_BACKEND_EPOLL && epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
         LOG(ERROR, "epoll_ctl() failed: %s", strerror(errno));
     }
 
-    for (int i = 0; i < server->nclients; i++) {
-        if (server->clients[i].fd != client->fd)
+    if (client->ready) {
+        list_forget(&server->ready, client);
+        list_forget(&server->requeued, client);
+    }
+
+    timewheel_remove(&client->idle);
+
+    close(client->fd);
+    socket_buffer_free(&client->rx);
+    socket_queue_free(&client->tx);
+
+    server->fd_table[client->fd] = NULL;
+
+    client_t *last = server->clients[--server->nclients];
+
+    server->clients[client->idx] = last;
+    last->idx = client->idx;
+
+    free(client);
+}
+
+static void list_push(client_list *list, client_t *client) {
+    if (list->size == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = mem_realloc(list->items, list->cap * sizeof(client_t *));
+    }
+
+    list->items[list->size++] = client;
+}
+
+// Removes the client on the next server_poll() instead of right away, so
+// callers can keep going over server->clients or the current packets.
+static void close_client(server_t *server, client_t *client) {
+    if (client->closing)
+        return;
+
+    client->closing = true;
+
+    list_push(&server->closing, client);
+
+    // without a free submission entry the cancel is retried by reap_clients(),
+    // until then the shutdown ends the recv and fails the sends
+    if (client->inflight && cancel_client(server, client) == -1) {
+        client->cancel_pending = true;
+        shutdown(client->fd, SHUT_RDWR);
+    }
+}
+
+// Queues a client that still has frames buffered after using up its budget,
+// it gets another turn in the next round.
+static void requeue_client(server_t *server, client_t *client) {
+    if (client->ready)
+        return;
+
+    client->ready = true;
+
+    list_push(&server->requeued, client);
+}
+
+static client_t *next_ready(server_t *server) {
+    while (server->ready_idx < server->ready.size) {
+        client_t *client = server->ready.items[server->ready_idx++];
+
+        // removed while queued
+        if (!client)
             continue;
 
-        close(server->clients[i].fd);
+        client->ready = false;
 
-        for (int j = i + 1; j < server->nclients; j++) {
-            server->clients[j - 1] = server->clients[j];
-        }
+        if (!client->closing)
+            return client;
+    }
+
+    return NULL;
+}
+
+// Starts the next round with the clients requeued during the last one,
+// returns whether there are any.
+static bool start_ready_round(server_t *server) {
+    client_list ready = server->ready;
+
+    server->ready = server->requeued;
+    server->ready_idx = 0;
+
+    server->requeued = ready;
+    server->requeued.size = 0;
+
+    return server->ready.size > 0;
+}
+
+// Clients with io_uring requests in flight stay until those completed, the
+// kernel may still be using their buffers.
+static void reap_clients(server_t *server) {
+    size_t kept = 0;
+
+    for (size_t i = 0; i < server->closing.size; i++) {
+        client_t *client = server->closing.items[i];
 
-        server->nclients--;
+        if (client->inflight && client->cancel_pending && cancel_client(server, client) == 0)
+            client->cancel_pending = false;
 
-        break;
+        if (client->inflight)
+            server->closing.items[kept++] = client;
+        else
+            remove_client(server, client);
     }
+
+    server->closing.size = kept;
 }
 
-int server_accept(server_t *server, client_t **client) {
-    if (!server || !client)
-        return -1;
+// Frames only move last_active, the timer is pushed back when it expires
+// rather than on every frame.
+static void expire_idle(wheel_timer *timer, void *arg) {
+    server_t *server = arg;
+    client_t *client = timer->data;
 
-    if (server->nclients >= SERVER_MAX_CLIENTS) {
-        LOG(ERROR, "can't accept connection, maximum client count reached.");
+    if (client->closing)
+        return;
+
+    const uint64_t expires = client->last_active + server->idle_timeout;
+
+    if (expires > server->now) {
+        timewheel_add(&server->idle_wheel, timer, expires);
+        return;
+    }
+
+    LOG(DEBUG, "dropping idle client (fd = %d)", client->fd);
+    close_client(server, client);
+}
+
+static void expire_clients(server_t *server) {
+    server->now = now_s();
+
+    timewheel_advance(&server->idle_wheel, server->now, expire_idle, server);
+}
+
+static void poll_writable(server_t *server, client_t *client, bool enable) {
+    if (client->polling_out == enable)
+        return;
+
+    struct epoll_event event = {
+        .data.u64 = make_handle(client->fd, client->generation),
+        .events = enable ? EPOLLIN | EPOLLOUT : EPOLLIN
+    };
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
+        LOG(ERROR, "epoll_ctl() failed: %s", strerror(errno));
+        return;
+    }
+
+    client->polling_out = enable;
+}
+
+// Sends the queued frames as a chain of linked sends, one per frame, unless the
+// previous chain is still in flight. MSG_WAITALL has a short send fail the
+// rest of the chain, rather than sending them out of order.
+static void send_queue(server_t *server, client_t *client) {
+    if (client->sending || !client->tx.count)
+        return;
+
+    struct iovec iov[SOCKET_QUEUE_MAX_IOV];
+    size_t niov = socket_queue_peek(&client->tx, iov, SOCKET_QUEUE_MAX_IOV);
+
+    // a chain has to be submitted in one go, the rest follows the next chain
+    if (uring_sq_space(&server->uring) < niov)
+        uring_submit(&server->uring);
+
+    if (niov > uring_sq_space(&server->uring))
+        niov = uring_sq_space(&server->uring);
+
+    if (!niov) {
+        LOG(ERROR, "dropping client (fd = %d), io_uring submission queue is full.", client->fd);
+        close_client(server, client);
+        return;
+    }
+
+    for (size_t i = 0; i < niov; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&server->uring);
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = client->fd;
+        sqe->addr = (uint64_t)(uintptr_t)iov[i].iov_base;
+        sqe->len = iov[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = i + 1 < niov ? IOSQE_IO_LINK : 0;
+        sqe->user_data = make_op(URING_OP_SEND, client->fd, client->generation);
+
+        client->sending++;
+        client->inflight++;
+        server->inflight++;
+    }
+}
+
+static int flush_client(server_t *server, client_t *client) {
+    const int ret = socket_queue_flush(client->fd, &client->tx);
+
+    if (ret != SOCK_OK && ret != SOCK_AGAIN) {
+        close_client(server, client);
         return -1;
     }
 
-    const int fd = socket_accept(server->fd);
+    poll_writable(server, client, ret == SOCK_AGAIN);
 
-    if (fd == -1)
+    return 0;
+}
+
+// Everything queued since the last poll goes out in one go per client.
+static void flush_clients(server_t *server) {
+    for (size_t i = 0; i < server->flushing.size; i++) {
+        client_t *client = server->flushing.items[i];
+
+        client->flushing = false;
+
+        if (client->closing)
+            continue;
+
+        // the flush is left to EPOLLOUT while the socket is full
+        if (server->backend == SERVER_BACKEND_URING)
+            send_queue(server, client);
+        else if (!client->polling_out)
+            flush_client(server, client);
+    }
+
+    server->flushing.size = 0;
+}
+
+// Takes over the accepted fd, closing it on failure.
+static int accept_client(server_t *server, int fd, const struct sockaddr_in *addr, client_t **client) {
+    if (!admission_allow(server->admission, addr)) {
+        LOG(DEBUG, "rejecting connection from %s, too many from that address.", inet_ntoa(addr->sin_addr));
+        close(fd);
         return -1;
+    }
 
-    if (socket_set_non_blocking(fd) == -1)
+    if (server->nclients >= server->max_clients) {
+        LOG(ERROR, "can't accept connection, maximum client count reached.");
+        close(fd);
         return -1;
+    }
 
-    *client = add_client(server, fd);
+    if (!(*client = add_client(server, fd))) {
+        close(fd);
+        return -1;
+    }
 
     LOG(DEBUG, "accepted client (fd = %d)", fd);
 
     return 0;
 }
 
-static client_t *find_client(server_t *server, int fd) {
-    for (int i = 0; i < server->nclients; i++) {
-        if (server->clients[i].fd == fd)
-            return &server->clients[i];
+// Out of fds the pending connection can't be accepted, and stays pending: the
+// listening socket would be reported ready again right away. The spare fd is
+// given up to accept and close it, so a storm at the fd limit is rejected
+// instead of spun on. Returns false if no connection was taken.
+static bool shed_connection(server_t *server) {
+    if (server->spare_fd == -1)
+        server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (server->spare_fd == -1)
+        return false;
+
+    close(server->spare_fd);
+
+    // the io_uring backend's listening socket blocks
+    struct pollfd pfd = {
+        .fd = server->fd,
+        .events = POLLIN
+    };
+
+    int fd = -1;
+
+    if (poll(&pfd, 1, 0) == 1)
+        fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd != -1)
+        close(fd);
+
+    server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return fd != -1;
+}
+
+// Handles a failed accept, err being its errno. Returns false if connections
+// left pending can't be taken for now.
+static bool accept_failed(server_t *server, int err) {
+    bool shed = false;
+
+    if (err == EMFILE || err == ENFILE)
+        shed = shed_connection(server);
+
+    // the same error tends to come up for every pending connection
+    if (server->now - server->accept_error_at < ACCEPT_ERROR_INTERVAL) {
+        server->accept_errors++;
     }
+    else {
+        LOG(ERROR, "accept() failed: %s%s", strerror(err), shed ? ", connection dropped" : "");
 
-    return NULL;
+        if (server->accept_errors) {
+            LOG(ERROR, "%u more accepts failed since.", server->accept_errors);
+        }
+
+        server->accept_error_at = server->now;
+        server->accept_errors = 0;
+    }
+
+    return shed || err == ECONNABORTED || err == EPERM;
 }
 
-poll_status server_handle_poll_revents(server_t *server, client_t **client) {
-    if (server->revent_idx >= server->nrevents)
-        return POLL_TIMEOUT;
+// Accepts whatever is pending on the listening socket before going on with
+// the other events, one connection per call.
+static poll_status accept_pending(server_t *server, client_t **client) {
+    while (server->accepting) {
+        struct sockaddr_in addr;
+        const int fd = socket_accept(server->fd, &addr);
 
-    const struct epoll_event *revent = &server->revents[server->revent_idx++];
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && accept_failed(server, errno))
+                continue;
 
-    if (revent->events & EPOLLERR)
-        return POLL_ERROR;
+            // drained, or accept4() keeps failing, the next event tells either way
+            server->accepting = false;
+            break;
+        }
 
-    if (revent->data.fd == server->fd) {
-        if (server_accept(server, client) == -1)
-            return POLL_ERROR;
+        // a rejected connection must not stop the draining
+        if (accept_client(server, fd, &addr, client) == 0)
+            return POLL_NEW_CONNECTION;
+    }
+
+    return POLL_TIMEOUT;
+}
+
+static client_t *find_client(server_t *server, uint64_t handle) {
+    const int fd = handle_fd(handle);
 
+    if ((size_t)fd >= server->fd_table_size)
+        return NULL;
+
+    client_t *client = server->fd_table[fd];
+
+    if (!client || client->generation != handle_generation(handle) || client->closing)
+        return NULL;
+
+    return client;
+}
+
+static poll_status server_handle_poll_revents(server_t *server, client_t **client) {
+    if (accept_pending(server, client) == POLL_NEW_CONNECTION)
         return POLL_NEW_CONNECTION;
+
+    while (server->revent_idx < server->nrevents) {
+        const struct epoll_event *revent = &server->revents[server->revent_idx++];
+
+        if (revent->data.u64 == make_handle(server->fd, 0)) {
+            if (revent->events & EPOLLERR)
+                return POLL_ERROR;
+
+            server->accepting = true;
+
+            if (accept_pending(server, client) == POLL_NEW_CONNECTION)
+                return POLL_NEW_CONNECTION;
+
+            continue;
+        }
+
+        LOG(DEBUG, "revent->fd = %d", handle_fd(revent->data.u64));
+
+        *client = find_client(server, revent->data.u64);
+
+        // the client was removed earlier in this batch of events
+        if (*client == NULL)
+            continue;
+
+        if (revent->events & (EPOLLERR | EPOLLRDHUP)) {
+            close_client(server, *client);
+
+            return POLL_DISCONNECT;
+        }
+
+        if (revent->events & EPOLLOUT && flush_client(server, *client) == -1)
+            continue;
+
+        if (revent->events & (EPOLLIN | EPOLLHUP))
+            return POLL_RECEIVED_DATA;
     }
 
-    LOG(DEBUG, "revent->fd = %d", revent->data.fd);
+    return POLL_TIMEOUT;
+}
 
-    *client = find_client(server, revent->data.fd);
+// Looks up the client of a request, closing clients included since their
+// requests still complete.
+static client_t *request_client(server_t *server, uint64_t user_data) {
+    const int fd = op_fd(user_data);
 
-    if (*client == NULL)
-        return POLL_ERROR;
+    if ((size_t)fd >= server->fd_table_size)
+        return NULL;
 
-    if (revent->events & EPOLLRDHUP) {
-        remove_client(server, *client);
+    client_t *client = server->fd_table[fd];
+
+    if (!client || client->generation != handle_generation(user_data))
+        return NULL;
+
+    return client;
+}
+
+// Bookkeeping of a request that won't complete again. Returns its client, if
+// it has one.
+static client_t *complete_request(server_t *server, const struct io_uring_cqe *cqe) {
+    const unsigned op = op_type(cqe->user_data);
+    const bool done = !(cqe->flags & IORING_CQE_F_MORE);
+
+    if (done)
+        server->inflight--;
+
+    if (op != URING_OP_RECV && op != URING_OP_SEND)
+        return NULL;
+
+    client_t *client = request_client(server, cqe->user_data);
+
+    if (!client)
+        return NULL;
+
+    if (done)
+        client->inflight--;
+
+    if (op == URING_OP_RECV && done)
+        client->receiving = false;
+    else if (op == URING_OP_SEND)
+        client->sending--;
+
+    return client;
+}
+
+static poll_status handle_recv(server_t *server, const struct io_uring_cqe *cqe, client_t **client) {
+    client_t *c = complete_request(server, cqe);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        const uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (c && !c->closing && cqe->res > 0)
+            socket_buffer_append(&c->rx, uring_buffer(&server->uring, bid), cqe->res);
+
+        uring_recycle_buffer(&server->uring, bid);
+    }
+
+    if (!c || c->closing)
+        return POLL_TIMEOUT;
+
+    // only cancel_recv() cancels the recv of an open client
+    if (cqe->res <= 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        LOG(DEBUG, "client disconnected (fd = %d)", c->fd);
+        close_client(server, c);
+        *client = c;
 
         return POLL_DISCONNECT;
     }
 
-    if (revent->events & EPOLLIN)
-        return POLL_RECEIVED_DATA;
+    // like the epoll backend stops reading at a full buffer, the recv is
+    // paused until server_read_packet() handled the frames buffered. What it
+    // received meanwhile still arrives, at most URING_BUFFERS chunks.
+    if (!c->rx_paused && c->rx.end - c->rx.start > URING_MAX_RX) {
+        // the next chunk received tries again if the cancel can't be submitted
+        if (!c->receiving || cancel_recv(server, c) == 0)
+            c->rx_paused = true;
+    }
+
+    // a multishot recv ends when the kernel ran out of buffers
+    if (!c->receiving && !c->rx_paused && arm_recv(server, c) == -1) {
+        close_client(server, c);
+        *client = c;
 
-    return POLL_ERROR;
+        return POLL_DISCONNECT;
+    }
+
+    if (cqe->res <= 0)
+        return POLL_TIMEOUT;
+
+    *client = c;
+
+    return POLL_RECEIVED_DATA;
 }
 
-poll_status server_poll(server_t *server, client_t **client) {
-    LOG(DEBUG, "server_poll()");
+static void handle_send(server_t *server, const struct io_uring_cqe *cqe) {
+    client_t *client = complete_request(server, cqe);
 
-    if (!server || !client)
-        return POLL_ERROR;
+    if (!client || client->closing)
+        return;
 
-    poll_status status;
+    if (cqe->res < 0) {
+        if (cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+            LOG(ERROR, "send failed (fd = %d): %s", client->fd, strerror(-cqe->res));
+        }
+
+        close_client(server, client);
+        return;
+    }
+
+    socket_queue_consume(&client->tx, cqe->res);
+
+    // whatever was queued while the chain was in flight goes out next
+    if (!client->sending)
+        send_queue(server, client);
+}
+
+static poll_status server_handle_completions(server_t *server, client_t **client) {
+    struct io_uring_cqe *next;
+
+    while ((next = uring_peek_cqe(&server->uring))) {
+        const struct io_uring_cqe cqe = *next;
+
+        uring_cqe_seen(&server->uring);
+
+        // keep the sends going out while completions keep coming in
+        if (++server->unsubmitted == URING_SUBMIT_BATCH) {
+            server->unsubmitted = 0;
+            uring_submit(&server->uring);
+        }
+
+        switch (op_type(cqe.user_data)) {
+            case URING_OP_ACCEPT:
+                complete_request(server, &cqe);
+
+                // before the accept is armed again, it would take the connection
+                if (cqe.res < 0)
+                    accept_failed(server, -cqe.res);
+
+                if (!(cqe.flags & IORING_CQE_F_MORE) && arm_accept(server) == -1)
+                    return POLL_ERROR;
+
+                if (cqe.res < 0)
+                    continue;
+
+                struct sockaddr_in addr;
+                socklen_t size = sizeof(addr);
+
+                // without the source it can't be rate limited, most likely it
+                // already hung up anyway
+                if (getpeername(cqe.res, (struct sockaddr *)&addr, &size) == -1) {
+                    LOG(DEBUG, "getpeername() failed: %s", strerror(errno));
+                    close(cqe.res);
+                    continue;
+                }
+
+                // a failed accept must not take the whole server down
+                if (accept_client(server, cqe.res, &addr, client) == -1)
+                    continue;
+
+                return POLL_NEW_CONNECTION;
+            case URING_OP_RECV: {
+                const poll_status status = handle_recv(server, &cqe, client);
+
+                if (status != POLL_TIMEOUT)
+                    return status;
+
+                continue;
+            }
+            case URING_OP_SEND:
+                handle_send(server, &cqe);
+                continue;
+            default:
+                complete_request(server, &cqe);
+                continue;
+        }
+    }
+
+    return POLL_TIMEOUT;
+}
 
-    if ((status = server_handle_poll_revents(server, client)) != POLL_TIMEOUT)
-        return status;
+// Waits up to timeout ms for events. Returns whether any arrived, or -1 if
+// waiting failed.
+static int wait_events(server_t *server, int timeout) {
+    if (server->backend == SERVER_BACKEND_URING) {
+        server->unsubmitted = 0;
+
+        if (uring_wait(&server->uring, timeout) == -1) {
+            LOG(ERROR, "io_uring_enter() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        return uring_peek_cqe(&server->uring) != NULL;
+    }
 
     int ret;
 
-    while ((ret = epoll_wait(server->epoll_fd, server->revents, SERVER_MAX_REVENTS, EPOLL_TIMEOUT)) < 0) {
+    while ((ret = epoll_wait(server->epoll_fd, server->revents, server->max_revents, timeout)) < 0) {
         if (errno == EINTR)
             continue;
 
         LOG(ERROR, "epoll_wait() failed: %s", strerror(errno));
 
-        return POLL_ERROR;
+        return -1;
     }
 
-    if (ret == 0)
-        return POLL_TIMEOUT;
-
     server->nrevents = ret;
     server->revent_idx = 0;
 
+    return ret > 0;
+}
+
+static poll_status handle_events(server_t *server, client_t **client) {
+    if (server->backend == SERVER_BACKEND_URING)
+        return server_handle_completions(server, client);
+
     return server_handle_poll_revents(server, client);
 }
 
-int server_read_packet(server_t *server, client_t *client, packet_t **packet) {
+// Returns the next thing to handle, waiting up to timeout ms for one. Run from
+// an event loop, server_fd() tells when to call it with a timeout of 0.
+poll_status server_poll(server_t *server, client_t **client, int timeout) {
+    LOG(DEBUG, "server_poll()");
+
     if (!server || !client)
+        return POLL_ERROR;
+
+    flush_clients(server);
+    expire_clients(server);
+    reap_clients(server);
+
+    poll_status status;
+
+    while ((status = handle_events(server, client)) == POLL_TIMEOUT) {
+        // clients that used up their budget get another turn after the events
+        if ((*client = next_ready(server)))
+            return POLL_RECEIVED_DATA;
+
+        // new events are only looked for, not waited for, while any are left
+        const bool pending = start_ready_round(server);
+        const int ret = wait_events(server, pending ? 0 : timeout);
+
+        if (ret == -1)
+            return POLL_ERROR;
+
+        if (!ret && !pending)
+            return POLL_TIMEOUT;
+    }
+
+    return status;
+}
+
+// Reads what the client sent so far with a single recv(), the complete frames
+// are then taken out with server_read_packet(). Returns -1 if the client is gone.
+int server_receive(server_t *server, client_t *client) {
+    if (!server || !client || client->closing)
         return -1;
 
-    const int ret = socket_read_packet(client->fd, &server->packet);
+    client->budget = server->frame_budget;
 
-    if (ret != SOCK_OK) {
-        if (ret == SOCK_DISCONNECTED) {
-            remove_client(server, client);
-        }
+    // the completion already put the data into rx, and frames left over from
+    // the last turn go first
+    if (server->backend == SERVER_BACKEND_URING || socket_buffer_ready(&client->rx))
+        return 0;
+
+    const int ret = socket_fill(client->fd, &client->rx);
+
+    if (ret == SOCK_DISCONNECTED || ret == SOCK_ERROR) {
+        LOG(DEBUG, "client disconnected (fd = %d)", client->fd);
+        close_client(server, client);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// Re-arms a paused recv once only a partial frame is left buffered. A recv
+// still being cancelled is re-armed by handle_recv() when it completes.
+static int resume_recv(server_t *server, client_t *client) {
+    client->rx_paused = false;
+
+    if (client->receiving)
+        return 0;
+
+    return arm_recv(server, client);
+}
+
+// Hands out the buffered frames one by one, up to the client's budget for this
+// turn. The rest waits for the client's next turn.
+int server_read_packet(server_t *server, client_t *client, packet_t **packet) {
+    if (!server || !client || !packet || client->closing)
+        return -1;
+
+    if (!client->budget) {
+        if (socket_buffer_ready(&client->rx))
+            requeue_client(server, client);
+        else if (client->rx_paused && resume_recv(server, client) == -1)
+            close_client(server, client);
 
         return -1;
     }
 
-    *packet = &server->packet;
+    const int ret = socket_next_packet(&client->rx, packet);
+
+    if (ret == SOCK_ERROR) {
+        // the stream can't be resynchronised after a malformed frame
+        LOG(ERROR, "dropping client (fd = %d) after a malformed packet.", client->fd);
+        close_client(server, client);
+    }
+
+    if (ret == SOCK_AGAIN && client->rx_paused && resume_recv(server, client) == -1)
+        close_client(server, client);
+
+    if (ret != SOCK_OK)
+        return -1;
+
+    client->budget--;
+    client->last_active = server->now;
+
+    return 0;
+}
+
+// Queues a reference to the frame, it's sent on the next server_poll() together
+// with everything else queued for the client until then.
+int server_send(server_t *server, client_t *client, wirebuf_t *buf) {
+    if (!server || !client || !buf || client->closing)
+        return -1;
+
+    socket_queue_push(&client->tx, buf);
+
+    // a client that can't keep up must not grow its queue without bound
+    if (client->tx.size > server->max_queue) {
+        LOG(WARNING, "dropping client (fd = %d), more than %zu bytes queued.", client->fd, server->max_queue);
+        close_client(server, client);
+        return -1;
+    }
+
+    if (!client->flushing) {
+        client->flushing = true;
+        list_push(&server->flushing, client);
+    }
 
     return 0;
 }
 
 int server_send_packet(server_t *server, client_t *client, packet_t *packet) {
-    if (!server || !client)
+    if (!server || !client || !packet)
         return -1;
 
-    return socket_send_packet(client->fd, packet);
+    wirebuf_t *buf = wirebuf_from_packet(packet);
+
+    const int ret = server_send(server, client, buf);
+
+    wirebuf_unref(buf);
+
+    return ret;
+}
+
+// Cancels every request and waits for them, so the kernel is done with the
+// buffers before they're freed.
+static void drain_uring(server_t *server) {
+    struct io_uring_sqe *sqe = get_sqe(server);
+
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = make_op(URING_OP_CANCEL, 0, 0);
+
+        server->inflight++;
+    }
+
+    while (server->inflight) {
+        struct io_uring_cqe *cqe;
+
+        if (uring_wait(&server->uring, DRAIN_TIMEOUT) == -1 || !(cqe = uring_peek_cqe(&server->uring))) {
+            LOG(WARNING, "%zu io_uring requests didn't complete.", server->inflight);
+            return;
+        }
+
+        do {
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                uring_recycle_buffer(&server->uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+            complete_request(server, cqe);
+            uring_cqe_seen(&server->uring);
+        } while ((cqe = uring_peek_cqe(&server->uring)));
+    }
 }
 
 void server_close(server_t *server) {
     if (!server)
         return;
 
+    if (server->backend == SERVER_BACKEND_URING && server->uring.fd != -1)
+        drain_uring(server);
+
+    server->flushing.size = 0;
+
+    reap_clients(server);
+
+    while (server->nclients)
+        remove_client(server, server->clients[0]);
+
     close(server->fd);
+    close(server->spare_fd);
     close(server->epoll_fd);
-
+    uring_free(&server->uring);
+    admission_free(&server->own_admission);
+
+    free(server->clients);
+    free(server->revents);
+    free(server->ready.items);
+    free(server->requeued.items);
+    free(server->flushing.items);
+    free(server->closing.items);
+    free(server->fd_table);
     free(server);
 }
 
@@ -1,29 +1,96 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include <sys/epoll.h>
 
+#include "admission.h"
 #include "packets.h"
+#include "socket.h"
+#include "timewheel.h"
+#include "uring.h"
 
-#define SERVER_MAX_CLIENTS 32
-#define SERVER_MAX_REVENTS 4
+#define SERVER_DEFAULT_MAX_CLIENTS 1024
+#define SERVER_DEFAULT_MAX_QUEUE (1024 * 1024) // bytes
+#define SERVER_DEFAULT_REVENTS 64
+#define SERVER_DEFAULT_FRAME_BUDGET 16 // frames handled per client and turn
+#define SERVER_DEFAULT_BACKLOG 4096
+#define SERVER_DEFAULT_IDLE_TIMEOUT 120 // s without a frame before a client is dropped
 
 typedef struct {
     int fd;
+    uint32_t generation;
+    size_t idx;
+    uint32_t max_frame_size; // 0 until the client sent PACKET_TYPE_HELLO
+    socket_buffer rx;
+    socket_queue tx;
+    bool polling_out;  // EPOLLOUT is requested while tx isn't empty
+    bool flushing;     // tx is flushed on the next server_poll()
+    bool closing;      // removed on the next server_poll()
+    bool receiving;    // a multishot recv is armed, io_uring only
+    bool rx_paused;    // not re-armed until rx drained, io_uring only
+    bool cancel_pending; // closing, but its requests weren't cancelled yet, io_uring only
+    bool ready;        // queued for another turn, see server_read_packet()
+    size_t budget;     // frames left to handle in this turn
+    unsigned sending;  // linked sends in flight, io_uring only
+    unsigned inflight; // io_uring requests not completed yet, freed after them
+    wheel_timer idle;  // expires once idle_timeout passed since last_active
+    uint64_t last_active; // s, monotonic
+    void *data;        // owned by the server's user, see server_set_close_cb()
 } client_t;
 
+typedef struct {
+    client_t **items;
+    size_t size;
+    size_t cap;
+} client_list;
+
+typedef void (*server_close_cb)(client_t *client, void *arg);
+
+typedef enum {
+    SERVER_BACKEND_EPOLL,
+    SERVER_BACKEND_URING
+} server_backend;
+
 typedef struct {
     int fd;
+    server_backend backend;
     int epoll_fd;
-    client_t clients[SERVER_MAX_CLIENTS];
-    struct epoll_event revents[SERVER_MAX_REVENTS];
+    uring_t uring;
+    size_t inflight; // io_uring requests not completed yet
+    unsigned unsubmitted; // completions handled since the last submit
+    client_t **clients;
+    size_t nclients;
+    size_t clients_cap;
+    size_t max_clients;
+    size_t max_queue;
+    client_list flushing;
+    client_list closing;
+    server_close_cb close_cb;
+    void *close_cb_arg;
+    client_t **fd_table;
+    size_t fd_table_size;
+    uint32_t generation;
+    struct epoll_event *revents;
+    int max_revents;
     int revent_idx;
     int nrevents;
-    size_t nclients;
-    packet_t packet;
+    bool accepting; // connections may be pending on fd
+    int spare_fd;   // given up to shed a connection once out of fds
+    uint64_t accept_error_at;  // s, when a failed accept was last logged
+    unsigned accept_errors;    // failed since, not logged
+    size_t frame_budget;
+    client_list ready; // clients with frames left over, in this round
+    size_t ready_idx;
+    client_list requeued; // and those for the next round
+    admission_t *admission; // own_admission unless shared, see server_set_admission()
+    admission_t own_admission;
+    timewheel_t idle_wheel; // ticks of 1 s
+    unsigned idle_timeout;  // s, 0 never drops idle clients
+    uint64_t now;           // s, monotonic, as of the last server_poll()
 } server_t;
 
 typedef enum {
@@ -34,12 +101,19 @@ typedef enum {
     POLL_ERROR
 } poll_status;
 
-server_t *server_new();
+server_t *server_new(size_t max_clients, size_t max_queue, server_backend backend);
 int server_init(server_t *server);
-int server_listen(server_t *server, unsigned short port);
-int server_accept(server_t *server, client_t **client);
-poll_status server_poll(server_t *server, client_t **client);
+void server_raise_fd_limit(size_t max_clients);
+void server_set_admission(server_t *server, admission_t *admission);
+void server_set_batch(server_t *server, int max_revents, size_t frame_budget);
+void server_set_idle_timeout(server_t *server, unsigned seconds);
+void server_set_close_cb(server_t *server, server_close_cb cb, void *arg);
+int server_listen(server_t *server, unsigned short port, int backlog);
+int server_fd(server_t *server);
+poll_status server_poll(server_t *server, client_t **client, int timeout);
+int server_receive(server_t *server, client_t *client);
 int server_read_packet(server_t *server, client_t *client, packet_t **packet);
+int server_send(server_t *server, client_t *client, wirebuf_t *buf);
 int server_send_packet(server_t *server, client_t *client, packet_t *packet);
 void server_close(server_t *server);
 
@@ -0,0 +1,52 @@
+#include "snapshot.h"
+
+#include <stdlib.h>
+
+#include "mem.h"
+
+// Takes over the peers, leaving the table empty. The changes are computed
+// against prev, if any.
+snapshot_t *snapshot_new(peertable_t *peers, const snapshot_t *prev) {
+    snapshot_t *snapshot = mem_zalloc(sizeof(snapshot_t));
+
+    atomic_init(&snapshot->refs, 1);
+    atomic_init(&snapshot->next, NULL);
+
+    snapshot->peers = *peers;
+    peertable_init(peers);
+
+    if (prev)
+        diff_peers(&prev->peers, &snapshot->peers, &snapshot->changes);
+
+    return snapshot;
+}
+
+snapshot_t *snapshot_ref(snapshot_t *snapshot) {
+    atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+
+    return snapshot;
+}
+
+void snapshot_unref(snapshot_t *snapshot) {
+    // freeing a snapshot drops its reference to the next one, do it in a loop
+    // rather than recursing down a long chain
+    while (snapshot && atomic_fetch_sub_explicit(&snapshot->refs, 1, memory_order_acq_rel) == 1) {
+        snapshot_t *next = atomic_load_explicit(&snapshot->next, memory_order_acquire);
+
+        peertable_free(&snapshot->peers);
+        diff_free(&snapshot->changes);
+        free(snapshot);
+
+        snapshot = next;
+    }
+}
+
+// Makes snapshot the successor of prev, visible to every reader. The reference
+// the caller holds on snapshot is handed over to prev.
+void snapshot_publish(snapshot_t *prev, snapshot_t *snapshot) {
+    atomic_store_explicit(&prev->next, snapshot, memory_order_release);
+}
+
+snapshot_t *snapshot_next(const snapshot_t *snapshot) {
+    return atomic_load_explicit(&((snapshot_t *)snapshot)->next, memory_order_acquire);
+}
@@ -0,0 +1,29 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdatomic.h>
+
+#include "diff.h"
+#include "peertable.h"
+
+// Immutable state of the device as of one scan, together with the changes
+// since the snapshot before it. Snapshots are published by the scanner thread
+// by linking them to their predecessor through next. A reader holds a
+// reference to the snapshot it's at and follows next without any locking;
+// every snapshot keeps its successor alive, so the chain can't be freed from
+// under a reader lagging behind.
+
+typedef struct snapshot {
+    atomic_uint refs;
+    peertable_t peers;
+    peer_changes_t changes; // removed peers index the previous table, which may be gone
+    struct snapshot *_Atomic next;
+} snapshot_t;
+
+snapshot_t *snapshot_new(peertable_t *peers, const snapshot_t *prev);
+snapshot_t *snapshot_ref(snapshot_t *snapshot);
+void snapshot_unref(snapshot_t *snapshot);
+void snapshot_publish(snapshot_t *prev, snapshot_t *snapshot);
+snapshot_t *snapshot_next(const snapshot_t *snapshot);
+
+#endif
@@ -0,0 +1,142 @@
+#include "subs.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+#define SUBS_MIN_CAP 4
+
+// keymap values must be non-NULL, so positions are stored off by one
+static void *position_value(size_t idx) {
+    return (void *)(uintptr_t)(idx + 1);
+}
+
+static size_t value_position(void *value) {
+    return (uintptr_t)value - 1;
+}
+
+void subs_init(subs_t *subs) {
+    keymap_init(&subs->peers);
+}
+
+void subs_client_init(subs_client *sc, client_t *client) {
+    sc->client = client;
+    sc->subscriptions = NULL;
+    sc->size = 0;
+    sc->cap = 0;
+
+    keymap_init(&sc->index);
+}
+
+bool subs_add(subs_t *subs, subs_client *sc, const wg_key key) {
+    if (keymap_get(&sc->index, key))
+        return false;
+
+    subs_peer *peer = keymap_get(&subs->peers, key);
+
+    if (!peer) {
+        peer = mem_zalloc(sizeof(subs_peer));
+
+        memcpy(peer->key, key, sizeof(wg_key));
+        keymap_put(&subs->peers, peer->key, peer);
+    }
+
+    if (peer->size == peer->cap) {
+        peer->cap = peer->cap ? peer->cap * 2 : SUBS_MIN_CAP;
+        peer->subscribers = mem_realloc(peer->subscribers, peer->cap * sizeof(subs_subscriber));
+    }
+
+    if (sc->size == sc->cap) {
+        sc->cap = sc->cap ? sc->cap * 2 : SUBS_MIN_CAP;
+        sc->subscriptions = mem_realloc(sc->subscriptions, sc->cap * sizeof(subs_subscription));
+    }
+
+    peer->subscribers[peer->size] = (subs_subscriber){sc, sc->size};
+    sc->subscriptions[sc->size] = (subs_subscription){peer, peer->size};
+
+    keymap_put(&sc->index, key, position_value(sc->size));
+
+    peer->size++;
+    sc->size++;
+
+    return true;
+}
+
+static void unlink_subscriber(subs_t *subs, subs_peer *peer, size_t idx) {
+    const size_t last = --peer->size;
+
+    if (idx != last) {
+        const subs_subscriber moved = peer->subscribers[last];
+
+        peer->subscribers[idx] = moved;
+        moved.client->subscriptions[moved.idx].idx = idx;
+    }
+
+    if (peer->size)
+        return;
+
+    keymap_remove(&subs->peers, peer->key);
+
+    free(peer->subscribers);
+    free(peer);
+}
+
+static void unlink_subscription(subs_client *sc, size_t idx) {
+    const size_t last = --sc->size;
+
+    if (idx == last)
+        return;
+
+    const subs_subscription moved = sc->subscriptions[last];
+
+    sc->subscriptions[idx] = moved;
+    moved.peer->subscribers[moved.idx].idx = idx;
+
+    keymap_put(&sc->index, moved.peer->key, position_value(idx));
+}
+
+bool subs_remove(subs_t *subs, subs_client *sc, const wg_key key) {
+    void *value = keymap_remove(&sc->index, key);
+
+    if (!value)
+        return false;
+
+    const size_t idx = value_position(value);
+    const subs_subscription subscription = sc->subscriptions[idx];
+
+    unlink_subscription(sc, idx);
+    unlink_subscriber(subs, subscription.peer, subscription.idx);
+
+    return true;
+}
+
+void subs_remove_client(subs_t *subs, subs_client *sc) {
+    for (size_t i = 0; i < sc->size; i++)
+        unlink_subscriber(subs, sc->subscriptions[i].peer, sc->subscriptions[i].idx);
+
+    free(sc->subscriptions);
+    keymap_free(&sc->index);
+
+    sc->subscriptions = NULL;
+    sc->size = 0;
+    sc->cap = 0;
+}
+
+const subs_peer *subs_find(const subs_t *subs, const wg_key key) {
+    return keymap_get(&subs->peers, key);
+}
+
+void subs_free(subs_t *subs) {
+    keymap_entry *entry;
+
+    keymap_for_each(&subs->peers, entry) {
+        subs_peer *peer = entry->value;
+
+        free(peer->subscribers);
+        free(peer);
+    }
+
+    keymap_free(&subs->peers);
+}
@@ -0,0 +1,55 @@
+#ifndef SUBS_H
+#define SUBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wireguard.h"
+
+#include "keymap.h"
+#include "server.h"
+
+// Inverted index from peer public key to the clients subscribed to changes of
+// its endpoint. Every subscription is linked from both the peer and the client
+// side, so none of the operations has to search a subscriber list.
+
+typedef struct subs_client subs_client;
+
+typedef struct {
+    subs_client *client;
+    size_t idx; // position in the client's subscriptions
+} subs_subscriber;
+
+typedef struct {
+    wg_key key;
+    subs_subscriber *subscribers;
+    size_t size;
+    size_t cap;
+} subs_peer;
+
+typedef struct {
+    subs_peer *peer;
+    size_t idx; // position in the peer's subscribers
+} subs_subscription;
+
+struct subs_client {
+    client_t *client;
+    keymap_t index; // public key -> position in subscriptions + 1
+    subs_subscription *subscriptions;
+    size_t size;
+    size_t cap;
+};
+
+typedef struct {
+    keymap_t peers; // public key -> subs_peer
+} subs_t;
+
+void subs_init(subs_t *subs);
+void subs_client_init(subs_client *sc, client_t *client);
+bool subs_add(subs_t *subs, subs_client *sc, const wg_key key);
+bool subs_remove(subs_t *subs, subs_client *sc, const wg_key key);
+void subs_remove_client(subs_t *subs, subs_client *sc);
+const subs_peer *subs_find(const subs_t *subs, const wg_key key);
+void subs_free(subs_t *subs);
+
+#endif
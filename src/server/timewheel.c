@@ -0,0 +1,110 @@
+#include "timewheel.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define TIMEWHEEL_MASK (TIMEWHEEL_SLOTS - 1)
+#define TIMEWHEEL_SPAN(level) ((uint64_t)1 << (TIMEWHEEL_BITS * (level)))
+
+static void link_timer(wheel_timer **slot, wheel_timer *timer) {
+    timer->next = *slot;
+    timer->pprev = slot;
+
+    if (*slot)
+        (*slot)->pprev = &timer->next;
+
+    *slot = timer;
+}
+
+void timewheel_init(timewheel_t *wheel, uint64_t now) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+
+    wheel->now = now;
+}
+
+// A timer already due expires on the next advance.
+void timewheel_add(timewheel_t *wheel, wheel_timer *timer, uint64_t expires) {
+    timewheel_remove(timer);
+
+    if (expires < wheel->now)
+        expires = wheel->now;
+
+    if (expires - wheel->now >= TIMEWHEEL_SPAN(TIMEWHEEL_LEVELS))
+        expires = wheel->now + TIMEWHEEL_SPAN(TIMEWHEEL_LEVELS) - 1;
+
+    size_t level = 0;
+
+    while (expires - wheel->now >= TIMEWHEEL_SPAN(level + 1))
+        level++;
+
+    timer->expires = expires;
+
+    link_timer(&wheel->slots[level][(expires >> (TIMEWHEEL_BITS * level)) & TIMEWHEEL_MASK], timer);
+}
+
+void timewheel_remove(wheel_timer *timer) {
+    if (!timer->pprev)
+        return;
+
+    *timer->pprev = timer->next;
+
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+bool timewheel_pending(const wheel_timer *timer) {
+    return timer->pprev != NULL;
+}
+
+// Moves the timers of a slot down to the levels below, now that they're due
+// within its span.
+static void cascade(timewheel_t *wheel, size_t level, size_t idx) {
+    wheel_timer *timer = wheel->slots[level][idx];
+
+    wheel->slots[level][idx] = NULL;
+
+    while (timer) {
+        wheel_timer *next = timer->next;
+
+        timer->pprev = NULL;
+        timewheel_add(wheel, timer, timer->expires);
+
+        timer = next;
+    }
+}
+
+// Expires every timer due up to and including tick now. The callback may add
+// the timer again, or any other.
+void timewheel_advance(timewheel_t *wheel, uint64_t now, timewheel_cb cb, void *arg) {
+    while (wheel->now <= now) {
+        const uint64_t tick = wheel->now;
+        const size_t idx = tick & TIMEWHEEL_MASK;
+
+        for (size_t level = 1; level < TIMEWHEEL_LEVELS; level++) {
+            if ((tick >> (TIMEWHEEL_BITS * (level - 1))) & TIMEWHEEL_MASK)
+                break;
+
+            cascade(wheel, level, (tick >> (TIMEWHEEL_BITS * level)) & TIMEWHEEL_MASK);
+        }
+
+        // timers added by the callbacks go to later ticks, even those landing
+        // in this slot again
+        wheel->now = tick + 1;
+
+        wheel_timer *expired = wheel->slots[0][idx];
+        wheel_timer *timer;
+
+        wheel->slots[0][idx] = NULL;
+
+        if (expired)
+            expired->pprev = &expired;
+
+        while ((timer = expired)) {
+            timewheel_remove(timer);
+            cb(timer, arg);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef TIMEWHEEL_H
+#define TIMEWHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMEWHEEL_BITS 6
+#define TIMEWHEEL_SLOTS (1 << TIMEWHEEL_BITS)
+#define TIMEWHEEL_LEVELS 4 // timers up to 64^4 ticks ahead, later ones are clamped
+
+// Hierarchical timing wheel. Timers close to expiring sit in the slots of the
+// first level, one per tick; each further level covers 64 times the span with
+// slots of 64 times the length, and a slot is cascaded down a level once the
+// wheel reaches it. Adding and removing is O(1), expiring O(1) amortised.
+
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev; // NULL while not scheduled
+    uint64_t expires; // tick
+    void *data;
+} wheel_timer;
+
+typedef void (*timewheel_cb)(wheel_timer *timer, void *arg);
+
+typedef struct {
+    wheel_timer *slots[TIMEWHEEL_LEVELS][TIMEWHEEL_SLOTS];
+    uint64_t now; // next tick to expire
+} timewheel_t;
+
+void timewheel_init(timewheel_t *wheel, uint64_t now);
+void timewheel_add(timewheel_t *wheel, wheel_timer *timer, uint64_t expires);
+void timewheel_remove(wheel_timer *timer);
+bool timewheel_pending(const wheel_timer *timer);
+void timewheel_advance(timewheel_t *wheel, uint64_t now, timewheel_cb cb, void *arg);
+
+#endif
@@ -0,0 +1,269 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "mem.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static unsigned load_acquire(const unsigned *p) {
+    return atomic_load_explicit((const _Atomic unsigned *)p, memory_order_acquire);
+}
+
+static void store_release(unsigned *p, unsigned value) {
+    atomic_store_explicit((_Atomic unsigned *)p, value, memory_order_release);
+}
+
+// Multishot recv came with the same kernel as IORING_OP_SEND_ZC, which the
+// probe can tell about while the multishot flags can't be probed.
+static bool probe_ops(int fd) {
+    const unsigned nops = 256;
+    struct io_uring_probe *probe = mem_zalloc(sizeof(*probe) + nops * sizeof(struct io_uring_probe_op));
+    bool ret = false;
+
+    if (sys_register(fd, IORING_REGISTER_PROBE, probe, nops) == 0)
+        ret = probe->ops_len > IORING_OP_SEND_ZC && probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED;
+
+    free(probe);
+
+    return ret;
+}
+
+// Fails with ENOTSUP if the kernel lacks anything the server relies on:
+// multishot accept and recv, provided buffer rings and waiting with a timeout.
+int uring_init(uring_t *ring, unsigned entries, unsigned cq_entries) {
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->fd = -1;
+
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+        .cq_entries = cq_entries
+    };
+
+    if ((ring->fd = sys_setup(entries, &params)) == -1)
+        return -1;
+
+    const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+
+    if ((params.features & needed) != needed || !probe_ops(ring->fd)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // both rings share one mapping
+    ring->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        return -1;
+    }
+
+    ring->cq_ring = ring->sq_ring;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+// Registers nbufs buffers of size bytes each as buffer group group, picked by
+// the kernel for requests with IOSQE_BUFFER_SELECT. nbufs must be a power of 2.
+int uring_setup_buffers(uring_t *ring, uint16_t group, unsigned nbufs, unsigned size) {
+    ring->bufs_size = nbufs * sizeof(struct io_uring_buf);
+    ring->bufs = mmap(NULL, ring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        return -1;
+    }
+
+    ring->buf_data = mem_alloc((size_t)nbufs * size);
+    ring->nbufs = nbufs;
+    ring->buf_size = size;
+    ring->buf_group = group;
+    ring->buf_tail = 0;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)ring->bufs,
+        .ring_entries = nbufs,
+        .bgid = group
+    };
+
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    for (unsigned i = 0; i < nbufs; i++)
+        uring_recycle_buffer(ring, i);
+
+    return 0;
+}
+
+// Returns NULL while the submission queue is full, uring_submit() makes room.
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    if (!uring_sq_space(ring))
+        return NULL;
+
+    const unsigned idx = (*ring->sq_tail + ring->sq_pending++) & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+unsigned uring_sq_space(const uring_t *ring) {
+    return ring->sq_entries - (*ring->sq_tail + ring->sq_pending - load_acquire(ring->sq_head));
+}
+
+// Hands the prepared entries to the kernel, and those a previous call couldn't.
+static unsigned publish(uring_t *ring) {
+    const unsigned tail = *ring->sq_tail + ring->sq_pending;
+
+    store_release(ring->sq_tail, tail);
+    ring->sq_pending = 0;
+
+    return tail - load_acquire(ring->sq_head);
+}
+
+int uring_submit(uring_t *ring) {
+    const unsigned to_submit = publish(ring);
+
+    if (!to_submit)
+        return 0;
+
+    while (sys_enter(ring->fd, to_submit, 0, 0, NULL, 0) == -1) {
+        if (errno == EINTR)
+            continue;
+
+        // the completion queue is backed up, the entries stay queued
+        if (errno == EBUSY || errno == EAGAIN)
+            return 0;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// Submits what is queued and waits up to timeout ms for a completion. Returns
+// 0 on a timeout too, uring_peek_cqe() tells them apart.
+int uring_wait(uring_t *ring, int timeout) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = (timeout % 1000) * 1000000L
+    };
+
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t)(uintptr_t)&ts
+    };
+
+    const unsigned to_submit = publish(ring);
+
+    while (sys_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1) {
+        if (errno == EINTR)
+            continue;
+
+        if (errno == ETIME || errno == EBUSY)
+            return 0;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    const unsigned head = *ring->cq_head;
+
+    if (head == load_acquire(ring->cq_tail))
+        return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+uint8_t *uring_buffer(uring_t *ring, uint16_t bid) {
+    return ring->buf_data + (size_t)bid * ring->buf_size;
+}
+
+// Gives a provided buffer back to the kernel once its data was consumed.
+void uring_recycle_buffer(uring_t *ring, uint16_t bid) {
+    struct io_uring_buf *buf = &ring->bufs->bufs[ring->buf_tail & (ring->nbufs - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+
+    ring->buf_tail++;
+
+    atomic_store_explicit((_Atomic uint16_t *)&ring->bufs->tail, ring->buf_tail, memory_order_release);
+}
+
+// Closing the ring cancels whatever is still in flight, the caller has to have
+// waited for the requests referencing its memory.
+void uring_free(uring_t *ring) {
+    if (ring->fd != -1)
+        close(ring->fd);
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+
+    if (ring->bufs)
+        munmap(ring->bufs, ring->bufs_size);
+
+    free(ring->buf_data);
+
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->fd = -1;
+}
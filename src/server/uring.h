@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper over the raw syscalls: the two rings and one ring of
+// provided receive buffers. Used by a single thread at a time.
+
+typedef struct {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending; // prepared but not submitted yet
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring *bufs; // provided buffers, see uring_setup_buffers()
+    size_t bufs_size;
+    uint8_t *buf_data;
+    unsigned nbufs;
+    unsigned buf_size;
+    uint16_t buf_group;
+    uint16_t buf_tail;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries, unsigned cq_entries);
+int uring_setup_buffers(uring_t *ring, uint16_t group, unsigned nbufs, unsigned size);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+unsigned uring_sq_space(const uring_t *ring);
+int uring_submit(uring_t *ring);
+int uring_wait(uring_t *ring, int timeout);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+uint8_t *uring_buffer(uring_t *ring, uint16_t bid);
+void uring_recycle_buffer(uring_t *ring, uint16_t bid);
+void uring_free(uring_t *ring);
+
+#endif
@@ -0,0 +1,124 @@
+// Sends a peer set of several bulk frames through a socket with a small send
+// buffer, followed by a keepalive, and checks that every frame arrives whole
+// and in order once the receiver reads and the client flushes on EPOLLOUT.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "packets.h"
+#include "socket.h"
+#include "test.h"
+
+#define NPEERS 10000
+#define SNDBUF_SIZE 4096
+#define MAX_ROUNDS 100000
+
+static int send_peers(client_t *client) {
+    const uint32_t capacity = packet_bulk_capacity(PACKET_TYPE_ENDPOINT_INFO_BULK_REQ, client->max_frame_size);
+
+    for (size_t i = 0; i < NPEERS; i += capacity) {
+        const uint32_t count = NPEERS - i < capacity ? NPEERS - i : capacity;
+        packet_t *packet = PACKET_NEW_BULK(ENDPOINT_INFO_BULK_REQ, count);
+
+        for (uint32_t j = 0; j < count; j++)
+            test_make_key(packet->endpoint_info_bulk_req.public_keys[j], i + j);
+
+        const int ret = client_send_packet(client, packet);
+
+        free(packet);
+
+        CHECK(ret == 0);
+        CHECK(client->connected);
+    }
+
+    packet_t *packet = PACKET_NEW(KEEPALIVE);
+    const int ret = client_send_packet(client, packet);
+
+    free(packet);
+
+    CHECK(ret == 0);
+    CHECK(client->connected);
+
+    return 0;
+}
+
+int main(void) {
+    int fds[2];
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    const int sndbuf = SNDBUF_SIZE;
+
+    CHECK(setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+    CHECK(socket_set_non_blocking(fds[0]) == 0);
+    CHECK(socket_set_non_blocking(fds[1]) == 0);
+
+    client_t *client = client_new();
+
+    client->fd = fds[0];
+    client->connected = true;
+    client->max_frame_size = PACKET_MAX_FRAME_SIZE;
+
+    CHECK(send_peers(client) == 0);
+
+    // the socket can't have taken all of it yet
+    CHECK(client_pending(client));
+
+    socket_buffer rx = {};
+    size_t received = 0;
+    size_t frames = 0;
+    bool keepalive = false;
+
+    for (int round = 0; !keepalive; round++) {
+        CHECK(round < MAX_ROUNDS);
+
+        const int ret = socket_fill(fds[1], &rx);
+
+        CHECK(ret == SOCK_OK || ret == SOCK_AGAIN);
+
+        packet_t *packet;
+
+        while (socket_next_packet(&rx, &packet) == SOCK_OK) {
+            CHECK(!keepalive);
+
+            if (packet->header.type == PACKET_TYPE_KEEPALIVE) {
+                CHECK(received == NPEERS);
+                keepalive = true;
+                continue;
+            }
+
+            CHECK(packet->header.type == PACKET_TYPE_ENDPOINT_INFO_BULK_REQ);
+
+            for (uint32_t i = 0; i < packet->endpoint_info_bulk_req.count; i++) {
+                wg_key key;
+
+                test_make_key(key, received++);
+
+                CHECK(memcmp(packet->endpoint_info_bulk_req.public_keys[i], key, sizeof(wg_key)) == 0);
+            }
+
+            frames++;
+        }
+
+        if (client_pending(client))
+            CHECK(client_check_events(client, EPOLLOUT) == CLIENT_OK);
+
+        CHECK(client->connected);
+    }
+
+    CHECK(frames > 1);
+    CHECK(!client_pending(client));
+
+    socket_buffer_free(&rx);
+    client_close(client);
+    client_free(client);
+    close(fds[1]);
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+// Converts a device to a peertable and back and compares the peers field by
+// field, with IPv4, IPv6 and unset endpoints. Also checks that a table whose
+// device size would overflow returns NULL.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "wireguard.h"
+
+#include "peertable.h"
+#include "test.h"
+
+#define NPEERS 4
+
+// Peers out of key order, the way a dump may return them, with whatever else
+// the kernel reports set as well.
+static void make_device(wg_device *device, wg_peer *peers) {
+    memset(device, 0, sizeof(*device));
+    memset(peers, 0, NPEERS * sizeof(wg_peer));
+
+    strcpy(device->name, "wgtest0");
+
+    test_make_key(peers[0].public_key, 3);
+    peers[0].endpoint.addr4.sin_family = AF_INET;
+    peers[0].endpoint.addr4.sin_port = htons(51820);
+    inet_pton(AF_INET, "192.0.2.1", &peers[0].endpoint.addr4.sin_addr);
+
+    test_make_key(peers[1].public_key, 1);
+    peers[1].endpoint.addr6.sin6_family = AF_INET6;
+    peers[1].endpoint.addr6.sin6_port = htons(51821);
+    peers[1].endpoint.addr6.sin6_scope_id = 2;
+    inet_pton(AF_INET6, "2001:db8::1", &peers[1].endpoint.addr6.sin6_addr);
+
+    // no endpoint known yet
+    test_make_key(peers[2].public_key, 4);
+
+    test_make_key(peers[3].public_key, 2);
+    peers[3].endpoint.addr6.sin6_family = AF_INET6;
+    peers[3].endpoint.addr6.sin6_port = htons(1);
+    inet_pton(AF_INET6, "::ffff:198.51.100.7", &peers[3].endpoint.addr6.sin6_addr);
+
+    for (int i = 0; i < NPEERS; i++) {
+        peers[i].flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL;
+        peers[i].persistent_keepalive_interval = 25;
+        peers[i].rx_bytes = 1000 * i;
+        peers[i].next_peer = i + 1 < NPEERS ? &peers[i + 1] : NULL;
+    }
+
+    device->first_peer = &peers[0];
+    device->last_peer = &peers[NPEERS - 1];
+}
+
+static const wg_peer *find_peer(const wg_peer *peers, const wg_key key) {
+    for (int i = 0; i < NPEERS; i++) {
+        if (memcmp(peers[i].public_key, key, sizeof(wg_key)) == 0)
+            return &peers[i];
+    }
+
+    return NULL;
+}
+
+static int endpoints_equal(const wg_endpoint *a, const wg_endpoint *b) {
+    if (a->addr.sa_family != b->addr.sa_family)
+        return 0;
+
+    switch (a->addr.sa_family) {
+        case AF_INET:
+            return memcmp(&a->addr4, &b->addr4, sizeof(a->addr4)) == 0;
+        case AF_INET6:
+            return memcmp(&a->addr6, &b->addr6, sizeof(a->addr6)) == 0;
+        default:
+            return 1;
+    }
+}
+
+static int test_round_trip(void) {
+    wg_device source;
+    wg_peer source_peers[NPEERS];
+
+    make_device(&source, source_peers);
+
+    peertable_t table;
+
+    peertable_init(&table);
+    peertable_from_device(&table, &source);
+
+    CHECK(table.size == NPEERS);
+
+    for (size_t i = 0; i < table.size; i++) {
+        const wg_peer *peer = find_peer(source_peers, table.keys[i]);
+
+        CHECK(peer);
+        CHECK(endpoints_equal(&table.endpoints[i], &peer->endpoint));
+        CHECK(peertable_find(&table, peer->public_key) == i);
+
+        if (i)
+            CHECK(memcmp(table.keys[i - 1], table.keys[i], sizeof(wg_key)) < 0);
+    }
+
+    wg_device *device = peertable_to_device(&table, source.name);
+
+    CHECK(device);
+    CHECK(strcmp(device->name, source.name) == 0);
+    CHECK(device->flags == 0);
+
+    wg_peer *peer;
+    size_t i = 0;
+
+    wg_for_each_peer(device, peer) {
+        CHECK(i < table.size);
+
+        const wg_peer *expected = find_peer(source_peers, peer->public_key);
+
+        CHECK(expected);
+        CHECK(memcmp(peer->public_key, table.keys[i], sizeof(wg_key)) == 0);
+        CHECK(endpoints_equal(&peer->endpoint, &expected->endpoint));
+
+        // only the endpoint is set, nothing else the kernel reported
+        CHECK(peer->flags == WGPEER_HAS_PUBLIC_KEY);
+        CHECK(peer->persistent_keepalive_interval == 0);
+        CHECK(peer->first_allowedip == NULL);
+
+        if (!peer->next_peer)
+            CHECK(device->last_peer == peer);
+
+        i++;
+    }
+
+    CHECK(i == NPEERS);
+
+    wg_free_device(device);
+    peertable_free(&table);
+
+    return 0;
+}
+
+static int test_empty(void) {
+    peertable_t table;
+
+    peertable_init(&table);
+
+    wg_device *device = peertable_to_device(&table, "wgtest0");
+
+    CHECK(device);
+    CHECK(device->first_peer == NULL);
+    CHECK(device->last_peer == NULL);
+
+    wg_free_device(device);
+
+    return 0;
+}
+
+// The size is checked before anything is allocated or read from the table, so
+// it doesn't need arrays that large.
+static int test_overflow(void) {
+    peertable_t table;
+
+    peertable_init(&table);
+
+    table.size = SIZE_MAX / sizeof(wg_peer);
+    errno = 0;
+
+    CHECK(peertable_to_device(&table, "wgtest0") == NULL);
+    CHECK(errno == ENOMEM);
+
+    return 0;
+}
+
+int main(void) {
+    if (test_round_trip() || test_empty() || test_overflow())
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Splits a resync across several frames and checks which sequence number the
+// next resync starts from, with the connection dropped between the answers
+// and with all of them received.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packets.h"
+#include "resync.h"
+#include "socket.h"
+#include "test.h"
+#include "wirebuf.h"
+
+#define EPOCH 0x1234
+#define FRAMES 3
+
+// Starts from a sequence number taken on an earlier connection.
+static void resync_at(resync_t *resync, uint64_t seq) {
+    resync_init(resync);
+    resync_receive(resync, EPOCH, seq);
+    resync_commit(resync);
+}
+
+static int test_dropped_between_answers(void) {
+    resync_t resync;
+
+    resync_at(&resync, 10);
+    resync_start(&resync, FRAMES);
+
+    resync_receive(&resync, EPOCH, 20);
+
+    CHECK(!resync_commit(&resync));
+    CHECK(resync.epoch == EPOCH);
+    CHECK(resync.seq == 10);
+
+    resync_disconnected(&resync);
+
+    // the peers of the unanswered frames may have changed before 20
+    CHECK(resync.epoch == 0);
+    CHECK(resync.seq == 0);
+
+    // nothing is left over for the next connection
+    resync_receive(&resync, EPOCH, 30);
+
+    CHECK(resync_commit(&resync));
+    CHECK(resync.seq == 30);
+
+    return 0;
+}
+
+static int test_all_answered(void) {
+    resync_t resync;
+
+    resync_at(&resync, 10);
+    resync_start(&resync, FRAMES);
+
+    for (int i = 0; i < FRAMES; i++) {
+        CHECK(!resync_commit(&resync));
+
+        resync_receive(&resync, EPOCH, 20 + i);
+    }
+
+    CHECK(resync_commit(&resync));
+    CHECK(resync.epoch == EPOCH);
+    CHECK(resync.seq == 20 + FRAMES - 1);
+
+    resync_disconnected(&resync);
+
+    CHECK(resync.seq == 20 + FRAMES - 1);
+
+    return 0;
+}
+
+static int test_missed(void) {
+    resync_t resync;
+
+    resync_at(&resync, 10);
+    resync_miss(&resync);
+    resync_receive(&resync, EPOCH, 20);
+
+    CHECK(resync_commit(&resync));
+    CHECK(resync.epoch == 0);
+    CHECK(resync.seq == 0);
+
+    return 0;
+}
+
+// The count of frames following goes over the wire with the request.
+static int test_more_on_wire(void) {
+    packet_t *packet = PACKET_NEW_BULK(RESYNC_REQ, 1);
+
+    test_make_key(packet_bulk_keys(packet)[0], 1);
+
+    packet->resync_req.more = FRAMES - 1;
+    packet->resync_req.epoch = EPOCH;
+    packet->resync_req.seq = 10;
+
+    wirebuf_t *buf = wirebuf_from_packet(packet);
+    socket_buffer rx = {};
+
+    free(packet);
+
+    socket_buffer_append(&rx, buf->data, buf->size);
+    wirebuf_unref(buf);
+
+    CHECK(socket_next_packet(&rx, &packet) == SOCK_OK);
+    CHECK(packet->header.type == PACKET_TYPE_RESYNC_REQ);
+    CHECK(packet->resync_req.count == 1);
+    CHECK(packet->resync_req.more == FRAMES - 1);
+    CHECK(packet->resync_req.epoch == EPOCH);
+    CHECK(packet->resync_req.seq == 10);
+
+    socket_buffer_free(&rx);
+
+    return 0;
+}
+
+int main(void) {
+    if (test_dropped_between_answers() || test_all_answered() || test_missed() || test_more_on_wire())
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wireguard.h"
+
+// Fails the calling function, which returns non-zero on failure.
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+// A public key telling peers apart by id, the keys sort in the order of their
+// ids.
+static inline void test_make_key(wg_key key, size_t id) {
+    memset(key, 0, sizeof(wg_key));
+
+    for (size_t i = 0; i < sizeof(id); i++)
+        key[i] = id >> (8 * (sizeof(id) - 1 - i));
+
+    key[31] = 0x5a;
+}
+
+#endif
@@ -13,6 +13,7 @@
 #include <linux/rtnetlink.h>
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,7 +54,8 @@ enum wgdevice_attribute {
 
 enum wgpeer_flag {
 	WGPEER_F_REMOVE_ME = 1U << 0,
-	WGPEER_F_REPLACE_ALLOWEDIPS = 1U << 1
+	WGPEER_F_REPLACE_ALLOWEDIPS = 1U << 1,
+	WGPEER_F_UPDATE_ONLY = 1U << 2
 };
 enum wgpeer_attribute {
 	WGPEER_A_UNSPEC,
@@ -616,8 +618,8 @@ static ssize_t mnl_socket_sendto(const struct mnl_socket *nl, const void *buf,
 		      (struct sockaddr *) &snl, sizeof(snl));
 }
 
-static ssize_t mnl_socket_recvfrom(const struct mnl_socket *nl, void *buf,
-				   size_t bufsiz)
+static ssize_t mnl_socket_recvfrom_flags(const struct mnl_socket *nl, void *buf,
+					 size_t bufsiz, int flags)
 {
 	ssize_t ret;
 	struct sockaddr_nl addr;
@@ -634,7 +636,7 @@ static ssize_t mnl_socket_recvfrom(const struct mnl_socket *nl, void *buf,
 		.msg_controllen	= 0,
 		.msg_flags	= 0,
 	};
-	ret = recvmsg(nl->fd, &msg, 0);
+	ret = recvmsg(nl->fd, &msg, flags);
 	if (ret == -1)
 		return ret;
 
@@ -649,6 +651,12 @@ static ssize_t mnl_socket_recvfrom(const struct mnl_socket *nl, void *buf,
 	return ret;
 }
 
+static ssize_t mnl_socket_recvfrom(const struct mnl_socket *nl, void *buf,
+				   size_t bufsiz)
+{
+	return mnl_socket_recvfrom_flags(nl, buf, bufsiz, 0);
+}
+
 static int mnl_socket_close(struct mnl_socket *nl)
 {
 	int ret = close(nl->fd);
@@ -677,8 +685,7 @@ static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 	nlh = mnl_nlmsg_put_header(nlg->buf);
 	nlh->nlmsg_type	= id;
 	nlh->nlmsg_flags = flags;
-	nlg->seq = time(NULL);
-	nlh->nlmsg_seq = nlg->seq;
+	nlh->nlmsg_seq = ++nlg->seq;
 
 	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
 	genl->cmd = cmd;
@@ -817,6 +824,7 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 	}
 
 	nlg->portid = mnl_socket_get_portid(nlg->nl);
+	nlg->seq = time(NULL);
 
 	nlh = __mnlg_msg_prepare(nlg, CTRL_CMD_GETFAMILY,
 				 NLM_F_REQUEST | NLM_F_ACK, GENL_ID_CTRL, 1);
@@ -1061,18 +1069,76 @@ cleanup:
 	return ret;
 }
 
-int wg_set_device(wg_device *dev)
+struct dump_state {
+	wg_device *device;
+	unsigned int fields;
+	wg_peer_visitor visit;
+	void *data;
+	wg_peer peer;
+	wg_key last_key;
+	bool has_last;
+	int ret;
+};
+
+/* wg_ctx keeps the generic netlink socket, the resolved family id and the
+ * message buffer around between requests. The socket is dropped after any
+ * failure, so a half-read reply or a reloaded module can't poison the next
+ * request; it is reopened lazily on the next call. */
+struct wg_ctx {
+	struct mnlg_socket *nlg;
+	bool no_update_only;
+	bool dumping;
+	unsigned int generation;
+	struct dump_state dump;
+};
+
+static struct mnlg_socket *wg_ctx_socket(wg_ctx *ctx)
+{
+	if (!ctx->nlg)
+		ctx->nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	return ctx->nlg;
+}
+
+/* Synchronous requests can't share the socket with an asynchronous dump. */
+static struct mnlg_socket *wg_ctx_request_socket(wg_ctx *ctx)
+{
+	if (ctx->dumping) {
+		errno = EBUSY;
+		return NULL;
+	}
+	return wg_ctx_socket(ctx);
+}
+
+static void wg_ctx_reset(wg_ctx *ctx)
+{
+	if (ctx->nlg) {
+		mnlg_socket_close(ctx->nlg);
+		++ctx->generation;
+	}
+	ctx->nlg = NULL;
+	ctx->dumping = false;
+}
+
+wg_ctx *wg_ctx_new(void)
+{
+	return calloc(1, sizeof(wg_ctx));
+}
+
+void wg_ctx_free(wg_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	wg_ctx_reset(ctx);
+	free(ctx);
+}
+
+static int set_device(struct mnlg_socket *nlg, wg_device *dev)
 {
 	int ret = 0;
 	wg_peer *peer = NULL;
 	wg_allowedip *allowedip = NULL;
 	struct nlattr *peers_nest, *peer_nest, *allowedips_nest, *allowedip_nest;
 	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
-
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg)
-		return -errno;
 
 again:
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
@@ -1190,11 +1256,218 @@ send:
 		goto again;
 
 out:
-	mnlg_socket_close(nlg);
+	return ret;
+}
+
+int wg_ctx_set_device(wg_ctx *ctx, wg_device *dev)
+{
+	struct mnlg_socket *nlg = wg_ctx_request_socket(ctx);
+	int ret;
+
+	if (!nlg)
+		return -errno;
+	ret = set_device(nlg, dev);
+	if (ret)
+		wg_ctx_reset(ctx);
+	errno = -ret;
+	return ret;
+}
+
+static int set_endpoints(struct mnlg_socket *nlg, const char *device_name,
+			 const wg_peer_endpoint *endpoints, size_t count, uint32_t flags)
+{
+	const size_t buflen = mnl_ideal_socket_buffer_size();
+	struct nlattr *peers_nest, *peer_nest;
+	struct nlmsghdr *nlh;
+	size_t i = 0, added;
+
+	while (i < count) {
+		nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+		mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
+		peers_nest = mnl_attr_nest_start(nlh, WGDEVICE_A_PEERS);
+		for (added = 0; i < count; ++i) {
+			const wg_peer_endpoint *entry = &endpoints[i];
+			size_t len;
+
+			if (entry->endpoint.addr.sa_family == AF_INET)
+				len = sizeof(entry->endpoint.addr4);
+			else if (entry->endpoint.addr.sa_family == AF_INET6)
+				len = sizeof(entry->endpoint.addr6);
+			else
+				continue;
+
+			peer_nest = mnl_attr_nest_start_check(nlh, buflen, 0);
+			if (!peer_nest)
+				break;
+			if (!mnl_attr_put_check(nlh, buflen, WGPEER_A_PUBLIC_KEY, sizeof(entry->public_key), entry->public_key) ||
+			    !mnl_attr_put_check(nlh, buflen, WGPEER_A_ENDPOINT, len, &entry->endpoint) ||
+			    (flags && !mnl_attr_put_u32_check(nlh, buflen, WGPEER_A_FLAGS, flags))) {
+				mnl_attr_nest_cancel(nlh, peer_nest);
+				break;
+			}
+			mnl_attr_nest_end(nlh, peer_nest);
+			++added;
+		}
+		mnl_attr_nest_end(nlh, peers_nest);
+		if (!added) {
+			/* Only the skipped entries were left, or one doesn't
+			 * fit even into an empty message. */
+			if (i < count)
+				return -EMSGSIZE;
+			break;
+		}
+
+		if (mnlg_socket_send(nlg, nlh) < 0)
+			return -errno;
+		errno = 0;
+		if (mnlg_socket_recv_run(nlg, NULL, NULL) < 0)
+			return errno ? -errno : -EINVAL;
+	}
+	return 0;
+}
+
+/* Only sends the public key and endpoint of each peer, so the kernel doesn't
+ * have to reprocess keys, keepalive intervals and allowed ips. Peers that no
+ * longer exist are not recreated on kernels that support WGPEER_F_UPDATE_ONLY. */
+int wg_ctx_set_endpoints(wg_ctx *ctx, const char *device_name,
+			 const wg_peer_endpoint *endpoints, size_t count)
+{
+	struct mnlg_socket *nlg;
+	int ret;
+
+	for (;;) {
+		nlg = wg_ctx_request_socket(ctx);
+		if (!nlg)
+			return -errno;
+		ret = set_endpoints(nlg, device_name, endpoints, count,
+				    ctx->no_update_only ? 0 : WGPEER_F_UPDATE_ONLY);
+		if (!ret)
+			break;
+		wg_ctx_reset(ctx);
+		if (ret != -EOPNOTSUPP || ctx->no_update_only)
+			break;
+		ctx->no_update_only = true;
+	}
+	errno = -ret;
+	return ret;
+}
+
+int wg_set_device(wg_device *dev)
+{
+	wg_ctx ctx = { 0 };
+	int ret = wg_ctx_set_device(&ctx, dev);
+
+	wg_ctx_reset(&ctx);
 	errno = -ret;
 	return ret;
 }
 
+/* An arena hands out zeroed memory from a chain of chunks and releases all of
+ * it at once. After a reset, the chunks are merged into one of their combined
+ * size, so a dump of the same size as the last one is allocated from a single
+ * contiguous block. */
+#define WG_ARENA_MIN_CHUNK 4096
+#define WG_ARENA_ALIGN (sizeof(max_align_t))
+
+struct wg_arena_chunk {
+	struct wg_arena_chunk *next;
+	size_t size, used;
+	max_align_t data[];
+};
+
+struct wg_arena {
+	struct wg_arena_chunk *chunks;
+	size_t capacity;
+};
+
+static struct wg_arena_chunk *arena_add_chunk(wg_arena *arena, size_t size)
+{
+	struct wg_arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+
+	if (!chunk)
+		return NULL;
+	chunk->next = arena->chunks;
+	chunk->size = size;
+	chunk->used = 0;
+	arena->chunks = chunk;
+	arena->capacity += size;
+	return chunk;
+}
+
+static void arena_free_chunks(wg_arena *arena)
+{
+	struct wg_arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+	arena->capacity = 0;
+}
+
+wg_arena *wg_arena_new(void)
+{
+	return calloc(1, sizeof(wg_arena));
+}
+
+void *wg_arena_alloc(wg_arena *arena, size_t size)
+{
+	struct wg_arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + WG_ARENA_ALIGN - 1) & ~(WG_ARENA_ALIGN - 1);
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = chunk ? chunk->size * 2 : WG_ARENA_MIN_CHUNK;
+
+		while (chunk_size < size)
+			chunk_size *= 2;
+		chunk = arena_add_chunk(arena, chunk_size);
+		if (!chunk)
+			return NULL;
+	}
+	ptr = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	return memset(ptr, 0, size);
+}
+
+void wg_arena_reset(wg_arena *arena)
+{
+	struct wg_arena_chunk *chunk;
+	size_t capacity = arena->capacity;
+
+	if (arena->chunks && arena->chunks->next) {
+		chunk = malloc(sizeof(*chunk) + capacity);
+		if (chunk) {
+			arena_free_chunks(arena);
+			chunk->next = NULL;
+			chunk->size = capacity;
+			arena->chunks = chunk;
+			arena->capacity = capacity;
+		} else {
+			/* allocations only come from the head chunk, the largest one,
+			 * so the older chunks would never be used again */
+			struct wg_arena_chunk *head = arena->chunks;
+
+			arena->chunks = head->next;
+			arena_free_chunks(arena);
+			head->next = NULL;
+			arena->chunks = head;
+			arena->capacity = head->size;
+		}
+	}
+	if (arena->chunks)
+		arena->chunks->used = 0;
+}
+
+void wg_arena_free(wg_arena *arena)
+{
+	if (!arena)
+		return;
+	arena_free_chunks(arena);
+	free(arena);
+}
+
 static int parse_allowedip(const struct nlattr *attr, void *data)
 {
 	wg_allowedip *allowedip = data;
@@ -1221,10 +1494,16 @@ static int parse_allowedip(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
+struct parse_peer_ctx {
+	wg_peer *peer;
+	wg_arena *arena;
+};
+
 static int parse_allowedips(const struct nlattr *attr, void *data)
 {
-	wg_peer *peer = data;
-	wg_allowedip *new_allowedip = calloc(1, sizeof(wg_allowedip));
+	struct parse_peer_ctx *pctx = data;
+	wg_peer *peer = pctx->peer;
+	wg_allowedip *new_allowedip = wg_arena_alloc(pctx->arena, sizeof(wg_allowedip));
 	int ret;
 
 	if (!new_allowedip)
@@ -1259,7 +1538,8 @@ bool wg_key_is_zero(const wg_key key)
 
 static int parse_peer(const struct nlattr *attr, void *data)
 {
-	wg_peer *peer = data;
+	struct parse_peer_ctx *pctx = data;
+	wg_peer *peer = pctx->peer;
 
 	switch (mnl_attr_get_type(attr)) {
 	case WGPEER_A_UNSPEC:
@@ -1306,7 +1586,7 @@ static int parse_peer(const struct nlattr *attr, void *data)
 			peer->tx_bytes = mnl_attr_get_u64(attr);
 		break;
 	case WGPEER_A_ALLOWEDIPS:
-		return mnl_attr_parse_nested(attr, parse_allowedips, peer);
+		return mnl_attr_parse_nested(attr, parse_allowedips, pctx);
 	}
 
 	return MNL_CB_OK;
@@ -1315,7 +1595,8 @@ static int parse_peer(const struct nlattr *attr, void *data)
 static int parse_peers(const struct nlattr *attr, void *data)
 {
 	wg_device *device = data;
-	wg_peer *new_peer = calloc(1, sizeof(wg_peer));
+	wg_peer *new_peer = wg_arena_alloc(device->arena, sizeof(wg_peer));
+	struct parse_peer_ctx pctx = { .peer = new_peer, .arena = device->arena };
 	int ret;
 
 	if (!new_peer)
@@ -1326,7 +1607,7 @@ static int parse_peers(const struct nlattr *attr, void *data)
 		device->last_peer->next_peer = new_peer;
 		device->last_peer = new_peer;
 	}
-	ret = mnl_attr_parse_nested(attr, parse_peer, new_peer);
+	ret = mnl_attr_parse_nested(attr, parse_peer, &pctx);
 	if (!ret)
 		return ret;
 	if (!(new_peer->flags & WGPEER_HAS_PUBLIC_KEY)) {
@@ -1387,7 +1668,7 @@ static int read_device_cb(const struct nlmsghdr *nlh, void *data)
 
 static void coalesce_peers(wg_device *device)
 {
-	wg_peer *old_next_peer, *peer = device->first_peer;
+	wg_peer *peer = device->first_peer;
 
 	while (peer && peer->next_peer) {
 		if (memcmp(peer->public_key, peer->next_peer->public_key, sizeof(wg_key))) {
@@ -1401,29 +1682,21 @@ static void coalesce_peers(wg_device *device)
 			peer->last_allowedip->next_allowedip = peer->next_peer->first_allowedip;
 			peer->last_allowedip = peer->next_peer->last_allowedip;
 		}
-		old_next_peer = peer->next_peer;
-		peer->next_peer = old_next_peer->next_peer;
-		free(old_next_peer);
+		/* the dropped peer goes with the arena */
+		peer->next_peer = peer->next_peer->next_peer;
 	}
 }
 
-int wg_get_device(wg_device **device, const char *device_name)
+static int get_device(struct mnlg_socket *nlg, wg_device **device, const char *device_name, wg_arena *arena)
 {
 	int ret = 0;
 	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
 
-try_again:
-	*device = calloc(1, sizeof(wg_device));
+	wg_arena_reset(arena);
+	*device = wg_arena_alloc(arena, sizeof(wg_device));
 	if (!*device)
-		return -errno;
-
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg) {
-		wg_free_device(*device);
-		*device = NULL;
-		return -errno;
-	}
+		return -ENOMEM;
+	(*device)->arena = arena;
 
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
@@ -1439,18 +1712,323 @@ try_again:
 	coalesce_peers(*device);
 
 out:
-	if (nlg)
-		mnlg_socket_close(nlg);
 	if (ret) {
-		wg_free_device(*device);
-		if (ret == -EINTR)
-			goto try_again;
+		/* a failed dump doesn't take the arena over */
+		wg_arena_reset(arena);
+		*device = NULL;
+	}
+	return ret;
+}
+
+static int ctx_get_device(wg_ctx *ctx, wg_device **device, const char *device_name, wg_arena *arena)
+{
+	struct mnlg_socket *nlg;
+	int ret;
+
+	do {
+		nlg = wg_ctx_request_socket(ctx);
+		if (!nlg) {
+			*device = NULL;
+			return -errno;
+		}
+		ret = get_device(nlg, device, device_name, arena);
+		if (ret)
+			wg_ctx_reset(ctx);
+	} while (ret == -EINTR);
+	errno = -ret;
+	return ret;
+}
+
+/* The device is allocated from an arena of its own, so wg_free_device() is a
+ * single release. */
+int wg_ctx_get_device(wg_ctx *ctx, wg_device **device, const char *device_name)
+{
+	wg_arena *arena = wg_arena_new();
+	int ret;
+
+	if (!arena) {
 		*device = NULL;
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+	ret = ctx_get_device(ctx, device, device_name, arena);
+	if (ret) {
+		wg_arena_free(arena);
+		errno = -ret;
+	}
+	return ret;
+}
+
+/* Allocates the whole device from the arena, which it owns on success; free it
+ * with a single wg_free_device() or get the arena back for the next dump with
+ * wg_device_release(). On failure the arena stays with the caller. */
+int wg_ctx_get_device_arena(wg_ctx *ctx, wg_device **device, const char *device_name, wg_arena *arena)
+{
+	return ctx_get_device(ctx, device, device_name, arena);
+}
+
+int wg_get_device(wg_device **device, const char *device_name)
+{
+	wg_ctx ctx = { 0 };
+	int ret = wg_ctx_get_device(&ctx, device, device_name);
+
+	wg_ctx_reset(&ctx);
+	errno = -ret;
+	return ret;
+}
+
+static int parse_peer_fields(const struct nlattr *attr, void *data)
+{
+	struct dump_state *state = data;
+	wg_peer *peer = &state->peer;
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGPEER_A_PUBLIC_KEY:
+		if (mnl_attr_get_payload_len(attr) == sizeof(peer->public_key)) {
+			memcpy(peer->public_key, mnl_attr_get_payload(attr), sizeof(peer->public_key));
+			peer->flags |= WGPEER_HAS_PUBLIC_KEY;
+		}
+		break;
+	case WGPEER_A_ENDPOINT: {
+		struct sockaddr *addr;
+
+		if (!(state->fields & WGPEER_FIELD_ENDPOINT) || mnl_attr_get_payload_len(attr) < sizeof(*addr))
+			break;
+		addr = mnl_attr_get_payload(attr);
+		if (addr->sa_family == AF_INET && mnl_attr_get_payload_len(attr) == sizeof(peer->endpoint.addr4))
+			memcpy(&peer->endpoint.addr4, addr, sizeof(peer->endpoint.addr4));
+		else if (addr->sa_family == AF_INET6 && mnl_attr_get_payload_len(attr) == sizeof(peer->endpoint.addr6))
+			memcpy(&peer->endpoint.addr6, addr, sizeof(peer->endpoint.addr6));
+		break;
+	}
+	case WGPEER_A_LAST_HANDSHAKE_TIME:
+		if ((state->fields & WGPEER_FIELD_LAST_HANDSHAKE_TIME) &&
+		    mnl_attr_get_payload_len(attr) == sizeof(peer->last_handshake_time))
+			memcpy(&peer->last_handshake_time, mnl_attr_get_payload(attr), sizeof(peer->last_handshake_time));
+		break;
+	case WGPEER_A_RX_BYTES:
+		if ((state->fields & WGPEER_FIELD_TRANSFER) && !mnl_attr_validate(attr, MNL_TYPE_U64))
+			peer->rx_bytes = mnl_attr_get_u64(attr);
+		break;
+	case WGPEER_A_TX_BYTES:
+		if ((state->fields & WGPEER_FIELD_TRANSFER) && !mnl_attr_validate(attr, MNL_TYPE_U64))
+			peer->tx_bytes = mnl_attr_get_u64(attr);
+		break;
+	}
+
+	/* allowed ips and the rest are skipped without being looked at */
+	return MNL_CB_OK;
+}
+
+static int visit_peer(const struct nlattr *attr, void *data)
+{
+	struct dump_state *state = data;
+	int ret;
+
+	memset(&state->peer, 0, sizeof(state->peer));
+	ret = mnl_attr_parse_nested(attr, parse_peer_fields, state);
+	if (!ret)
+		return ret;
+	if (!(state->peer.flags & WGPEER_HAS_PUBLIC_KEY)) {
+		errno = ENXIO;
+		return MNL_CB_ERROR;
+	}
+
+	/* a peer with too many allowed ips for one message is continued in the
+	 * next one, repeating only its public key */
+	if (state->has_last && !memcmp(state->last_key, state->peer.public_key, sizeof(wg_key)))
+		return MNL_CB_OK;
+	memcpy(state->last_key, state->peer.public_key, sizeof(wg_key));
+	state->has_last = true;
+
+	/* the rest of the dump still has to be read off the socket */
+	if (state->ret < 0)
+		return MNL_CB_OK;
+	ret = state->visit(&state->peer, state->data);
+	if (ret < 0)
+		state->ret = ret;
+	return MNL_CB_OK;
+}
+
+static int parse_device_fields(const struct nlattr *attr, void *data)
+{
+	struct dump_state *state = data;
+	wg_device *device = state->device;
+
+	if (mnl_attr_get_type(attr) == WGDEVICE_A_PEERS)
+		return mnl_attr_parse_nested(attr, visit_peer, state);
+	if (!device)
+		return MNL_CB_OK;
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGDEVICE_A_IFINDEX:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
+			device->ifindex = mnl_attr_get_u32(attr);
+		break;
+	case WGDEVICE_A_IFNAME:
+		if (!mnl_attr_validate(attr, MNL_TYPE_STRING)) {
+			strncpy(device->name, mnl_attr_get_str(attr), sizeof(device->name) - 1);
+			device->name[sizeof(device->name) - 1] = '\0';
+		}
+		break;
+	case WGDEVICE_A_PUBLIC_KEY:
+		if (mnl_attr_get_payload_len(attr) == sizeof(device->public_key)) {
+			memcpy(device->public_key, mnl_attr_get_payload(attr), sizeof(device->public_key));
+			device->flags |= WGDEVICE_HAS_PUBLIC_KEY;
+		}
+		break;
+	case WGDEVICE_A_LISTEN_PORT:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U16))
+			device->listen_port = mnl_attr_get_u16(attr);
+		break;
+	case WGDEVICE_A_FWMARK:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
+			device->fwmark = mnl_attr_get_u32(attr);
+		break;
+	}
+
+	return MNL_CB_OK;
+}
+
+static int dump_device_cb(const struct nlmsghdr *nlh, void *data)
+{
+	return mnl_attr_parse(nlh, sizeof(struct genlmsghdr), parse_device_fields, data);
+}
+
+static int dump_start(wg_ctx *ctx, const char *device_name, wg_device *device,
+		      unsigned int fields, wg_peer_visitor visit, void *data)
+{
+	struct mnlg_socket *nlg;
+	struct nlmsghdr *nlh;
+	int ret;
+
+	if (ctx->dumping)
+		return -EBUSY;
+	nlg = wg_ctx_socket(ctx);
+	if (!nlg)
+		return -errno;
+
+	ctx->dump = (struct dump_state){
+		.device = device,
+		.fields = fields,
+		.visit = visit,
+		.data = data
+	};
+
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
+	if (mnlg_socket_send(nlg, nlh) < 0) {
+		ret = -errno;
+		wg_ctx_reset(ctx);
+		return ret;
+	}
+	ctx->dumping = true;
+	return 0;
+}
+
+/* Streams the peers of the device to visit without building the peer list or
+ * allocating anything. If device isn't NULL, it receives everything but the
+ * private key and the peers. A dump interrupted by a concurrent change fails
+ * with -EINTR after some peers may have been visited already; the caller has
+ * to start over. */
+int wg_ctx_dump_peers(wg_ctx *ctx, const char *device_name, wg_device *device,
+		      unsigned int fields, wg_peer_visitor visit, void *data)
+{
+	int ret = dump_start(ctx, device_name, device, fields, visit, data);
+
+	if (ret) {
+		errno = -ret;
+		return ret;
+	}
+	errno = 0;
+	if (mnlg_socket_recv_run(ctx->nlg, dump_device_cb, &ctx->dump) < 0) {
+		ret = errno ? -errno : -EINVAL;
+		wg_ctx_reset(ctx);
+		errno = -ret;
+		return ret;
+	}
+	ctx->dumping = false;
+	errno = -ctx->dump.ret;
+	return ctx->dump.ret;
+}
+
+/* The netlink socket of the context, for polling an asynchronous dump. The
+ * socket is replaced after a failed request, so get it again for every dump. */
+int wg_ctx_fd(wg_ctx *ctx)
+{
+	struct mnlg_socket *nlg = wg_ctx_socket(ctx);
+
+	return nlg ? nlg->nl->fd : -errno;
+}
+
+/* Changes whenever the socket of wg_ctx_fd() is closed. The next socket may get
+ * the same fd, so the generation tells whether a watched fd is still the same
+ * socket. */
+unsigned int wg_ctx_generation(wg_ctx *ctx)
+{
+	return ctx->generation;
+}
+
+/* Sends the request of wg_ctx_dump_peers() without waiting for the reply.
+ * Feed the reply to wg_ctx_dump_peers_step() whenever wg_ctx_fd() becomes
+ * readable. Other requests on the context fail with -EBUSY until the dump is
+ * done or cancelled. */
+int wg_ctx_dump_peers_start(wg_ctx *ctx, const char *device_name, wg_device *device,
+			    unsigned int fields, wg_peer_visitor visit, void *data)
+{
+	int ret = dump_start(ctx, device_name, device, fields, visit, data);
+
+	errno = -ret;
+	return ret;
+}
+
+/* Processes the reply messages that arrived since the last step without ever
+ * blocking, one receive at a time so a long dump doesn't hold up the caller's
+ * other fds. Returns 1 while the dump goes on, 0 once it's complete or
+ * whatever the visitor or the request failed with. */
+int wg_ctx_dump_peers_step(wg_ctx *ctx)
+{
+	struct mnlg_socket *nlg = ctx->nlg;
+	ssize_t len;
+	int ret;
+
+	if (!ctx->dumping) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	len = mnl_socket_recvfrom_flags(nlg->nl, nlg->buf, mnl_ideal_socket_buffer_size(), MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 1;
+		ret = -errno;
+		goto err;
 	}
+	errno = 0;
+	ret = mnl_cb_run2(nlg->buf, len, nlg->seq, nlg->portid, dump_device_cb, &ctx->dump,
+			  mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
+	if (ret < 0) {
+		ret = errno ? -errno : -EINVAL;
+		goto err;
+	}
+	if (ret > MNL_CB_STOP)
+		return 1;
+	ctx->dumping = false;
+	errno = -ctx->dump.ret;
+	return ctx->dump.ret;
+
+err:
+	wg_ctx_reset(ctx);
 	errno = -ret;
 	return ret;
 }
 
+/* Drops a dump in progress along with the socket it's still arriving on. */
+void wg_ctx_dump_peers_cancel(wg_ctx *ctx)
+{
+	if (ctx->dumping)
+		wg_ctx_reset(ctx);
+}
+
 /* first\0second\0third\0forth\0last\0\0 */
 char *wg_list_device_names(void)
 {
@@ -1482,6 +2060,10 @@ void wg_free_device(wg_device *dev)
 
 	if (!dev)
 		return;
+	if (dev->arena) {
+		wg_arena_free(dev->arena);
+		return;
+	}
 	for (peer = dev->first_peer, np = peer ? peer->next_peer : NULL; peer; peer = np, np = peer ? peer->next_peer : NULL) {
 		for (allowedip = peer->first_allowedip, na = allowedip ? allowedip->next_allowedip : NULL; allowedip; allowedip = na, na = allowedip ? allowedip->next_allowedip : NULL)
 			free(allowedip);
@@ -1490,6 +2072,20 @@ void wg_free_device(wg_device *dev)
 	free(dev);
 }
 
+/* Frees an arena backed device, returning its emptied arena for reuse. */
+wg_arena *wg_device_release(wg_device *dev)
+{
+	wg_arena *arena;
+
+	if (!dev || !dev->arena) {
+		wg_free_device(dev);
+		return NULL;
+	}
+	arena = dev->arena;
+	wg_arena_reset(arena);
+	return arena;
+}
+
 static void encode_base64(char dest[static 4], const uint8_t src[static 3])
 {
 	const uint8_t input[] = { (src[0] >> 2) & 63, ((src[0] << 4) | (src[1] >> 4)) & 63, ((src[1] << 2) | (src[2] >> 6)) & 63, src[2] & 63 };
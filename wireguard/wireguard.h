@@ -83,17 +83,57 @@ typedef struct wg_device {
 	uint16_t listen_port;
 
 	struct wg_peer *first_peer, *last_peer;
+
+	struct wg_arena *arena; /* owns the device, its peers and allowed ips */
 } wg_device;
 
+typedef struct wg_peer_endpoint {
+	wg_key public_key;
+	wg_endpoint endpoint;
+} wg_peer_endpoint;
+
+typedef struct wg_ctx wg_ctx;
+typedef struct wg_arena wg_arena;
+
+enum wg_peer_fields {
+	WGPEER_FIELD_ENDPOINT = 1U << 0,
+	WGPEER_FIELD_LAST_HANDSHAKE_TIME = 1U << 1,
+	WGPEER_FIELD_TRANSFER = 1U << 2
+};
+
+/* Called for each peer of a dump with only the public key and the requested
+ * fields filled in; allowed ips and next_peer are always NULL. The peer is
+ * only valid during the call. A negative return stops the visiting. */
+typedef int (*wg_peer_visitor)(const wg_peer *peer, void *data);
+
 #define wg_for_each_device_name(__names, __name, __len) for ((__name) = (__names), (__len) = 0; ((__len) = strlen(__name)); (__name) += (__len) + 1)
 #define wg_for_each_peer(__dev, __peer) for ((__peer) = (__dev)->first_peer; (__peer); (__peer) = (__peer)->next_peer)
 #define wg_for_each_allowedip(__peer, __allowedip) for ((__allowedip) = (__peer)->first_allowedip; (__allowedip); (__allowedip) = (__allowedip)->next_allowedip)
 
 int wg_set_device(wg_device *dev);
 int wg_get_device(wg_device **dev, const char *device_name);
+wg_ctx *wg_ctx_new(void);
+void wg_ctx_free(wg_ctx *ctx);
+int wg_ctx_set_device(wg_ctx *ctx, wg_device *dev);
+int wg_ctx_get_device(wg_ctx *ctx, wg_device **dev, const char *device_name);
+int wg_ctx_get_device_arena(wg_ctx *ctx, wg_device **dev, const char *device_name, wg_arena *arena);
+int wg_ctx_dump_peers(wg_ctx *ctx, const char *device_name, wg_device *device,
+		      unsigned int fields, wg_peer_visitor visit, void *data);
+int wg_ctx_fd(wg_ctx *ctx);
+unsigned int wg_ctx_generation(wg_ctx *ctx);
+int wg_ctx_dump_peers_start(wg_ctx *ctx, const char *device_name, wg_device *device,
+			    unsigned int fields, wg_peer_visitor visit, void *data);
+int wg_ctx_dump_peers_step(wg_ctx *ctx);
+void wg_ctx_dump_peers_cancel(wg_ctx *ctx);
+int wg_ctx_set_endpoints(wg_ctx *ctx, const char *device_name, const wg_peer_endpoint *endpoints, size_t count);
 int wg_add_device(const char *device_name);
 int wg_del_device(const char *device_name);
 void wg_free_device(wg_device *dev);
+wg_arena *wg_device_release(wg_device *dev);
+wg_arena *wg_arena_new(void);
+void *wg_arena_alloc(wg_arena *arena, size_t size);
+void wg_arena_reset(wg_arena *arena);
+void wg_arena_free(wg_arena *arena);
 char *wg_list_device_names(void); /* first\0second\0third\0forth\0last\0\0 */
 void wg_key_to_base64(wg_key_b64_string base64, const wg_key key);
 int wg_key_from_base64(wg_key key, const wg_key_b64_string base64);